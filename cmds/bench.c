@@ -0,0 +1,761 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "../kern/ux_fs.h"
+
+/*
+ * uxbench: time the metadata and data paths of a mounted uxfs.
+ * Each test is a run of single system calls. Every call is timed
+ * on its own, which gives the latency percentiles, and the device
+ * counters from /sys/dev/block are read around the test, after a
+ * syncfs, which gives the I/O it caused. Data is dropped from the
+ * page cache with posix_fadvise before it is read back, so reads
+ * reach the file system.
+ *
+ * Files are at most UX_DIRECT_BLOCKS blocks, and the smallest file
+ * system has only UX_MAXFILES inodes, so the tests work in sets of
+ * at most that many files and repeat them for the given number of
+ * rounds.
+ */
+
+#define MAXFILE (UX_DIRECT_BLOCKS * UX_BSIZE)
+
+struct iocount{
+	long long rd_ios, rd_sect, wr_ios, wr_sect;
+};
+
+struct lat{
+	double *l_v;
+	int     l_n, l_max;
+};
+
+struct result{
+	char           r_name[32];
+	int            r_ops;
+	double         r_secs;
+	long long      r_bytes;
+	double         r_p50, r_p99;
+	struct iocount r_io;
+};
+
+static char *dir;
+static int dirfd_, rounds = 20, nthreads = 4, json;
+static char statpath[64];
+static struct lat lat;
+static struct result cur;
+static struct iocount io0;
+static struct result *base;
+static int nbase;
+static FILE *jout;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char *what)
+{
+	fprintf(stderr, "uxbench: %s: %s\n", what, strerror(errno));
+	exit(1);
+}
+
+static void lat_add(struct lat *l, double t)
+{
+	if(l->l_n == l->l_max){
+		l->l_max = l->l_max ? l->l_max * 2 : 1024;
+		l->l_v = realloc(l->l_v, l->l_max * sizeof(double));
+		if(!l->l_v){
+			die("realloc");
+		}
+	}
+	l->l_v[l->l_n++] = t;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * The counters are those of the device under the mount point. A
+ * FUSE mount has none and reports -1.
+ */
+
+static void io_sample(struct iocount *io)
+{
+	long long v[8];
+	FILE *f;
+
+	memset(io, 0xff, sizeof(*io));
+	if(!statpath[0] || !(f = fopen(statpath, "r"))){
+		return;
+	}
+	if(fscanf(f, "%lld %lld %lld %lld %lld %lld %lld %lld",
+		  &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) == 8){
+		io->rd_ios = v[0];
+		io->rd_sect = v[2];
+		io->wr_ios = v[4];
+		io->wr_sect = v[6];
+	}
+	fclose(f);
+}
+
+static void begin(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void begin(const char *fmt, ...)
+{
+	va_list ap;
+
+	memset(&cur, 0, sizeof(cur));
+	va_start(ap, fmt);
+	vsnprintf(cur.r_name, sizeof(cur.r_name), fmt, ap);
+	va_end(ap);
+	lat.l_n = 0;
+	syncfs(dirfd_);
+	io_sample(&io0);
+}
+
+static const struct result *find_base(const char *name)
+{
+	int i;
+
+	for(i = 0; i < nbase; i++){
+		if(!strcmp(base[i].r_name, name)){
+			return &base[i];
+		}
+	}
+	return NULL;
+}
+
+static void print_json(FILE *f, const struct result *b, double ops_s, double mb_s)
+{
+	fprintf(f, "{\"test\":\"%s\",\"ops\":%d,\"secs\":%.6f,\"ops_s\":%.1f,\"mb_s\":%.3f,"
+		"\"p50_us\":%.1f,\"p99_us\":%.1f,\"rd_ios\":%lld,\"wr_ios\":%lld,"
+		"\"rd_kb\":%lld,\"wr_kb\":%lld",
+		cur.r_name, cur.r_ops, cur.r_secs, ops_s, mb_s, cur.r_p50, cur.r_p99,
+		cur.r_io.rd_ios, cur.r_io.wr_ios,
+		cur.r_io.rd_sect < 0 ? -1 : cur.r_io.rd_sect / 2,
+		cur.r_io.wr_sect < 0 ? -1 : cur.r_io.wr_sect / 2);
+	if(b && b->r_secs > 0){
+		fprintf(f, ",\"base_ops_s\":%.1f,\"base_p99_us\":%.1f", b->r_ops / b->r_secs, b->r_p99);
+	}
+	fprintf(f, "}\n");
+}
+
+static void end(void)
+{
+	struct iocount io1;
+	const struct result *b;
+	double ops_s, mb_s;
+
+	syncfs(dirfd_);
+	io_sample(&io1);
+	if(io0.rd_ios >= 0 && io1.rd_ios >= 0){
+		cur.r_io.rd_ios = io1.rd_ios - io0.rd_ios;
+		cur.r_io.rd_sect = io1.rd_sect - io0.rd_sect;
+		cur.r_io.wr_ios = io1.wr_ios - io0.wr_ios;
+		cur.r_io.wr_sect = io1.wr_sect - io0.wr_sect;
+	}
+	else{
+		memset(&cur.r_io, 0xff, sizeof(cur.r_io));
+	}
+	cur.r_ops = lat.l_n;
+	if(lat.l_n){
+		qsort(lat.l_v, lat.l_n, sizeof(double), cmp_double);
+		cur.r_p50 = lat.l_v[lat.l_n / 2] * 1e6;
+		cur.r_p99 = lat.l_v[(lat.l_n * 99) / 100] * 1e6;
+	}
+	ops_s = cur.r_secs > 0 ? cur.r_ops / cur.r_secs : 0;
+	mb_s = cur.r_secs > 0 ? cur.r_bytes / cur.r_secs / 1e6 : 0;
+	b = find_base(cur.r_name);
+
+	if(json){
+		print_json(stdout, b, ops_s, mb_s);
+	}
+	else{
+		printf("%-20s %7d %10.1f %8.3f %9.1f %9.1f %7lld %7lld",
+		       cur.r_name, cur.r_ops, ops_s, mb_s, cur.r_p50, cur.r_p99,
+		       cur.r_io.rd_ios, cur.r_io.wr_ios);
+		if(b && b->r_secs > 0 && ops_s > 0){
+			printf(" %+6.1f%%", (ops_s * b->r_secs / b->r_ops - 1) * 100);
+		}
+		printf("\n");
+	}
+	if(jout){
+		print_json(jout, b, ops_s, mb_s);
+		fflush(jout);
+	}
+	fflush(stdout);
+}
+
+/*
+ * Time one call. The wall time of a test is the sum of its calls,
+ * so the setup between them is not counted.
+ */
+
+#define TIMED(call) ({						\
+	double __t = now();					\
+	long __r = (call);					\
+	__t = now() - __t;					\
+	lat_add(&lat, __t);					\
+	cur.r_secs += __t;					\
+	__r;							\
+})
+
+static void path(char *buf, int d, const char *pfx, int i)
+{
+	if(d < 0){
+		sprintf(buf, "%s/%s%d", dir, pfx, i);
+	}
+	else{
+		sprintf(buf, "%s/d%d/%s%d", dir, d, pfx, i);
+	}
+}
+
+/*
+ * How many files a test may create, leaving two inodes spare. The
+ * cap keeps runs on other file systems comparable.
+ */
+
+static int free_inodes(void)
+{
+	struct statvfs st;
+
+	if(statvfs(dir, &st) < 0){
+		die(dir);
+	}
+	if(st.f_ffree > UX_MAXFILES){
+		return UX_MAXFILES;
+	}
+	return st.f_ffree > 2 ? st.f_ffree - 2 : 0;
+}
+
+static void drop_cache(int fd)
+{
+	fdatasync(fd);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+/*
+ * create, stat, rename and unlink storms over n files, spread over
+ * ndirs directories or kept in the top one when ndirs is 0.
+ */
+
+static void bench_names(int ndirs)
+{
+	char a[4096], b[4096], tag[8];
+	struct stat st;
+	int n, i, r, d, fd;
+
+	for(d = 0; d < ndirs; d++){
+		sprintf(a, "%s/d%d", dir, d);
+		if(mkdir(a, 0755) < 0){
+			die(a);
+		}
+	}
+	n = free_inodes();
+	if(n < 1){
+		fprintf(stderr, "uxbench: no free inodes\n");
+		goto out;
+	}
+	if(ndirs){
+		sprintf(tag, "%ddir", ndirs);
+	}
+	else{
+		strcpy(tag, "1dir");
+	}
+
+#define FOR_FILES for(i = 0; i < n; i++) \
+	if((d = ndirs ? i % ndirs : -1), 1)
+
+	begin("create/%s", tag);
+	for(r = 0; r < rounds; r++){
+		FOR_FILES{
+			path(a, d, "f", i);
+			fd = TIMED(open(a, O_CREAT | O_EXCL | O_WRONLY, 0644));
+			if(fd < 0){
+				die(a);
+			}
+			close(fd);
+		}
+		FOR_FILES{
+			path(a, d, "f", i);
+			unlink(a);
+		}
+	}
+	end();
+
+	FOR_FILES{
+		path(a, d, "f", i);
+		if((fd = open(a, O_CREAT | O_WRONLY, 0644)) < 0){
+			die(a);
+		}
+		close(fd);
+	}
+	begin("stat/%s", tag);
+	for(r = 0; r < rounds; r++){
+		FOR_FILES{
+			path(a, d, "f", i);
+			if(TIMED(stat(a, &st)) < 0){
+				die(a);
+			}
+		}
+	}
+	end();
+
+	begin("rename/%s", tag);
+	for(r = 0; r < rounds; r++){
+		FOR_FILES{
+			path(a, d, r & 1 ? "g" : "f", i);
+			path(b, d, r & 1 ? "f" : "g", i);
+			if(TIMED(rename(a, b)) < 0){
+				die(a);
+			}
+		}
+	}
+	end();
+
+	FOR_FILES{
+		path(a, d, rounds & 1 ? "g" : "f", i);
+		unlink(a);
+	}
+	begin("unlink/%s", tag);
+	for(r = 0; r < rounds; r++){
+		FOR_FILES{
+			path(a, d, "f", i);
+			if((fd = open(a, O_CREAT | O_WRONLY, 0644)) < 0){
+				die(a);
+			}
+			close(fd);
+		}
+		FOR_FILES{
+			path(a, d, "f", i);
+			if(TIMED(unlink(a)) < 0){
+				die(a);
+			}
+		}
+	}
+	end();
+#undef FOR_FILES
+
+out:
+	for(d = 0; d < ndirs; d++){
+		sprintf(a, "%s/d%d", dir, d);
+		rmdir(a);
+	}
+}
+
+/*
+ * readdir of a directory holding as many entries as the inode table
+ * allows. The entries stay inline up to UX_INLINE_DIRS and spill to
+ * blocks beyond that.
+ */
+
+static void bench_readdir(void)
+{
+	char a[4096];
+	struct dirent *de;
+	DIR *dp;
+	int n, i, r, fd, cnt;
+
+	sprintf(a, "%s/rd", dir);
+	if(mkdir(a, 0755) < 0){
+		die(a);
+	}
+	n = free_inodes();
+	for(i = 0; i < n; i++){
+		sprintf(a, "%s/rd/e%d", dir, i);
+		if((fd = open(a, O_CREAT | O_WRONLY, 0644)) < 0){
+			die(a);
+		}
+		close(fd);
+	}
+	sprintf(a, "%s/rd", dir);
+	begin("readdir/%d", n + 2);
+	for(r = 0; r < rounds * 10; r++){
+		double t = now();
+
+		if(!(dp = opendir(a))){
+			die(a);
+		}
+		cnt = 0;
+		while((de = readdir(dp))){
+			cnt++;
+		}
+		closedir(dp);
+		t = now() - t;
+		lat_add(&lat, t);
+		cur.r_secs += t;
+		if(cnt != n + 2){
+			fprintf(stderr, "uxbench: readdir saw %d entries, expected %d\n", cnt, n + 2);
+		}
+	}
+	end();
+	for(i = 0; i < n; i++){
+		sprintf(a, "%s/rd/e%d", dir, i);
+		unlink(a);
+	}
+	sprintf(a, "%s/rd", dir);
+	rmdir(a);
+}
+
+/*
+ * Sequential and random I/O on one file of the largest size, in
+ * io-sized calls.
+ */
+
+static void bench_data(int io)
+{
+	char a[4096], *buf;
+	int fd, r, i, n = MAXFILE / io;
+	off_t off;
+
+	buf = malloc(MAXFILE);
+	if(!buf){
+		die("malloc");
+	}
+	memset(buf, 0x5a, MAXFILE);
+	sprintf(a, "%s/data", dir);
+
+	begin("seqwrite/%d", io);
+	for(r = 0; r < rounds; r++){
+		if((fd = open(a, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0){
+			die(a);
+		}
+		for(i = 0; i < n; i++){
+			if(TIMED(write(fd, buf, io)) != io){
+				die(a);
+			}
+			cur.r_bytes += io;
+		}
+		cur.r_secs -= now();
+		fsync(fd);
+		cur.r_secs += now();
+		close(fd);
+	}
+	end();
+
+	begin("seqread/%d", io);
+	for(r = 0; r < rounds; r++){
+		if((fd = open(a, O_RDONLY)) < 0){
+			die(a);
+		}
+		drop_cache(fd);
+		for(i = 0; i < n; i++){
+			if(TIMED(read(fd, buf, io)) != io){
+				die(a);
+			}
+			cur.r_bytes += io;
+		}
+		close(fd);
+	}
+	end();
+
+	begin("randwrite/%d", io);
+	if((fd = open(a, O_WRONLY)) < 0){
+		die(a);
+	}
+	for(r = 0; r < rounds; r++){
+		for(i = 0; i < n; i++){
+			off = (off_t)(random() % n) * io;
+			if(TIMED(pwrite(fd, buf, io, off)) != io){
+				die(a);
+			}
+			cur.r_bytes += io;
+		}
+		cur.r_secs -= now();
+		fsync(fd);
+		cur.r_secs += now();
+	}
+	close(fd);
+	end();
+
+	begin("randread/%d", io);
+	if((fd = open(a, O_RDONLY)) < 0){
+		die(a);
+	}
+	for(r = 0; r < rounds; r++){
+		drop_cache(fd);
+		for(i = 0; i < n; i++){
+			off = (off_t)(random() % n) * io;
+			if(TIMED(pread(fd, buf, io, off)) != io){
+				die(a);
+			}
+			cur.r_bytes += io;
+		}
+	}
+	close(fd);
+	end();
+
+	unlink(a);
+	free(buf);
+}
+
+/*
+ * Write many small files, then read them back cold. Files of up to
+ * UX_INLINE_SIZE bytes live in their inode.
+ */
+
+static void bench_small(int size)
+{
+	char a[4096], buf[MAXFILE];
+	int n = free_inodes(), r, i, fd;
+
+	memset(buf, 0xa5, size);
+	begin("smallwrite/%d", size);
+	for(r = 0; r < rounds; r++){
+		for(i = 0; i < n; i++){
+			double t;
+
+			sprintf(a, "%s/s%d", dir, i);
+			t = now();
+			fd = open(a, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+			if(fd < 0 || write(fd, buf, size) != size || close(fd) < 0){
+				die(a);
+			}
+			t = now() - t;
+			lat_add(&lat, t);
+			cur.r_secs += t;
+			cur.r_bytes += size;
+		}
+	}
+	end();
+
+	begin("smallread/%d", size);
+	for(r = 0; r < rounds; r++){
+		for(i = 0; i < n; i++){
+			sprintf(a, "%s/s%d", dir, i);
+			if((fd = open(a, O_RDONLY)) < 0){
+				die(a);
+			}
+			drop_cache(fd);
+			close(fd);
+		}
+		for(i = 0; i < n; i++){
+			double t;
+
+			sprintf(a, "%s/s%d", dir, i);
+			t = now();
+			fd = open(a, O_RDONLY);
+			if(fd < 0 || read(fd, buf, size) != size){
+				die(a);
+			}
+			close(fd);
+			t = now() - t;
+			lat_add(&lat, t);
+			cur.r_secs += t;
+			cur.r_bytes += size;
+		}
+	}
+	end();
+	for(i = 0; i < n; i++){
+		sprintf(a, "%s/s%d", dir, i);
+		unlink(a);
+	}
+}
+
+/*
+ * Parallel writers, each rewriting its own file with fsync.
+ */
+
+struct writer{
+	pthread_t  w_tid;
+	int        w_id;
+	struct lat w_lat;
+	long long  w_bytes;
+};
+
+static void *writer(void *arg)
+{
+	struct writer *w = arg;
+	char a[4096], buf[UX_BSIZE * 8];
+	int r, i, fd;
+
+	memset(buf, w->w_id, sizeof(buf));
+	sprintf(a, "%s/w%d", dir, w->w_id);
+	for(r = 0; r < rounds; r++){
+		if((fd = open(a, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0){
+			die(a);
+		}
+		for(i = 0; i < MAXFILE / (int)sizeof(buf); i++){
+			double t = now();
+
+			if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+				die(a);
+			}
+			lat_add(&w->w_lat, now() - t);
+			w->w_bytes += sizeof(buf);
+		}
+		fsync(fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+static void bench_parallel(int n)
+{
+	struct writer *w;
+	char a[4096];
+	double t;
+	int i, j;
+
+	if(n > free_inodes()){
+		n = free_inodes();
+	}
+	w = calloc(n, sizeof(*w));
+	if(!w){
+		die("calloc");
+	}
+	begin("parwrite/%d", n);
+	t = now();
+	for(i = 0; i < n; i++){
+		w[i].w_id = i;
+		pthread_create(&w[i].w_tid, NULL, writer, &w[i]);
+	}
+	for(i = 0; i < n; i++){
+		pthread_join(w[i].w_tid, NULL);
+		for(j = 0; j < w[i].w_lat.l_n; j++){
+			lat_add(&lat, w[i].w_lat.l_v[j]);
+		}
+		cur.r_bytes += w[i].w_bytes;
+		free(w[i].w_lat.l_v);
+	}
+	cur.r_secs = now() - t;
+	end();
+	for(i = 0; i < n; i++){
+		sprintf(a, "%s/w%d", dir, i);
+		unlink(a);
+	}
+	free(w);
+}
+
+/*
+ * A baseline is an earlier run saved with -j.
+ */
+
+static void load_base(const char *file)
+{
+	char line[1024];
+	struct result r;
+	FILE *f = fopen(file, "r");
+
+	if(!f){
+		die(file);
+	}
+	while(fgets(line, sizeof(line), f)){
+		memset(&r, 0, sizeof(r));
+		if(sscanf(line, "{\"test\":\"%31[^\"]\",\"ops\":%d,\"secs\":%lf,", r.r_name, &r.r_ops, &r.r_secs) != 3){
+			continue;
+		}
+		if(sscanf(strstr(line, "\"p99_us\":"), "\"p99_us\":%lf", &r.r_p99) != 1){
+			continue;
+		}
+		base = realloc(base, (nbase + 1) * sizeof(*base));
+		if(!base){
+			die("realloc");
+		}
+		base[nbase++] = r;
+	}
+	fclose(f);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: uxbench [-j] [-o results] [-r rounds] [-t threads] [-b baseline] [-T tests] dir\n"
+			"tests: names,readdir,data,small,parallel (default all)\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *tests = "names,readdir,data,small,parallel";
+	struct stat st;
+	int c;
+
+	while((c = getopt(argc, argv, "jo:r:t:b:T:")) != -1){
+		switch(c){
+		case 'j':
+			json = 1;
+			break;
+		case 'o':
+			if(!(jout = fopen(optarg, "w"))){
+				die(optarg);
+			}
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'b':
+			load_base(optarg);
+			break;
+		case 'T':
+			tests = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if(optind != argc - 1 || rounds < 1 || nthreads < 1){
+		usage();
+	}
+	dir = argv[optind];
+	if((dirfd_ = open(dir, O_RDONLY | O_DIRECTORY)) < 0 || fstat(dirfd_, &st) < 0){
+		die(dir);
+	}
+	snprintf(statpath, sizeof(statpath), "/sys/dev/block/%u:%u/stat",
+		 major(st.st_dev), minor(st.st_dev));
+	if(access(statpath, R_OK) < 0){
+		statpath[0] = '\0';
+	}
+	srandom(1);
+
+	if(!json){
+		printf("%-20s %7s %10s %8s %9s %9s %7s %7s%s\n", "test", "ops", "ops/s", "MB/s",
+		       "p50(us)", "p99(us)", "rd_ios", "wr_ios", nbase ? "  vs base" : "");
+	}
+	if(strstr(tests, "names")){
+		bench_names(0);
+		bench_names(4);
+	}
+	if(strstr(tests, "readdir")){
+		bench_readdir();
+	}
+	if(strstr(tests, "data")){
+		bench_data(UX_BSIZE);
+		bench_data(UX_BSIZE * 8);
+		bench_data(MAXFILE);
+	}
+	if(strstr(tests, "small")){
+		bench_small(100);
+		bench_small(UX_INLINE_SIZE);
+		bench_small(UX_BSIZE * 2);
+	}
+	if(strstr(tests, "parallel")){
+		bench_parallel(nthreads);
+	}
+	close(dirfd_);
+	if(jout){
+		fclose(jout);
+	}
+	return 0;
+}
@@ -0,0 +1,106 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <errno.h>
+#include <string.h>
+#include <linux/fs.h>
+#include "../kern/ux_fs.h"
+
+/*
+ * Walk a tree on a mounted uxfs and ask the kernel to move each
+ * regular file into one contiguous run of blocks.
+ */
+
+static long nfiles, nmoved, nblocks, nfailed;
+
+static int defrag_file(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+	int fd, ret;
+
+	(void)ftw;
+	if(type != FTW_F || !S_ISREG(st->st_mode)){
+		return 0;
+	}
+	nfiles++;
+	fd = open(path, O_RDWR | O_NOFOLLOW);
+	if(fd < 0){
+		fprintf(stderr, "uxdefrag: %s: %s\n", path, strerror(errno));
+		nfailed++;
+		return 0;
+	}
+	ret = ioctl(fd, UX_IOC_DEFRAG);
+	if(ret < 0){
+		fprintf(stderr, "uxdefrag: %s: %s\n", path, strerror(errno));
+		nfailed++;
+	}
+	else if(ret > 0){
+		printf("%s: %d blocks moved\n", path, ret);
+		nmoved++;
+		nblocks += ret;
+	}
+	close(fd);
+	return 0;
+}
+
+/*
+ * uxdefrag -s path: print the kernel's fragmentation report for
+ * the filesystem holding path, without moving anything.
+ */
+
+static void print_hist(const char *what, __u32 *count, __u32 *blocks)
+{
+	int b;
+
+	printf("%12s %10s %10s\n", what, "count", "blocks");
+	for(b = 0; b < UX_HIST_BUCKETS; b++){
+		if(count[b]){
+			printf("%5u - %-5u %10u %10u\n", 1u << b, (2u << b) - 1, count[b], blocks[b]);
+		}
+	}
+}
+
+static int report(const char *path)
+{
+	struct ux_fragstat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0 || ioctl(fd, UX_IOC_FRAGSTAT, &st) < 0){
+		fprintf(stderr, "uxdefrag: %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	close(fd);
+	printf("%u free blocks in %u extents, longest %u\n",
+	       st.f_free_blocks, st.f_free_extents, st.f_free_longest);
+	print_hist("extent size", st.f_free_hist, st.f_free_hist_blocks);
+	printf("%u files, %u inline, %u fragmented\n", st.f_files, st.f_inline, st.f_fragmented);
+	print_hist("extents", st.f_frag_hist, st.f_frag_hist_blocks);
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	int i;
+
+	if(argc == 3 && !strcmp(argv[1], "-s")){
+		return report(argv[2]);
+	}
+	if(argc < 2){
+		fprintf(stderr, "usage: uxdefrag path...\n       uxdefrag -s path\n");
+		_exit(1);
+	}
+	for(i = 1; i < argc; i++){
+		if(nftw(argv[i], defrag_file, 16, FTW_PHYS | FTW_MOUNT) < 0){
+			fprintf(stderr, "uxdefrag: %s: %s\n", argv[i], strerror(errno));
+			nfailed++;
+		}
+	}
+	printf("%ld files, %ld defragmented, %ld blocks moved, %ld errors\n",
+	       nfiles, nmoved, nblocks, nfailed);
+	return nfailed ? 1 : 0;
+}
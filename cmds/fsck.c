@@ -0,0 +1,641 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <linux/fs.h>
+#include "libuxfs.h"
+
+/*
+ * uxfsck checks an unmounted uxfs image and, with -y, repairs it.
+ * The image is mapped rather than read object by object, and the
+ * inode table and directories are scanned by several threads, each
+ * taking the next chunk of inodes as it finishes one.
+ */
+
+#define CHUNK 64
+
+static struct ux_image img;
+static struct ux_superblock *sb;
+static int repair;
+static int nthreads;
+static int errors;
+static pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned char *inuse;		/* per inode */
+static uint32_t *links;			/* directory entries naming each inode */
+static uint32_t *owner;			/* per data block, owning inode */
+static uint32_t *parent;		/* per directory, the directory naming it */
+static uint32_t *dotdot;		/* per directory, where its ".." points */
+static unsigned char *reach;		/* per directory, see reachable() */
+static int renamed;			/* some directory has more than one name */
+static uint32_t next_ino;
+
+static void problem(const char *fmt, ...)
+{
+	va_list ap;
+
+	pthread_mutex_lock(&print_lock);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf(repair ? " (fixed)\n" : "\n");
+	errors++;
+	pthread_mutex_unlock(&print_lock);
+}
+
+static int valid_ino(uint32_t ino)
+{
+	return ino >= UX_ROOT_NO && ino < sb->s_ninodes;
+}
+
+static void clear_inode(uint32_t ino)
+{
+	struct ux_inode *ip = ux_inode(&img, ino);
+	uint32_t blk;
+	int i;
+
+	for(i = 0; i < UX_DIRECT_BLOCKS; i++){
+		blk = ip->i_addr[i];
+		if(blk >= sb->s_data_block && blk < sb->s_data_block + sb->s_nblocks &&
+		   owner[blk - sb->s_data_block] == ino){
+			owner[blk - sb->s_data_block] = 0;
+		}
+	}
+	inuse[ino] = 0;
+	if(repair){
+		memset(ip, 0, sizeof(*ip));
+	}
+}
+
+/*
+ * Pass 1: check one inode's type, flags and block pointers, and
+ * claim its blocks. A block claimed twice stays with whichever
+ * inode got there first.
+ */
+
+static void check_inode(uint32_t ino)
+{
+	struct ux_inode *ip = ux_inode(&img, ino);
+	uint32_t i, blk, nr, none, count = 0;
+
+	if((sb->s_flags & UX_LAZY_ITABLE) && ino >= sb->s_inode_init){
+		return;
+	}
+	if(!ip->i_mode){
+		return;
+	}
+	if(!S_ISREG(ip->i_mode) && !S_ISDIR(ip->i_mode) && !S_ISLNK(ip->i_mode)){
+		problem("inode %u has bad mode 0%o, cleared", ino, ip->i_mode);
+		if(repair){
+			memset(ip, 0, sizeof(*ip));
+		}
+		return;
+	}
+	inuse[ino] = 1;
+
+	if(ip->i_flags & UX_INLINE_DATA){
+		for(i = 0; i < UX_DIRECT_BLOCKS; i++){
+			if(ip->i_addr[i]){
+				problem("inline inode %u has block pointers", ino);
+				if(repair){
+					memset(ip->i_addr, 0, sizeof(ip->i_addr));
+				}
+				break;
+			}
+		}
+		if(ip->i_size > UX_INLINE_SIZE){
+			problem("inline inode %u has size %u", ino, ip->i_size);
+			if(repair){
+				ip->i_size = S_ISDIR(ip->i_mode) ? UX_INLINE_SIZE : 0;
+			}
+		}
+		if(ip->i_blocks){
+			problem("inline inode %u has i_blocks %u", ino, ip->i_blocks);
+			if(repair){
+				ip->i_blocks = 0;
+			}
+		}
+		return;
+	}
+
+	for(i = 0; i < UX_DIRECT_BLOCKS; i++){
+		blk = ip->i_addr[i];
+		if(!blk){
+			continue;
+		}
+		if(blk < sb->s_data_block || blk >= sb->s_data_block + sb->s_nblocks ||
+		   (blk == sb->s_data_block && ino != UX_ROOT_NO)){
+			problem("inode %u block %u: bad address %u", ino, i, blk);
+			if(repair){
+				ip->i_addr[i] = 0;
+			}
+			continue;
+		}
+		nr = blk - sb->s_data_block;
+		none = 0;
+		if(!__atomic_compare_exchange_n(&owner[nr], &none, ino, 0,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+			problem("inode %u block %u: block %u already used by inode %u", ino, i, blk, none);
+			if(repair){
+				ip->i_addr[i] = 0;
+			}
+			continue;
+		}
+		count++;
+	}
+	if(ip->i_blocks != count){
+		problem("inode %u has i_blocks %u, should be %u", ino, ip->i_blocks, count);
+		if(repair){
+			ip->i_blocks = count;
+		}
+	}
+}
+
+static int is_dir(uint32_t ino)
+{
+	return S_ISDIR(ux_inode(&img, ino)->i_mode);
+}
+
+static int is_name(struct ux_dirent *de, const char *name)
+{
+	return strncmp(de->d_name, name, UX_NAMELEN) == 0;
+}
+
+/*
+ * Call fn on the entry slots of an in-use directory: the inline
+ * area, or each block the directory owns.
+ */
+
+static void walk_dir(uint32_t ino, void (*fn)(uint32_t, struct ux_dirent *, int))
+{
+	struct ux_inode *ip = ux_inode(&img, ino);
+	uint32_t blk;
+	int i;
+
+	if(!inuse[ino] || !S_ISDIR(ip->i_mode)){
+		return;
+	}
+	if(ip->i_flags & UX_INLINE_DATA){
+		fn(ino, (struct ux_dirent *)ip->i_inline, UX_INLINE_DIRS);
+		return;
+	}
+	for(i = 0; i < UX_DIRECT_BLOCKS; i++){
+		blk = ip->i_addr[i];
+		if(blk >= sb->s_data_block && blk < sb->s_data_block + sb->s_nblocks &&
+		   owner[blk - sb->s_data_block] == ino){
+			fn(ino, (struct ux_dirent *)ux_block(&img, blk), UX_DIRS_PER_BLOCK);
+		}
+	}
+}
+
+/*
+ * A directory named from several places keeps the lowest-numbered
+ * one as its parent, whatever order the threads find them in.
+ */
+
+static void set_parent(uint32_t child, uint32_t dir)
+{
+	uint32_t old = __atomic_load_n(&parent[child], __ATOMIC_RELAXED);
+
+	while((!old || dir < old) &&
+	      !__atomic_compare_exchange_n(&parent[child], &old, dir, 0,
+					   __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+	}
+}
+
+/*
+ * Pass 2: count the names of every inode in one directory, and
+ * clear entries that name free or invalid inodes. "." and ".." are
+ * not names: they are checked against the tree in pass 3, and a
+ * directory's parent is the directory that names it.
+ */
+
+static void check_entries(uint32_t dir, struct ux_dirent *de, int n)
+{
+	int i;
+
+	for(i = 0; i < n; i++, de++){
+		if(!de->d_ino){
+			continue;
+		}
+		if(!valid_ino(de->d_ino) || !inuse[de->d_ino]){
+			problem("directory %u entry \"%.*s\" names bad inode %u",
+				dir, UX_NAMELEN, de->d_name, de->d_ino);
+			if(repair){
+				memset(de, 0, sizeof(*de));
+			}
+			continue;
+		}
+		if(is_name(de, ".")){
+			if(de->d_ino != dir){
+				problem("directory %u has \".\" pointing at %u", dir, de->d_ino);
+				if(repair){
+					de->d_ino = dir;
+				}
+			}
+			continue;
+		}
+		if(is_name(de, "..")){
+			dotdot[dir] = de->d_ino;
+			continue;
+		}
+		if(is_dir(de->d_ino)){
+			if(de->d_ino == UX_ROOT_NO){
+				problem("directory %u entry \"%.*s\" names the root directory",
+					dir, UX_NAMELEN, de->d_name);
+				if(repair){
+					memset(de, 0, sizeof(*de));
+				}
+				continue;
+			}
+			set_parent(de->d_ino, dir);
+			if(__atomic_fetch_add(&links[de->d_ino], 1, __ATOMIC_RELAXED)){
+				__atomic_store_n(&renamed, 1, __ATOMIC_RELAXED);
+			}
+			continue;
+		}
+		__atomic_fetch_add(&links[de->d_ino], 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void check_dir(uint32_t ino)
+{
+	walk_dir(ino, check_entries);
+}
+
+/*
+ * Pass 2b, only needed if some directory has several names: clear
+ * every name but the one in its parent.
+ */
+
+static void check_names(uint32_t dir, struct ux_dirent *de, int n)
+{
+	int i;
+
+	for(i = 0; i < n; i++, de++){
+		if(!de->d_ino || is_name(de, ".") || is_name(de, "..") ||
+		   !valid_ino(de->d_ino) || !inuse[de->d_ino] ||
+		   de->d_ino == UX_ROOT_NO || !is_dir(de->d_ino) ||
+		   parent[de->d_ino] == dir){
+			continue;
+		}
+		problem("directory %u is also named \"%.*s\" in directory %u, entry cleared",
+			de->d_ino, UX_NAMELEN, de->d_name, dir);
+		__atomic_fetch_sub(&links[de->d_ino], 1, __ATOMIC_RELAXED);
+		if(repair){
+			memset(de, 0, sizeof(*de));
+		}
+	}
+}
+
+static void check_dir_names(uint32_t ino)
+{
+	walk_dir(ino, check_names);
+}
+
+static void *worker(void *arg)
+{
+	void (*fn)(uint32_t) = arg;
+	uint32_t ino, end;
+
+	for(;;){
+		ino = __atomic_fetch_add(&next_ino, CHUNK, __ATOMIC_RELAXED);
+		if(ino >= sb->s_ninodes){
+			break;
+		}
+		end = ino + CHUNK < sb->s_ninodes ? ino + CHUNK : sb->s_ninodes;
+		for(; ino < end; ino++){
+			if(ino >= UX_ROOT_NO){
+				fn(ino);
+			}
+		}
+	}
+	return NULL;
+}
+
+static void run_pass(void (*fn)(uint32_t))
+{
+	pthread_t tid[64];
+	int i, n = nthreads;
+
+	next_ino = 0;
+	for(i = 1; i < n; i++){
+		if(pthread_create(&tid[i], NULL, worker, fn) != 0){
+			n = i;
+			break;
+		}
+	}
+	worker(fn);
+	for(i = 1; i < n; i++){
+		pthread_join(tid[i], NULL);
+	}
+}
+
+/*
+ * Whether a directory can be reached from the root by following
+ * parents. The answer is kept for every directory on the way up,
+ * so each is walked once; a loop of parents is unreachable.
+ */
+
+#define REACH_YES  1
+#define REACH_NO   2
+#define REACH_BUSY 3
+
+static int reachable(uint32_t dir)
+{
+	uint32_t d;
+	int r;
+
+	for(d = dir; !reach[d]; d = parent[d]){
+		reach[d] = REACH_BUSY;
+		if(!parent[d]){
+			break;
+		}
+	}
+	r = reach[d] == REACH_YES ? REACH_YES : REACH_NO;
+	for(d = dir; d && reach[d] == REACH_BUSY; d = parent[d]){
+		reach[d] = r;
+	}
+	return r == REACH_YES;
+}
+
+/*
+ * Names in a directory that is about to be freed no longer count.
+ * Subdirectories need no help: they are unreachable too.
+ */
+
+static void drop_names(uint32_t dir, struct ux_dirent *de, int n)
+{
+	int i;
+
+	(void)dir;
+	for(i = 0; i < n; i++, de++){
+		if(de->d_ino && !is_name(de, ".") && !is_name(de, "..") &&
+		   valid_ino(de->d_ino) && inuse[de->d_ino] && !is_dir(de->d_ino)){
+			links[de->d_ino]--;
+		}
+	}
+}
+
+static int linked(uint32_t ino)
+{
+	return is_dir(ino) ? reachable(ino) : links[ino] != 0;
+}
+
+/*
+ * Point a directory's ".." at its parent, in a free slot if the
+ * entry is missing altogether.
+ */
+
+static struct ux_dirent *slot;
+
+static void find_slot(uint32_t dir, struct ux_dirent *de, int n)
+{
+	(void)dir;
+	for(; n && !slot; n--, de++){
+		if(!de->d_ino){
+			slot = de;
+		}
+	}
+}
+
+static void set_dotdot(uint32_t dir, uint32_t want)
+{
+	struct ux_dirent *de = ux_dir_find(&img, ux_inode(&img, dir), "..");
+
+	if(!de){
+		slot = NULL;
+		walk_dir(dir, find_slot);
+		de = slot;
+		if(!de){
+			return;
+		}
+		memset(de, 0, sizeof(*de));
+		strcpy(de->d_name, "..");
+	}
+	de->d_ino = want;
+}
+
+/*
+ * Pass 3: free the directories that cannot be reached from the
+ * root, with the names in them, then what the kernel left on the
+ * orphan list and any other inode no directory names. Then correct
+ * the link counts: a directory has its name, its own "." and the
+ * ".." of each subdirectory, the root its "." and "..".
+ */
+
+static void check_links(void)
+{
+	struct ux_inode *ip;
+	uint32_t ino, next, want, count = 0;
+
+	reach[UX_ROOT_NO] = REACH_YES;
+	for(ino = UX_ROOT_NO + 1; ino < sb->s_ninodes; ino++){
+		if(inuse[ino] && is_dir(ino) && !reachable(ino)){
+			walk_dir(ino, drop_names);
+		}
+	}
+
+	for(ino = sb->s_orphan; ino; ino = next){
+		if(!valid_ino(ino) || count++ >= sb->s_ninodes){
+			problem("orphan list is corrupt");
+			break;
+		}
+		ip = ux_inode(&img, ino);
+		next = ip->i_next_orphan;
+		if(inuse[ino] && !linked(ino)){
+			printf("freeing orphan inode %u\n", ino);
+			clear_inode(ino);
+		}
+		else if(repair){
+			ip->i_next_orphan = 0;
+		}
+	}
+	if(repair){
+		sb->s_orphan = 0;
+	}
+
+	for(ino = UX_ROOT_NO + 1; ino < sb->s_ninodes; ino++){
+		if(!inuse[ino] || linked(ino)){
+			continue;
+		}
+		if(is_dir(ino)){
+			problem("directory %u is not reachable from the root, cleared", ino);
+		}
+		else{
+			problem("inode %u is not in any directory, cleared", ino);
+		}
+		clear_inode(ino);
+	}
+
+	links[UX_ROOT_NO] += 2;
+	for(ino = UX_ROOT_NO + 1; ino < sb->s_ninodes; ino++){
+		if(inuse[ino] && is_dir(ino)){
+			links[ino]++;
+			links[parent[ino]]++;
+		}
+	}
+	for(ino = UX_ROOT_NO; ino < sb->s_ninodes; ino++){
+		ip = ux_inode(&img, ino);
+		if(!inuse[ino]){
+			continue;
+		}
+		if(S_ISDIR(ip->i_mode)){
+			want = ino == UX_ROOT_NO ? ino : parent[ino];
+			if(dotdot[ino] != want){
+				problem("directory %u has \"..\" pointing at %u, should be %u",
+					ino, dotdot[ino], want);
+				if(repair){
+					set_dotdot(ino, want);
+				}
+			}
+		}
+		if(ip->i_nlink != links[ino]){
+			problem("inode %u has link count %u, should be %u", ino, ip->i_nlink, links[ino]);
+			if(repair){
+				ip->i_nlink = links[ino];
+			}
+		}
+	}
+}
+
+/*
+ * Pass 4: rebuild both maps from what is actually in use and
+ * recompute the free counts.
+ */
+
+static void check_maps(void)
+{
+	unsigned char *imap = img.im_imap;
+	unsigned char *bmap = img.im_bmap;
+	uint32_t i, nifree = 0, nbfree = 0, bad = 0;
+	int used;
+
+	for(i = 0; i < sb->s_ninodes; i++){
+		used = i <= UX_ROOT_NO || inuse[i];
+		nifree += !used;
+		if(ux_map_test(imap, i) != used){
+			bad++;
+			if(repair){
+				used ? ux_map_set(imap, i) : ux_map_clear(imap, i);
+			}
+		}
+	}
+	if(bad){
+		problem("inode map has %u wrong bits", bad);
+	}
+
+	bad = 0;
+	for(i = 0; i < sb->s_nblocks; i++){
+		used = i == 0 || owner[i] != 0;
+		nbfree += !used;
+		if(ux_map_test(bmap, i) != used){
+			bad++;
+			if(repair){
+				used ? ux_map_set(bmap, i) : ux_map_clear(bmap, i);
+			}
+		}
+	}
+	if(bad){
+		problem("block map has %u wrong bits", bad);
+	}
+
+	if(sb->s_nifree != nifree || sb->s_nbfree != nbfree){
+		printf("free counts %u/%u, should be %u/%u\n",
+		       sb->s_nifree, sb->s_nbfree, nifree, nbfree);
+		if(repair){
+			sb->s_nifree = nifree;
+			sb->s_nbfree = nbfree;
+		}
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	__u32 seq, start;
+	int err, c;
+
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	while((c = getopt(argc, argv, "yj:")) != -1){
+		switch(c){
+		case 'y':
+			repair = 1;
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: uxfsck [-y] [-j threads] device\n");
+			_exit(1);
+		}
+	}
+	if(optind != argc - 1){
+		fprintf(stderr, "usage: uxfsck [-y] [-j threads] device\n");
+		_exit(1);
+	}
+	if(nthreads < 1){
+		nthreads = 1;
+	}
+	if(nthreads > 64){
+		nthreads = 64;
+	}
+
+	/*
+	 * Without -y the mapping is private, so nothing reaches the disk.
+	 */
+
+	err = ux_open(&img, argv[optind], repair ? UX_RDWR : UX_PRIVATE);
+	if(err){
+		fprintf(stderr, "uxfsck: %s: %s\n", argv[optind], ux_strerror(err));
+		_exit(1);
+	}
+	sb = img.im_sb;
+	seq = ux_journal_pending(&img, &start);
+	if(seq && !repair){
+		printf("journal transaction %u needs replay, results may be stale\n", seq);
+	}
+	else if(seq){
+		printf("replaying journal transaction %u (%d blocks)\n", seq, ux_journal_replay(&img));
+	}
+	madvise(ux_block(&img, sb->s_inode_block), (size_t)sb->s_ninodes * UX_BSIZE, MADV_WILLNEED);
+
+	inuse = calloc(sb->s_ninodes, 1);
+	links = calloc(sb->s_ninodes, sizeof(uint32_t));
+	owner = calloc(sb->s_nblocks, sizeof(uint32_t));
+	parent = calloc(sb->s_ninodes, sizeof(uint32_t));
+	dotdot = calloc(sb->s_ninodes, sizeof(uint32_t));
+	reach = calloc(sb->s_ninodes, 1);
+	if(!inuse || !links || !owner || !parent || !dotdot || !reach){
+		fprintf(stderr, "uxfsck: out of memory\n");
+		_exit(1);
+	}
+
+	if(!S_ISDIR(ux_inode(&img, UX_ROOT_NO)->i_mode)){
+		fprintf(stderr, "uxfsck: root inode is not a directory\n");
+		_exit(1);
+	}
+	run_pass(check_inode);
+	run_pass(check_dir);
+	if(renamed){
+		run_pass(check_dir_names);
+	}
+	check_links();
+	check_maps();
+
+	if(repair){
+		sb->s_mode = UX_FSCLEAN;
+	}
+	ux_close(&img);
+	printf("%s: %d problem%s%s\n", argv[optind], errors, errors == 1 ? "" : "s",
+	       errors && !repair ? ", run with -y to repair" : "");
+	return errors && !repair ? 4 : errors ? 1 : 0;
+}
@@ -1,27 +1,139 @@
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <time.h>
 #include <linux/fs.h>
-#include "../kern/ux_fs.h"
+#include "libuxfs.h"
 
-struct ux_superblock sb;
-int devfd;
+/*
+ * uxfsdb [-j] device [command ...]
+ *
+ * Commands come from the arguments, or one per line from stdin.
+ * With -j every command prints one JSON value per line instead
+ * of text. The image is mapped read-only.
+ */
 
-void print_inode(int inum, struct ux_inode *uip)
+struct ux_image img;
+struct ux_superblock *sb;
+int json;
+
+/*
+ * Return an in-use inode, or NULL with a message if quiet is 0.
+ */
+
+static struct ux_inode *get_inode(__u32 inum, int quiet)
+{
+	if(inum >= sb->s_ninodes){
+		if(!quiet){
+			printf("%u is not a valid inode number!\n", inum);
+		}
+		return NULL;
+	}
+	if(!ux_map_test(img.im_imap, inum)){
+		if(!quiet){
+			printf("%uth node is free!\n", inum);
+		}
+		return NULL;
+	}
+	if((sb->s_flags & UX_LAZY_ITABLE) && inum >= sb->s_inode_init){
+		if(!quiet){
+			printf("%uth node is not initialized!\n", inum);
+		}
+		return NULL;
+	}
+	return ux_inode(&img, inum);
+}
+
+static const char *type_name(__u32 mode)
+{
+	if(S_ISDIR(mode)){
+		return "dir";
+	}
+	if(S_ISREG(mode)){
+		return "file";
+	}
+	if(S_ISLNK(mode)){
+		return "symlink";
+	}
+	return "unknown";
+}
+
+static char *time_str(__u32 t)
+{
+	time_t tm = t;
+	char *s = ctime(&tm);
+
+	s[strlen(s) - 1] = '\0';
+	return s;
+}
+
+static void json_str(const char *s, int len)
+{
+	int i;
+
+	putchar('"');
+	for(i = 0; i < len && s[i]; i++){
+		if(s[i] == '"' || s[i] == '\\'){
+			printf("\\%c", s[i]);
+		} else if((unsigned char)s[i] < 0x20){
+			printf("\\u%04x", (unsigned char)s[i]);
+		} else {
+			putchar(s[i]);
+		}
+	}
+	putchar('"');
+}
+
+static int print_entry(struct ux_dirent *de, void *arg)
+{
+	int *n = arg;
+
+	if(json){
+		printf("%s{\"ino\":%u,\"name\":", (*n)++ ? "," : "", de->d_ino);
+		json_str(de->d_name, UX_NAMELEN);
+		putchar('}');
+	} else {
+		printf("inum[%2d], name[%.*s]\n", de->d_ino, UX_NAMELEN, de->d_name);
+	}
+	return 0;
+}
+
+void print_inode(__u32 inum, struct ux_inode *uip)
 {
-	char buf[UX_BSIZE];
-	struct ux_dirent *dirent;
-	int i, x;
+	int i, n = 0;
+
+	if(json){
+		printf("{\"ino\":%u,\"type\":\"%s\",\"mode\":%u,\"nlink\":%u,"
+		       "\"atime\":%u,\"mtime\":%u,\"ctime\":%u,\"uid\":%u,\"gid\":%u,"
+		       "\"size\":%u,\"blocks\":%u,\"inline\":%s,\"next_orphan\":%u,\"addr\":[",
+		       inum, type_name(uip->i_mode), uip->i_mode, uip->i_nlink,
+		       uip->i_atime, uip->i_mtime, uip->i_ctime, uip->i_uid, uip->i_gid,
+		       uip->i_size, uip->i_blocks, (uip->i_flags & UX_INLINE_DATA) ? "true" : "false",
+		       uip->i_next_orphan);
+		for(i = 0; i < UX_DIRECT_BLOCKS; i++){
+			printf("%s%u", i ? "," : "", uip->i_addr[i]);
+		}
+		putchar(']');
+		if(S_ISDIR(uip->i_mode)){
+			printf(",\"entries\":[");
+			ux_dir_iterate(&img, uip, print_entry, &n);
+			putchar(']');
+		}
+		putchar('}');
+		return;
+	}
 
-	printf("\ninode number %d\n", inum);
+	printf("\ninode number %u\n", inum);
 	printf("imode    = 0x%x\n", uip->i_mode);
 	printf("ilink   = 0x%x\n", uip->i_nlink);
-	printf("iatime   = %s\n", ctime((time_t*)&uip->i_atime));
-	printf("ictime   = %s\n", ctime((time_t*)&uip->i_ctime));
-	printf("imtime   = %s\n", ctime((time_t*)&uip->i_mtime));
+	printf("iatime   = %s\n", time_str(uip->i_atime));
+	printf("ictime   = %s\n", time_str(uip->i_ctime));
+	printf("imtime   = %s\n", time_str(uip->i_mtime));
 	printf("iuid     = 0x%x\n", uip->i_uid);
 	printf("igid     = 0x%x\n", uip->i_gid);
 	printf("isize    = 0x%x\n", uip->i_size);
@@ -32,81 +144,444 @@ void print_inode(int inum, struct ux_inode *uip)
 		}
 		printf("  iaddr[%2d] = %3d", i, uip->i_addr[i]);
 	}
+	if(uip->i_next_orphan){
+		printf("\ninext_orphan = %d", uip->i_next_orphan);
+	}
+	if(uip->i_flags & UX_INLINE_DATA){
+		printf("\niflags   = inline\n");
+		if(S_ISREG(uip->i_mode)){
+			printf("  data: %.*s", (int)(uip->i_size < UX_INLINE_SIZE ? uip->i_size : UX_INLINE_SIZE), uip->i_inline);
+		}
+	}
 	/*
 	print out the directory entries
 	*/
-	if(uip->i_mode & S_IFDIR){
-		printf("\n\n Directory entries:\n");
-		for(i = 0; i < uip->i_blocks; i++){
-			lseek(devfd, uip->i_addr[i] * UX_BSIZE, SEEK_SET);
-			read(devfd, buf, UX_BSIZE);
-			dirent = (struct ux_dirent *)buf;
-			for(x = 0; x < UX_DIRECT_BLOCKS; x++){
-				if(dirent->d_ino != 0){
-					printf("inum[%2d], name[%s]\n", dirent->d_ino, dirent->d_name);
-				}
-				dirent++;
-			}
+	if(S_ISDIR(uip->i_mode)){
+		printf("\n\n Directory entries%s:\n", (uip->i_flags & UX_INLINE_DATA) ? " (inline)" : "");
+		ux_dir_iterate(&img, uip, print_entry, &n);
+	}
+	printf("\n\n");
+}
+
+static void cmd_super(void)
+{
+	if(json){
+		printf("{\"magic\":%u,\"mode\":\"%s\",\"nifree\":%u,\"nbfree\":%u,"
+		       "\"ninodes\":%u,\"nblocks\":%u,\"imap_block\":%u,\"imap_blocks\":%u,"
+		       "\"bmap_block\":%u,\"bmap_blocks\":%u,\"inode_block\":%u,"
+		       "\"data_block\":%u,\"journal_block\":%u,\"journal_blocks\":%u,"
+		       "\"orphan\":%u,\"flags\":%u,\"inode_init\":%u}",
+		       sb->s_magic, (sb->s_mode == UX_FSCLEAN) ? "clean" : "dirty",
+		       sb->s_nifree, sb->s_nbfree, sb->s_ninodes, sb->s_nblocks,
+		       sb->s_imap_block, sb->s_imap_blocks, sb->s_bmap_block, sb->s_bmap_blocks,
+		       sb->s_inode_block, sb->s_data_block, sb->s_journal_block,
+		       sb->s_journal_blocks, sb->s_orphan, sb->s_flags, sb->s_inode_init);
+		return;
+	}
+	printf("\nSuperblock contents:\n");
+	printf("  s_magic =  0x%x\n", sb->s_magic);
+	printf("  s_mode =   %s\n",(sb->s_mode == UX_FSCLEAN)? "UX_FSCLEAN":"UX_FSDIRTY");
+	printf("  s_nifree = %d\n", sb->s_nifree);
+	printf("  s_nbfree = %d\n", sb->s_nbfree);
+	printf("  s_ninodes = %d\n", sb->s_ninodes);
+	printf("  s_nblocks = %d\n", sb->s_nblocks);
+	printf("  s_imap_block = %d (%d blocks)\n", sb->s_imap_block, sb->s_imap_blocks);
+	printf("  s_bmap_block = %d (%d blocks)\n", sb->s_bmap_block, sb->s_bmap_blocks);
+	printf("  s_inode_block = %d\n", sb->s_inode_block);
+	printf("  s_data_block = %d\n", sb->s_data_block);
+	printf("  s_journal_block = %d (%d blocks)\n", sb->s_journal_block, sb->s_journal_blocks);
+	printf("  s_orphan = %d\n", sb->s_orphan);
+	printf("  s_flags = 0x%x%s\n", sb->s_flags,
+	       (sb->s_flags & UX_LAZY_ITABLE) ? " (UX_LAZY_ITABLE)" : "");
+	printf("  s_inode_init = %d\n", sb->s_inode_init);
+}
+
+static void cmd_inode(__u32 inum)
+{
+	struct ux_inode *ip = get_inode(inum, json);
+
+	if(!ip){
+		if(json){
+			printf("{\"ino\":%u,\"error\":\"not in use\"}", inum);
+		}
+		return;
+	}
+	print_inode(inum, ip);
+}
+
+static void cmd_inodes(void)
+{
+	struct ux_inode *ip;
+	__u32 inum;
+	int n = 0;
+
+	if(json){
+		putchar('[');
+	}
+	for(inum = UX_ROOT_NO; inum < sb->s_ninodes; inum++){
+		ip = get_inode(inum, 1);
+		if(!ip){
+			continue;
+		}
+		if(json && n++){
+			putchar(',');
+		}
+		print_inode(inum, ip);
+	}
+	if(json){
+		putchar(']');
+	}
+}
+
+/*
+ * The tree walk marks directories it has entered, so a corrupt
+ * image with a directory loop still terminates.
+ */
+
+struct walk{
+	unsigned char *seen;
+	int depth;
+	int n;
+};
+
+static void print_tree(__u32 inum, const char *name, struct walk *w);
+
+static int tree_entry(struct ux_dirent *de, void *arg)
+{
+	struct walk *w = arg;
+	char name[UX_NAMELEN + 1];
+
+	if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")){
+		return 0;
+	}
+	snprintf(name, sizeof(name), "%.*s", UX_NAMELEN, de->d_name);
+	print_tree(de->d_ino, name, w);
+	return 0;
+}
+
+static void print_tree(__u32 inum, const char *name, struct walk *w)
+{
+	struct ux_inode *ip = get_inode(inum, 1);
+	struct walk child;
+
+	if(json){
+		printf("%s{\"name\":", w->n++ ? "," : "");
+		json_str(name, UX_NAMELEN);
+		printf(",\"ino\":%u", inum);
+	} else {
+		printf("%*s%s", w->depth * 2, "", name);
+	}
+	if(!ip){
+		if(json){
+			printf(",\"error\":\"not in use\"}");
+		} else {
+			printf("  [%u: not in use]\n", inum);
+		}
+		return;
+	}
+	if(json){
+		printf(",\"type\":\"%s\",\"size\":%u", type_name(ip->i_mode), ip->i_size);
+	} else {
+		printf("%s  [%u, %u bytes]\n", S_ISDIR(ip->i_mode) ? "/" : "", inum, ip->i_size);
+	}
+	if(S_ISDIR(ip->i_mode) && !w->seen[inum]){
+		w->seen[inum] = 1;
+		child = *w;
+		child.depth++;
+		child.n = 0;
+		if(json){
+			printf(",\"children\":[");
+		}
+		ux_dir_iterate(&img, ip, tree_entry, &child);
+		if(json){
+			putchar(']');
+		}
+	}
+	if(json){
+		putchar('}');
+	}
+}
+
+static void cmd_tree(void)
+{
+	struct walk w;
+
+	memset(&w, 0, sizeof(w));
+	w.seen = calloc(sb->s_ninodes, 1);
+	if(!w.seen){
+		fprintf(stderr, "uxfsdb:out of memory\n");
+		return;
+	}
+	print_tree(UX_ROOT_NO, "", &w);
+	free(w.seen);
+}
+
+/*
+ * The free space and fragmentation reports are computed with the
+ * same code as UX_IOC_FRAGSTAT. Histograms use power-of-two
+ * buckets: 1, 2-3, 4-7 and so on.
+ */
+
+static void frag_stats(struct ux_fragstat *st)
+{
+	__u32 blk, len, inum, run = 0;
+	struct ux_inode *ip;
+
+	memset(st, 0, sizeof(*st));
+	for(blk = 0; blk * UX_BITS_PER_BLOCK < sb->s_nblocks; blk++){
+		len = sb->s_nblocks - blk * UX_BITS_PER_BLOCK;
+		if(len > UX_BITS_PER_BLOCK){
+			len = UX_BITS_PER_BLOCK;
+		}
+		run = ux_frag_scan_free(st, img.im_bmap + blk * UX_BSIZE, len, run);
+	}
+	ux_frag_add_free(st, run);
+	for(inum = UX_ROOT_NO; inum < sb->s_ninodes; inum++){
+		ip = get_inode(inum, 1);
+		if(ip){
+			ux_frag_add_file(st, ip);
+		}
+	}
+}
+
+static void print_hist(const char *what, __u32 *count, __u32 *blocks)
+{
+	int b, last = -1, n = 0;
+
+	for(b = 0; b < UX_HIST_BUCKETS; b++){
+		if(count[b]){
+			last = b;
+		}
+	}
+	if(!json){
+		printf("%12s %10s %10s\n", what, "count", "blocks");
+	}
+	for(b = 0; b <= last; b++){
+		if(json){
+			printf("%s{\"min\":%u,\"max\":%u,\"count\":%u,\"blocks\":%u}",
+			       n++ ? "," : "", 1u << b, (2u << b) - 1, count[b], blocks[b]);
+		} else {
+			printf("%5u - %-5u %10u %10u\n", 1u << b, (2u << b) - 1, count[b], blocks[b]);
+		}
+	}
+}
+
+static void cmd_free(void)
+{
+	struct ux_fragstat st;
+
+	frag_stats(&st);
+	if(json){
+		printf("{\"free_blocks\":%u,\"free_extents\":%u,\"longest\":%u,\"histogram\":[",
+		       st.f_free_blocks, st.f_free_extents, st.f_free_longest);
+		print_hist("extent size", st.f_free_hist, st.f_free_hist_blocks);
+		printf("]}");
+		return;
+	}
+	printf("%u free blocks in %u extents, longest %u\n",
+	       st.f_free_blocks, st.f_free_extents, st.f_free_longest);
+	print_hist("extent size", st.f_free_hist, st.f_free_hist_blocks);
+}
+
+static void cmd_frag(void)
+{
+	struct ux_fragstat st;
+
+	frag_stats(&st);
+	if(json){
+		printf("{\"files\":%u,\"inline\":%u,\"fragmented\":%u,\"histogram\":[",
+		       st.f_files, st.f_inline, st.f_fragmented);
+		print_hist("extents", st.f_frag_hist, st.f_frag_hist_blocks);
+		printf("]}");
+		return;
+	}
+	printf("%u files, %u inline, %u fragmented\n", st.f_files, st.f_inline, st.f_fragmented);
+	print_hist("extents", st.f_frag_hist, st.f_frag_hist_blocks);
+}
+
+static void print_extents(__u32 inum, struct ux_inode *ip, int *first)
+{
+	struct ux_extent ext[UX_DIRECT_BLOCKS];
+	int i, n = ux_extents(ip, ext);
+
+	if(json){
+		printf("%s{\"ino\":%u,\"inline\":%s,\"extents\":[", (*first)++ ? "," : "", inum,
+		       (ip->i_flags & UX_INLINE_DATA) ? "true" : "false");
+		for(i = 0; i < n; i++){
+			printf("%s{\"logical\":%u,\"physical\":%u,\"length\":%u}", i ? "," : "",
+			       ext[i].e_lblk, ext[i].e_pblk, ext[i].e_len);
+		}
+		printf("]}");
+		return;
+	}
+	printf("inode %u: %s%d extent%s\n", inum, (ip->i_flags & UX_INLINE_DATA) ? "inline, " : "",
+	       n, n == 1 ? "" : "s");
+	for(i = 0; i < n; i++){
+		printf("  %3u: %5u..%-5u %u\n", ext[i].e_lblk, ext[i].e_pblk,
+		       ext[i].e_pblk + ext[i].e_len - 1, ext[i].e_len);
+	}
+}
+
+static void cmd_extents(int all, __u32 inum)
+{
+	struct ux_inode *ip;
+	int n = 0;
+
+	if(!all){
+		ip = get_inode(inum, json);
+		if(ip){
+			print_extents(inum, ip, &n);
+		} else if(json){
+			printf("{\"ino\":%u,\"error\":\"not in use\"}", inum);
 		}
-		printf("\n");
+		return;
+	}
+	if(json){
+		putchar('[');
+	}
+	for(inum = UX_ROOT_NO; inum < sb->s_ninodes; inum++){
+		ip = get_inode(inum, 1);
+		if(ip){
+			print_extents(inum, ip, &n);
+		}
+	}
+	if(json){
+		putchar(']');
 	}
-	else{
-		printf("\n\n");
+}
+
+static void usage(void)
+{
+	printf("commands:\n"
+	       "  s | super          superblock\n"
+	       "  iN | inode N|path  one inode, with its directory entries\n"
+	       "  inodes             every inode in use\n"
+	       "  tree               the directory tree\n"
+	       "  free               free space histogram\n"
+	       "  frag               file fragmentation histogram\n"
+	       "  extents [N|path]   extent layout of one or every file\n"
+	       "  q | quit\n");
+}
+
+/*
+ * An inode is named by number or by absolute path.
+ */
+
+static __u32 parse_ino(const char *arg)
+{
+	__u32 ino;
+
+	if(arg[0] != '/'){
+		return strtoul(arg, NULL, 0);
 	}
+	ino = ux_namei(&img, arg);
+	return ino ? ino : sb->s_ninodes;
 }
 
-int read_inode(int inum, struct ux_inode *uip)
+/*
+ * Run one command. Returns 1 when asked to quit.
+ */
+
+static int run_command(int argc, char **argv)
 {
-	if(sb.s_inode[inum - 1] == UX_INODE_FREE){
-		printf("%dth node is free!\n", inum);
-		return -1;
+	char *cmd = argv[0];
+
+	if(!strcmp(cmd, "q") || !strcmp(cmd, "quit")){
+		return 1;
 	}
-	printf("read %dth inode\n", inum);
-	lseek(devfd, (UX_INODE_BLOCK * UX_BSIZE) + (inum * UX_BSIZE), SEEK_SET);
-	read(devfd, (char*)uip, sizeof(struct ux_inode));
+	if(!strcmp(cmd, "s") || !strcmp(cmd, "super")){
+		cmd_super();
+	} else if(!strcmp(cmd, "inode") && argc > 1){
+		cmd_inode(parse_ino(argv[1]));
+	} else if(cmd[0] == 'i' && cmd[1] >= '0' && cmd[1] <= '9'){
+		cmd_inode(strtoul(&cmd[1], NULL, 0));
+	} else if(!strcmp(cmd, "inodes")){
+		cmd_inodes();
+	} else if(!strcmp(cmd, "tree")){
+		cmd_tree();
+	} else if(!strcmp(cmd, "free")){
+		cmd_free();
+	} else if(!strcmp(cmd, "frag")){
+		cmd_frag();
+	} else if(!strcmp(cmd, "extents")){
+		cmd_extents(argc < 2, argc < 2 ? 0 : parse_ino(argv[1]));
+	} else {
+		usage();
+		return 0;
+	}
+	if(json){
+		putchar('\n');
+	}
+	fflush(stdout);
 	return 0;
 }
 
+static int split(char *line, char **args)
+{
+	int n = 0;
+
+	for(args[n] = strtok(line, " \t\n"); args[n] && n < 7; args[n] = strtok(NULL, " \t\n")){
+		n++;
+	}
+	return n;
+}
+
 int main(int argc, char* argv[])
 {
-	struct ux_inode inode;	
-	char buf[512];
-	char command[512];
-	off_t  nsectors;
-	int    error, i, blk;
-	ino_t  inum;
+	char line[512], *args[8];
+	int err, c, i, n, prompt;
 
-	devfd = open(argv[1], O_RDWR);
-	if(devfd < 0){
-		fprintf(stderr, "uxmkfs:failed to open device\n");
+	while((c = getopt(argc, argv, "j")) != -1){
+		switch(c){
+		case 'j':
+			json = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: uxfsdb [-j] device [command ...]\n");
+			_exit(1);
+		}
+	}
+	if(optind >= argc){
+		fprintf(stderr, "usage: uxfsdb [-j] device [command ...]\n");
 		_exit(1);
 	}
-	/*read in and validate super block*/	
-	read(devfd, (char*)&sb, sizeof(struct ux_superblock));
-	if(sb.s_magic != UX_MAGIC){
-		fprintf(stderr, "uxmkfs:this is not a ux filesystem\n");
+
+	err = ux_open(&img, argv[optind], UX_RDONLY);
+	if(err){
+		fprintf(stderr, "uxfsdb:%s\n", ux_strerror(err));
 		_exit(1);
-	}		
-	while(1){
-		printf("uxfsdb > ");
-		fflush(stdout);
-		scanf("%s", command);
-		if(command[0] == 'q'){
-			_exit(0);
-		}
-		if(command[0] == 'i'){
-			inum = atoi(&command[1]);
-			if(read_inode(inum, &inode) < 0){
-				continue;
+	}
+	sb = img.im_sb;
+	madvise(img.im_base, img.im_size, MADV_WILLNEED);
+
+	if(optind + 1 < argc){
+		for(i = optind + 1; i < argc; i++){
+			snprintf(line, sizeof(line), "%s", argv[i]);
+			n = split(line, args);
+			if(n == 1 && i + 1 < argc && (!strcmp(argv[i], "inode") || !strcmp(argv[i], "extents")) &&
+			   ((argv[i + 1][0] >= '0' && argv[i + 1][0] <= '9') || argv[i + 1][0] == '/')){
+				args[n++] = argv[++i];
 			}
-			print_inode(inum, &inode);
+			if(run_command(n, args)){
+				break;
+			}
+		}
+		return 0;
+	}
+
+	prompt = isatty(0) && !json;
+	while(1){
+		if(prompt){
+			printf("uxfsdb > ");
+			fflush(stdout);
 		}
-		if(command[0] == 's'){
-			printf("\nSuperblock contents:\n");
-			printf("  s_magic =  0x%x\n", sb.s_magic);
-			printf("  s_mode =   %s\n",(sb.s_mode == UX_FSCLEAN)? "UX_FSCLEAN":"UX_FSDIRTY");
-			printf("  s_nifree = %d\n", sb.s_nifree);
-			printf("  s_nbfree = %d\n", sb.s_nbfree);
+		if(!fgets(line, sizeof(line), stdin)){
+			break;
+		}
+		n = split(line, args);
+		if(n && run_command(n, args)){
+			break;
 		}
 	}
+	return 0;
 }
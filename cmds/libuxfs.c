@@ -0,0 +1,1109 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <linux/fs.h>
+#include "libuxfs.h"
+
+static int ux_check_layout(struct ux_image *im)
+{
+	struct ux_superblock *sb = im->im_sb;
+
+	if(sb->s_magic != UX_MAGIC){
+		return UX_ENOTUX;
+	}
+	if(sb->s_ninodes <= UX_ROOT_NO || sb->s_nblocks < 2 ||
+	   sb->s_imap_blocks * UX_BITS_PER_BLOCK < sb->s_ninodes ||
+	   sb->s_bmap_blocks * UX_BITS_PER_BLOCK < sb->s_nblocks ||
+	   (size_t)(sb->s_imap_block + sb->s_imap_blocks) * UX_BSIZE > im->im_size ||
+	   (size_t)(sb->s_bmap_block + sb->s_bmap_blocks) * UX_BSIZE > im->im_size ||
+	   (size_t)(sb->s_inode_block + sb->s_ninodes) * UX_BSIZE > im->im_size ||
+	   (size_t)(sb->s_data_block + sb->s_nblocks) * UX_BSIZE > im->im_size ||
+	   (size_t)(sb->s_journal_block + sb->s_journal_blocks) * UX_BSIZE > im->im_size ||
+	   ((sb->s_flags & UX_LAZY_ITABLE) &&
+	    (sb->s_inode_init <= UX_ROOT_NO || sb->s_inode_init > sb->s_ninodes))){
+		return UX_ELAYOUT;
+	}
+	return 0;
+}
+
+/*
+ * Wrap an image that is already in memory, such as the metadata
+ * mkfs builds. The superblock must be filled in first.
+ */
+
+void ux_image_init(struct ux_image *im, void *base, size_t size)
+{
+	memset(im, 0, sizeof(*im));
+	im->im_fd = -1;
+	im->im_mode = UX_RDWR;
+	im->im_base = base;
+	im->im_size = size;
+	im->im_sb = (struct ux_superblock *)base;
+	im->im_imap = (unsigned char *)ux_block(im, im->im_sb->s_imap_block);
+	im->im_bmap = (unsigned char *)ux_block(im, im->im_sb->s_bmap_block);
+}
+
+int ux_open(struct ux_image *im, const char *path, int mode)
+{
+	struct stat st;
+	unsigned long long bytes;
+	void *base;
+	int fd, err;
+
+	fd = open(path, mode == UX_RDWR ? O_RDWR : O_RDONLY);
+	if(fd < 0 || fstat(fd, &st) < 0){
+		err = -errno;
+		goto out;
+	}
+	bytes = st.st_size;
+	if(S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &bytes) < 0){
+		err = -errno;
+		goto out;
+	}
+	if(bytes < UX_BSIZE){
+		err = UX_ENOTUX;
+		goto out;
+	}
+	base = mmap(NULL, bytes, mode == UX_RDONLY ? PROT_READ : PROT_READ | PROT_WRITE,
+		    mode == UX_PRIVATE ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+	if(base == MAP_FAILED){
+		err = -errno;
+		goto out;
+	}
+	ux_image_init(im, base, bytes);
+	im->im_fd = fd;
+	im->im_mode = mode;
+	err = ux_check_layout(im);
+	if(err){
+		munmap(base, bytes);
+		goto out;
+	}
+	return 0;
+out:
+	if(fd >= 0){
+		close(fd);
+	}
+	memset(im, 0, sizeof(*im));
+	im->im_fd = -1;
+	return err;
+}
+
+const char *ux_strerror(int err)
+{
+	if(err == UX_ENOTUX){
+		return "this is not a ux filesystem";
+	}
+	if(err == UX_ELAYOUT){
+		return "bad filesystem layout";
+	}
+	return strerror(-err);
+}
+
+/*
+ * Write a shared mapping back. Private and in-memory images have
+ * nothing to write.
+ */
+
+int ux_sync(struct ux_image *im)
+{
+	if(im->im_fd < 0 || im->im_mode != UX_RDWR){
+		return 0;
+	}
+	if(msync(im->im_base, im->im_size, MS_SYNC) < 0 || fsync(im->im_fd) < 0){
+		return -errno;
+	}
+	return 0;
+}
+
+void ux_close(struct ux_image *im)
+{
+	free(im->im_claimed);
+	im->im_claimed = NULL;
+	if(im->im_fd < 0){
+		return;
+	}
+	ux_sync(im);
+	munmap(im->im_base, im->im_size);
+	close(im->im_fd);
+	im->im_fd = -1;
+}
+
+char *ux_block(struct ux_image *im, __u32 nr)
+{
+	if((size_t)(nr + 1) * UX_BSIZE > im->im_size){
+		return NULL;
+	}
+	return im->im_base + (size_t)nr * UX_BSIZE;
+}
+
+/*
+ * One inode per block, as in the kernel.
+ */
+
+struct ux_inode *ux_inode(struct ux_image *im, __u32 ino)
+{
+	if(ino >= im->im_sb->s_ninodes){
+		return NULL;
+	}
+	return (struct ux_inode *)ux_block(im, im->im_sb->s_inode_block + ino);
+}
+
+int ux_inode_inuse(struct ux_image *im, __u32 ino)
+{
+	struct ux_superblock *sb = im->im_sb;
+
+	if(ino >= sb->s_ninodes || !ux_map_test(im->im_imap, ino)){
+		return 0;
+	}
+	return !(sb->s_flags & UX_LAZY_ITABLE) || ino < sb->s_inode_init;
+}
+
+/*
+ * Set the given times of an inode to now, to the nanosecond.
+ */
+
+void ux_touch(struct ux_inode *ip, int which)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	if(which & UX_ATIME){
+		ip->i_atime = ts.tv_sec;
+		ip->i_atime_nsec = ts.tv_nsec;
+	}
+	if(which & UX_MTIME){
+		ip->i_mtime = ts.tv_sec;
+		ip->i_mtime_nsec = ts.tv_nsec;
+	}
+	if(which & UX_CTIME){
+		ip->i_ctime = ts.tv_sec;
+		ip->i_ctime_nsec = ts.tv_nsec;
+	}
+}
+
+int ux_data_block(struct ux_image *im, __u32 blk)
+{
+	return blk >= im->im_sb->s_data_block &&
+	       blk < im->im_sb->s_data_block + im->im_sb->s_nblocks;
+}
+
+/*
+ * Split a file's block list into extents of logically and
+ * physically contiguous blocks. Returns the number of extents.
+ */
+
+int ux_extents(struct ux_inode *ip, struct ux_extent *ext)
+{
+	__u32 i;
+	int n = 0;
+
+	if(ip->i_flags & UX_INLINE_DATA){
+		return 0;
+	}
+	for(i = 0; i < UX_DIRECT_BLOCKS; i++){
+		if(!ip->i_addr[i]){
+			continue;
+		}
+		if(n && ext[n - 1].e_lblk + ext[n - 1].e_len == i &&
+		   ext[n - 1].e_pblk + ext[n - 1].e_len == ip->i_addr[i]){
+			ext[n - 1].e_len++;
+			continue;
+		}
+		ext[n].e_lblk = i;
+		ext[n].e_pblk = ip->i_addr[i];
+		ext[n].e_len = 1;
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Allocate the lowest free inode above the root and return it
+ * cleared, or 0. An inode past the initialized part of a lazy
+ * inode table extends it, as ux_ialloc() does.
+ */
+
+__u32 ux_ialloc(struct ux_image *im)
+{
+	struct ux_superblock *sb = im->im_sb;
+	__u32 ino;
+
+	ino = ux_map_find(im->im_imap, sb->s_ninodes, UX_ROOT_NO + 1, 0);
+	if(ino >= sb->s_ninodes){
+		return 0;
+	}
+	ux_map_set(im->im_imap, ino);
+	sb->s_nifree--;
+	if((sb->s_flags & UX_LAZY_ITABLE) && ino >= sb->s_inode_init){
+		sb->s_inode_init = ino + 1;
+	}
+	memset(ux_block(im, sb->s_inode_block + ino), 0, UX_BSIZE);
+	return ino;
+}
+
+void ux_ifree(struct ux_image *im, __u32 ino)
+{
+	if(ino <= UX_ROOT_NO || ino >= im->im_sb->s_ninodes ||
+	   !ux_map_test(im->im_imap, ino)){
+		return;
+	}
+	ux_map_clear(im->im_imap, ino);
+	im->im_sb->s_nifree++;
+}
+
+/*
+ * Allocate a data block and return its block number or 0. Blocks
+ * come from a cache, refilled from the map as the kernel refills
+ * its per-CPU caches; a goal that is not the cache's next block
+ * gives the claims back and restarts the search at the goal. The
+ * first data block belongs to the root directory and is never
+ * handed out. A claimed block that something else has marked in
+ * use since, such as fsck rebuilding the map, is skipped.
+ */
+
+__u32 ux_balloc(struct ux_image *im, __u32 goal)
+{
+	struct ux_superblock *sb = im->im_sb;
+	struct ux_alloc_cache *c = &im->im_cache;
+	__u32 blk, nr;
+
+	if(!im->im_claimed){
+		im->im_claimed = calloc((sb->s_nblocks + 7) / 8, 1);
+		if(!im->im_claimed){
+			return 0;
+		}
+		c->c_goal = 1;
+	}
+	if(ux_data_block(im, goal) && goal > sb->s_data_block &&
+	   (c->c_next == c->c_count || c->c_blocks[c->c_next] != goal)){
+		ux_cache_drain(c, im->im_claimed, sb->s_data_block);
+		c->c_goal = goal - sb->s_data_block;
+	}
+	for(;;){
+		blk = ux_cache_take(c);
+		if(!blk && ux_cache_refill(c, im->im_bmap, im->im_claimed, sb->s_nblocks,
+					   sb->s_data_block, UX_ALLOC_BATCH)){
+			blk = ux_cache_take(c);
+		}
+		if(!blk){
+			return 0;
+		}
+		nr = blk - sb->s_data_block;
+		ux_map_clear(im->im_claimed, nr);
+		if(!ux_map_test(im->im_bmap, nr)){
+			break;
+		}
+	}
+	ux_map_set(im->im_bmap, nr);
+	sb->s_nbfree--;
+	return blk;
+}
+
+void ux_bfree(struct ux_image *im, __u32 blk)
+{
+	__u32 nr;
+
+	if(!ux_data_block(im, blk) || blk == im->im_sb->s_data_block){
+		return;
+	}
+	nr = blk - im->im_sb->s_data_block;
+	if(ux_map_test(im->im_bmap, nr)){
+		ux_map_clear(im->im_bmap, nr);
+		im->im_sb->s_nbfree++;
+	}
+}
+
+/*
+ * Call fn for every used entry of a directory, inline or not,
+ * until it returns non-zero. Returns what fn returned last.
+ */
+
+int ux_dir_iterate(struct ux_image *im, struct ux_inode *dp, ux_dir_actor fn, void *arg)
+{
+	struct ux_dirent *de;
+	int i, x, ret;
+
+	if(dp->i_flags & UX_INLINE_DATA){
+		de = (struct ux_dirent *)dp->i_inline;
+		for(x = 0; x < UX_INLINE_DIRS; x++, de++){
+			if(de->d_ino && (ret = fn(de, arg))){
+				return ret;
+			}
+		}
+		return 0;
+	}
+	for(i = 0; i < UX_DIRECT_BLOCKS; i++){
+		de = (struct ux_dirent *)ux_block(im, dp->i_addr[i]);
+		if(!ux_data_block(im, dp->i_addr[i]) || !de){
+			continue;
+		}
+		for(x = 0; x < UX_DIRS_PER_BLOCK; x++, de++){
+			if(de->d_ino && (ret = fn(de, arg))){
+				return ret;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Look "name" up in a directory, as ux_find_entry() does.
+ */
+
+struct ux_dirent *ux_dir_find(struct ux_image *im, struct ux_inode *dp, const char *name)
+{
+	struct ux_dirent *de;
+	int i, len = strlen(name);
+
+	if(len > UX_NAMELEN){
+		return NULL;
+	}
+	if(dp->i_flags & UX_INLINE_DATA){
+		return ux_dirent_find((struct ux_dirent *)dp->i_inline, UX_INLINE_DIRS, name, len);
+	}
+	for(i = 0; i < UX_DIRECT_BLOCKS; i++){
+		de = (struct ux_dirent *)ux_block(im, dp->i_addr[i]);
+		if(!ux_data_block(im, dp->i_addr[i]) || !de){
+			continue;
+		}
+		de = ux_dirent_find(de, UX_DIRS_PER_BLOCK, name, len);
+		if(de){
+			return de;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Move an inline directory's entries into its first block, as
+ * ux_dir_convert() does.
+ */
+
+static int ux_dir_convert(struct ux_image *im, struct ux_inode *dp)
+{
+	__u32 blk = ux_balloc(im, 0);
+
+	if(!blk){
+		return -ENOSPC;
+	}
+	ux_dir_move_inline(ux_block(im, blk), dp->i_inline);
+	dp->i_flags &= ~UX_INLINE_DATA;
+	dp->i_addr[0] = blk;
+	dp->i_blocks = 1;
+	dp->i_size = UX_BSIZE;
+	return 0;
+}
+
+/*
+ * Add "name" to directory dir, as ux_add_entry() does: the first
+ * free slot, converting an inline directory when it is full and
+ * adding a block when every block is full.
+ */
+
+int ux_dir_add(struct ux_image *im, __u32 dir, const char *name, __u32 ino)
+{
+	struct ux_inode *dp = ux_inode(im, dir);
+	struct ux_dirent *de;
+	__u32 blk;
+	int i, err;
+
+	if(!dp || !S_ISDIR(dp->i_mode)){
+		return -ENOTDIR;
+	}
+	if(strlen(name) > UX_NAMELEN){
+		return -ENAMETOOLONG;
+	}
+	if(ux_dir_find(im, dp, name)){
+		return -EEXIST;
+	}
+	ux_touch(dp, UX_MTIME | UX_CTIME);
+	if(dp->i_flags & UX_INLINE_DATA){
+		de = ux_dirent_free((struct ux_dirent *)dp->i_inline, UX_INLINE_DIRS);
+		if(de){
+			ux_set_dirent(de, name, strlen(name), ino);
+			return 0;
+		}
+		err = ux_dir_convert(im, dp);
+		if(err){
+			return err;
+		}
+	}
+	for(i = 0; i < (int)dp->i_blocks; i++){
+		de = (struct ux_dirent *)ux_block(im, dp->i_addr[i]);
+		if(de && (de = ux_dirent_free(de, UX_DIRS_PER_BLOCK))){
+			ux_set_dirent(de, name, strlen(name), ino);
+			return 0;
+		}
+	}
+	if(dp->i_blocks >= UX_DIRECT_BLOCKS){
+		return -ENOSPC;
+	}
+	blk = ux_balloc(im, dp->i_blocks ? dp->i_addr[dp->i_blocks - 1] + 1 : 0);
+	if(!blk){
+		return -ENOSPC;
+	}
+	de = (struct ux_dirent *)ux_block(im, blk);
+	memset(de, 0, UX_BSIZE);
+	ux_set_dirent(de, name, strlen(name), ino);
+	dp->i_addr[dp->i_blocks++] = blk;
+	dp->i_size += UX_BSIZE;
+	return 0;
+}
+
+int ux_dir_remove(struct ux_image *im, __u32 dir, const char *name)
+{
+	struct ux_inode *dp = ux_inode(im, dir);
+	struct ux_dirent *de;
+
+	if(!dp || !S_ISDIR(dp->i_mode)){
+		return -ENOTDIR;
+	}
+	de = ux_dir_find(im, dp, name);
+	if(!de){
+		return -ENOENT;
+	}
+	ux_dirent_clear(de);
+	ux_touch(dp, UX_MTIME | UX_CTIME);
+	return 0;
+}
+
+/*
+ * Resolve an absolute or root-relative path. Symlinks are not
+ * followed. Returns the inode number, or 0.
+ */
+
+__u32 ux_namei(struct ux_image *im, const char *path)
+{
+	char name[UX_NAMELEN + 1];
+	struct ux_inode *dp;
+	struct ux_dirent *de;
+	__u32 ino = UX_ROOT_NO;
+	size_t len;
+
+	while(*path){
+		while(*path == '/'){
+			path++;
+		}
+		if(!*path){
+			break;
+		}
+		len = strcspn(path, "/");
+		if(len > UX_NAMELEN){
+			return 0;
+		}
+		memcpy(name, path, len);
+		name[len] = '\0';
+		path += len;
+		dp = ux_inode(im, ino);
+		if(!ux_inode_inuse(im, ino) || !S_ISDIR(dp->i_mode)){
+			return 0;
+		}
+		de = ux_dir_find(im, dp, name);
+		if(!de){
+			return 0;
+		}
+		ino = de->d_ino;
+	}
+	return ux_inode_inuse(im, ino) ? ino : 0;
+}
+
+/*
+ * crc32_le() as the kernel computes it: reflected, no final xor.
+ */
+
+__u32 ux_crc32_le(__u32 crc, const unsigned char *p, size_t len)
+{
+	static __u32 table[256];
+	__u32 c;
+	int i, k;
+
+	if(!table[1]){
+		for(i = 0; i < 256; i++){
+			c = i;
+			for(k = 0; k < 8; k++){
+				c = (c & 1) ? (c >> 1) ^ 0xedb88320 : c >> 1;
+			}
+			table[i] = c;
+		}
+	}
+	while(len--){
+		crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+/*
+ * Return the sequence of the complete transaction at "start", or 0.
+ */
+
+static __u32 ux_journal_check(struct ux_image *im, __u32 start, __u32 len)
+{
+	struct ux_journal_header *d, *c;
+	__u32 crc = ~0, i;
+
+	d = (struct ux_journal_header *)ux_block(im, start);
+	if(d->h_magic != UX_JOURNAL_MAGIC || d->h_type != UX_JDESC ||
+	   !d->h_sequence || !d->h_count ||
+	   d->h_count > UX_JDESC_BLOCKS || d->h_count + 2 > len){
+		return 0;
+	}
+	for(i = 0; i < d->h_count; i++){
+		if(d->h_blocknr[i] >= im->im_sb->s_journal_block){
+			return 0;
+		}
+		crc = ux_crc32_le(crc, (unsigned char *)ux_block(im, start + 1 + i), UX_BSIZE);
+	}
+	c = (struct ux_journal_header *)ux_block(im, start + 1 + d->h_count);
+	if(c->h_magic != UX_JOURNAL_MAGIC || c->h_type != UX_JCOMMIT ||
+	   c->h_sequence != d->h_sequence || c->h_count != d->h_count ||
+	   c->h_checksum != crc){
+		return 0;
+	}
+	return d->h_sequence;
+}
+
+/*
+ * The newest committed transaction of a volume that was not
+ * unmounted cleanly, as the kernel would find it at mount. Returns
+ * its sequence and where its descriptor is, or 0.
+ */
+
+__u32 ux_journal_pending(struct ux_image *im, __u32 *start)
+{
+	struct ux_superblock *sb = im->im_sb;
+	__u32 half, s0, s1;
+
+	if(!sb->s_journal_blocks || sb->s_mode == UX_FSCLEAN){
+		return 0;
+	}
+	half = sb->s_journal_blocks / 2;
+	s0 = ux_journal_check(im, sb->s_journal_block, half);
+	s1 = ux_journal_check(im, sb->s_journal_block + half, half);
+	if(!s0 && !s1){
+		return 0;
+	}
+	if(!s0 || (s1 && (int32_t)(s1 - s0) > 0)){
+		*start = sb->s_journal_block + half;
+		return s1;
+	}
+	*start = sb->s_journal_block;
+	return s0;
+}
+
+/*
+ * Copy the pending transaction to its home blocks. Returns the
+ * number of blocks replayed.
+ */
+
+int ux_journal_replay(struct ux_image *im)
+{
+	struct ux_journal_header *d;
+	__u32 start, i;
+
+	if(!ux_journal_pending(im, &start)){
+		return 0;
+	}
+	d = (struct ux_journal_header *)ux_block(im, start);
+	for(i = 0; i < d->h_count; i++){
+		memcpy(ux_block(im, d->h_blocknr[i]), ux_block(im, start + 1 + i), UX_BSIZE);
+	}
+	return d->h_count;
+}
+
+/*
+ * Map logical block lblk of a file, as ux_get_block() does, with
+ * the same ux_bmap_lookup(). A zero address is a hole. With create,
+ * a hole is filled with a new, zeroed block, placed after the
+ * file's previous block if that one is free.
+ */
+
+int ux_bmap(struct ux_image *im, struct ux_inode *ip, __u32 lblk, int create, __u32 *blk)
+{
+	__u32 goal = 0;
+	int err;
+
+	err = ux_bmap_lookup(ip->i_addr, lblk, create, blk);
+	if(err){
+		return err;
+	}
+	if(*blk){
+		return ux_data_block(im, *blk) ? 0 : -EIO;
+	}
+	if(!create){
+		return 0;
+	}
+	if(lblk && ip->i_addr[lblk - 1]){
+		goal = ip->i_addr[lblk - 1] + 1;
+	}
+	*blk = ux_balloc(im, goal);
+	if(!*blk){
+		return -ENOSPC;
+	}
+	memset(ux_block(im, *blk), 0, UX_BSIZE);
+	ip->i_addr[lblk] = *blk;
+	ip->i_blocks++;
+	return 0;
+}
+
+/*
+ * Free a file's blocks from index "first" onwards, as
+ * ux_truncate_blocks() does.
+ */
+
+void ux_truncate_blocks(struct ux_image *im, struct ux_inode *ip, __u32 first)
+{
+	__u32 blks[UX_DIRECT_BLOCKS];
+	int i, n;
+
+	n = ux_bmap_truncate(ip->i_addr, first, blks);
+	for(i = 0; i < n; i++){
+		ux_bfree(im, blks[i]);
+	}
+	ip->i_blocks -= (__u32)n < ip->i_blocks ? (__u32)n : ip->i_blocks;
+}
+
+/*
+ * Move an inline file's data out to its first block, as
+ * ux_inline_convert() does.
+ */
+
+static int ux_inline_convert(struct ux_image *im, struct ux_inode *ip)
+{
+	__u32 len = ip->i_size < UX_INLINE_SIZE ? ip->i_size : UX_INLINE_SIZE;
+	__u32 blk;
+	int err;
+
+	ip->i_flags &= ~UX_INLINE_DATA;
+	if(len){
+		err = ux_bmap(im, ip, 0, 1, &blk);
+		if(err){
+			ip->i_flags |= UX_INLINE_DATA;
+			return err;
+		}
+		memcpy(ux_block(im, blk), ip->i_inline, len);
+	}
+	memset(ip->i_inline, 0, sizeof(ip->i_inline));
+	return 0;
+}
+
+ssize_t ux_read(struct ux_image *im, struct ux_inode *ip, void *buf, size_t len, off_t off)
+{
+	size_t done = 0, n, boff;
+	__u32 blk;
+	int err;
+
+	if(off < 0){
+		return -EINVAL;
+	}
+	if((size_t)off >= ip->i_size){
+		return 0;
+	}
+	if((off_t)len > (off_t)ip->i_size - off){
+		len = ip->i_size - off;
+	}
+	if(ip->i_flags & UX_INLINE_DATA){
+		if(off + len > UX_INLINE_SIZE){
+			return -EIO;
+		}
+		memcpy(buf, ip->i_inline + off, len);
+		return len;
+	}
+	while(done < len){
+		boff = (off + done) % UX_BSIZE;
+		n = UX_BSIZE - boff < len - done ? UX_BSIZE - boff : len - done;
+		err = ux_bmap(im, ip, (off + done) / UX_BSIZE, 0, &blk);
+		if(err){
+			return done ? (ssize_t)done : err;
+		}
+		if(blk){
+			memcpy((char *)buf + done, ux_block(im, blk) + boff, n);
+		}
+		else{
+			memset((char *)buf + done, 0, n);
+		}
+		done += n;
+	}
+	return done;
+}
+
+/*
+ * Writes stay in the inode while they fit, as in ux_write_begin().
+ */
+
+ssize_t ux_write(struct ux_image *im, struct ux_inode *ip, const void *buf, size_t len, off_t off)
+{
+	size_t done = 0, n, boff;
+	__u32 blk;
+	int err;
+
+	if(off < 0){
+		return -EINVAL;
+	}
+	if((size_t)off >= UX_DIRECT_BLOCKS * UX_BSIZE){
+		return len ? -EFBIG : 0;
+	}
+	if((off_t)len > UX_DIRECT_BLOCKS * UX_BSIZE - off){
+		len = UX_DIRECT_BLOCKS * UX_BSIZE - off;
+	}
+	if(ip->i_flags & UX_INLINE_DATA){
+		if(off + len <= UX_INLINE_SIZE){
+			memcpy(ip->i_inline + off, buf, len);
+			done = len;
+			goto out;
+		}
+		err = ux_inline_convert(im, ip);
+		if(err){
+			return err;
+		}
+	}
+	while(done < len){
+		boff = (off + done) % UX_BSIZE;
+		n = UX_BSIZE - boff < len - done ? UX_BSIZE - boff : len - done;
+		err = ux_bmap(im, ip, (off + done) / UX_BSIZE, 1, &blk);
+		if(err){
+			if(!done){
+				return err;
+			}
+			break;
+		}
+		memcpy(ux_block(im, blk) + boff, (const char *)buf + done, n);
+		done += n;
+	}
+out:
+	if(off + done > ip->i_size){
+		ip->i_size = off + done;
+	}
+	ux_touch(ip, UX_MTIME | UX_CTIME);
+	return done;
+}
+
+int ux_truncate(struct ux_image *im, struct ux_inode *ip, off_t size)
+{
+	__u32 blk;
+	int err;
+
+	if(size < 0){
+		return -EINVAL;
+	}
+	if(size > UX_DIRECT_BLOCKS * UX_BSIZE){
+		return -EFBIG;
+	}
+	if(ip->i_flags & UX_INLINE_DATA){
+		if(size <= UX_INLINE_SIZE){
+			if(size < ip->i_size){
+				memset(ip->i_inline + size, 0, UX_INLINE_SIZE - size);
+			}
+			goto out;
+		}
+		err = ux_inline_convert(im, ip);
+		if(err){
+			return err;
+		}
+	}
+	if(size % UX_BSIZE && size < ip->i_size &&
+	   ux_bmap(im, ip, size / UX_BSIZE, 0, &blk) == 0 && blk){
+		memset(ux_block(im, blk) + size % UX_BSIZE, 0, UX_BSIZE - size % UX_BSIZE);
+	}
+	ux_truncate_blocks(im, ip, (size + UX_BSIZE - 1) / UX_BSIZE);
+out:
+	ip->i_size = size;
+	ux_touch(ip, UX_MTIME | UX_CTIME);
+	return 0;
+}
+
+/*
+ * Release an inode whose last link is gone. The tools have no
+ * orphan list; the caller must know the inode is not open.
+ */
+
+void ux_free_inode(struct ux_image *im, __u32 ino)
+{
+	struct ux_inode *ip = ux_inode(im, ino);
+
+	if(!ip){
+		return;
+	}
+	if(!(ip->i_flags & UX_INLINE_DATA)){
+		ux_truncate_blocks(im, ip, 0);
+	}
+	memset(ip, 0, sizeof(*ip));
+	ux_ifree(im, ino);
+}
+
+/*
+ * Create "name" in dir. New files and directories start inline,
+ * as in ux_create() and ux_make_empty(). Symlinks are made by
+ * ux_symlink().
+ */
+
+int ux_create(struct ux_image *im, __u32 dir, const char *name, __u32 mode, __u32 *inop)
+{
+	struct ux_inode *dp = ux_inode(im, dir), *ip;
+	__u32 ino;
+	int err;
+
+	if(!dp || !S_ISDIR(dp->i_mode)){
+		return -ENOTDIR;
+	}
+	if(strlen(name) > UX_NAMELEN){
+		return -ENAMETOOLONG;
+	}
+	if(ux_dir_find(im, dp, name)){
+		return -EEXIST;
+	}
+	ino = ux_ialloc(im);
+	if(!ino){
+		return -ENOSPC;
+	}
+	ip = ux_inode(im, ino);
+	ip->i_mode = mode;
+	ip->i_nlink = 1;
+	ux_touch(ip, UX_ATIME | UX_MTIME | UX_CTIME);
+	if(S_ISDIR(mode)){
+		ux_dir_init_inline(ip->i_inline, ino, dir);
+		ip->i_nlink = 2;
+		ip->i_size = UX_INLINE_SIZE;
+	}
+	if(!S_ISLNK(mode)){
+		ip->i_flags = UX_INLINE_DATA;
+	}
+	err = ux_dir_add(im, dir, name, ino);
+	if(err){
+		memset(ip, 0, sizeof(*ip));
+		ux_ifree(im, ino);
+		return err;
+	}
+	if(S_ISDIR(mode)){
+		dp->i_nlink++;
+	}
+	*inop = ino;
+	return 0;
+}
+
+/*
+ * Targets that fit in the inode make fast symlinks, as in
+ * ux_symlink().
+ */
+
+int ux_symlink(struct ux_image *im, __u32 dir, const char *name, const char *target, __u32 *inop)
+{
+	size_t l = strlen(target) + 1;
+	struct ux_inode *ip;
+	ssize_t n;
+	int err;
+
+	if(l > UX_DIRECT_BLOCKS * UX_BSIZE){
+		return -ENAMETOOLONG;
+	}
+	err = ux_create(im, dir, name, S_IFLNK | 0777, inop);
+	if(err){
+		return err;
+	}
+	ip = ux_inode(im, *inop);
+	if(l <= UX_INLINE_SIZE){
+		memcpy(ip->i_inline, target, l);
+		ip->i_flags = UX_INLINE_DATA;
+		ip->i_size = l - 1;
+		return 0;
+	}
+	n = ux_write(im, ip, target, l - 1, 0);
+	if(n != (ssize_t)(l - 1)){
+		ux_unlink(im, dir, name);
+		return n < 0 ? n : -ENOSPC;
+	}
+	return 0;
+}
+
+int ux_readlink(struct ux_image *im, struct ux_inode *ip, char *buf, size_t size)
+{
+	ssize_t n;
+
+	if(!S_ISLNK(ip->i_mode)){
+		return -EINVAL;
+	}
+	if(!size){
+		return 0;
+	}
+	n = ux_read(im, ip, buf, size - 1, 0);
+	if(n < 0){
+		return n;
+	}
+	buf[n] = '\0';
+	return 0;
+}
+
+int ux_link(struct ux_image *im, __u32 ino, __u32 dir, const char *name)
+{
+	struct ux_inode *ip = ux_inode(im, ino);
+	int err;
+
+	if(!ip || S_ISDIR(ip->i_mode)){
+		return -EPERM;
+	}
+	err = ux_dir_add(im, dir, name, ino);
+	if(err){
+		return err;
+	}
+	ip->i_nlink++;
+	ux_touch(ip, UX_CTIME);
+	return 0;
+}
+
+int ux_unlink(struct ux_image *im, __u32 dir, const char *name)
+{
+	struct ux_inode *dp = ux_inode(im, dir), *ip;
+	struct ux_dirent *de;
+	__u32 ino;
+
+	if(!dp || !S_ISDIR(dp->i_mode)){
+		return -ENOTDIR;
+	}
+	de = ux_dir_find(im, dp, name);
+	if(!de){
+		return -ENOENT;
+	}
+	ino = de->d_ino;
+	ip = ux_inode(im, ino);
+	if(!ip){
+		return -EIO;
+	}
+	if(S_ISDIR(ip->i_mode)){
+		return -EISDIR;
+	}
+	ux_dir_remove(im, dir, name);
+	ux_touch(ip, UX_CTIME);
+	if(ip->i_nlink){
+		ip->i_nlink--;
+	}
+	if(!ip->i_nlink){
+		ux_free_inode(im, ino);
+	}
+	return 0;
+}
+
+static int ux_count_actor(struct ux_dirent *de, void *arg)
+{
+	if(strcmp(de->d_name, ".") && strcmp(de->d_name, "..")){
+		(*(int *)arg)++;
+	}
+	return 0;
+}
+
+int ux_rmdir(struct ux_image *im, __u32 dir, const char *name)
+{
+	struct ux_inode *dp = ux_inode(im, dir), *ip;
+	struct ux_dirent *de;
+	__u32 ino;
+	int n = 0;
+
+	if(!dp || !S_ISDIR(dp->i_mode)){
+		return -ENOTDIR;
+	}
+	if(!strcmp(name, ".") || !strcmp(name, "..")){
+		return -EINVAL;
+	}
+	de = ux_dir_find(im, dp, name);
+	if(!de){
+		return -ENOENT;
+	}
+	ino = de->d_ino;
+	ip = ux_inode(im, ino);
+	if(!ip || !S_ISDIR(ip->i_mode)){
+		return -ENOTDIR;
+	}
+	ux_dir_iterate(im, ip, ux_count_actor, &n);
+	if(n){
+		return -ENOTEMPTY;
+	}
+	ux_dir_remove(im, dir, name);
+	ux_free_inode(im, ino);
+	if(dp->i_nlink > 2){
+		dp->i_nlink--;
+	}
+	return 0;
+}
+
+/*
+ * Directories cannot be renamed, as in ux_rename(). An existing
+ * target file is replaced.
+ */
+
+int ux_rename(struct ux_image *im, __u32 odir, const char *oname, __u32 ndir, const char *nname)
+{
+	struct ux_inode *odp = ux_inode(im, odir), *ndp = ux_inode(im, ndir), *ip, *tp;
+	struct ux_dirent *de, *nde;
+	__u32 ino, tino;
+	int err;
+
+	if(!odp || !ndp || !S_ISDIR(odp->i_mode) || !S_ISDIR(ndp->i_mode)){
+		return -ENOTDIR;
+	}
+	de = ux_dir_find(im, odp, oname);
+	if(!de){
+		return -ENOENT;
+	}
+	ino = de->d_ino;
+	ip = ux_inode(im, ino);
+	if(!ip){
+		return -EIO;
+	}
+	if(S_ISDIR(ip->i_mode)){
+		return -EINVAL;
+	}
+	if(strlen(nname) > UX_NAMELEN){
+		return -ENAMETOOLONG;
+	}
+	nde = ux_dir_find(im, ndp, nname);
+	if(nde){
+		tino = nde->d_ino;
+		if(tino == ino){
+			return 0;
+		}
+		tp = ux_inode(im, tino);
+		if(!tp){
+			return -EIO;
+		}
+		if(S_ISDIR(tp->i_mode)){
+			return -EISDIR;
+		}
+		nde->d_ino = ino;
+		ux_touch(tp, UX_CTIME);
+		if(tp->i_nlink && !--tp->i_nlink){
+			ux_free_inode(im, tino);
+		}
+	}
+	else{
+		err = ux_dir_add(im, ndir, nname, ino);
+		if(err){
+			return err;
+		}
+	}
+	ux_dir_remove(im, odir, oname);
+	ux_touch(ip, UX_CTIME);
+	return 0;
+}
+
+/*
+ * Leave the journal empty, as mkfs does, once the image has been
+ * changed behind its back. A stale transaction must not be
+ * replayed over those changes at the next mount.
+ */
+
+void ux_journal_reset(struct ux_image *im)
+{
+	struct ux_superblock *sb = im->im_sb;
+
+	if(!sb->s_journal_blocks){
+		return;
+	}
+	memset(ux_block(im, sb->s_journal_block), 0, UX_BSIZE);
+	memset(ux_block(im, sb->s_journal_block + sb->s_journal_blocks / 2), 0, UX_BSIZE);
+}
@@ -0,0 +1,110 @@
+#ifndef _LIBUXFS_H
+#define _LIBUXFS_H
+
+#include <stddef.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <linux/types.h>
+#include <linux/ioctl.h>
+#include "../kern/ux_fs.h"
+#include "../kern/ux_map.h"
+#include "../kern/ux_dirent.h"
+
+/*
+ * libuxfs: userspace access to a uxfs image. The image is mapped
+ * as a whole, so the page cache is the block cache and a block is
+ * just a pointer into the mapping. Block and inode numbers are the
+ * kernel's: inode n lives in block s_inode_block + n, and block
+ * numbers are absolute. The tools only write unmounted images, so
+ * nothing here is journalled.
+ *
+ * Map scanning, block allocation, block list lookup and truncation,
+ * directory entry search, insertion and removal, and the inline
+ * directory layout come from ux_map.h and ux_dirent.h, the same
+ * code the kernel runs. Inode and file data I/O do not: the kernel
+ * goes through buffer heads and the page cache, the tools through
+ * the mapping, so those routines are written separately here and
+ * follow ux_inode.c and ux_file.c by hand.
+ */
+
+#define UX_RDONLY  0
+#define UX_RDWR    1
+#define UX_PRIVATE 2	/* writable, but changes never reach the device */
+
+/*
+ * Functions that can fail return a negative errno, or from
+ * ux_open() one of these. ux_strerror() describes either kind.
+ */
+#define UX_ENOTUX  -1001	/* no ux superblock */
+#define UX_ELAYOUT -1002	/* superblock does not fit the device */
+
+struct ux_image{
+	int                   im_fd;
+	int                   im_mode;
+	char                 *im_base;
+	size_t                im_size;
+	struct ux_superblock *im_sb;
+	unsigned char        *im_imap;
+	unsigned char        *im_bmap;
+	unsigned char        *im_claimed;	/* blocks held in im_cache */
+	struct ux_alloc_cache im_cache;
+};
+
+struct ux_extent{
+	__u32 e_lblk;
+	__u32 e_pblk;
+	__u32 e_len;
+};
+
+int ux_open(struct ux_image *im, const char *path, int mode);
+void ux_image_init(struct ux_image *im, void *base, size_t size);
+const char *ux_strerror(int err);
+int ux_sync(struct ux_image *im);
+void ux_close(struct ux_image *im);
+
+char *ux_block(struct ux_image *im, __u32 nr);
+struct ux_inode *ux_inode(struct ux_image *im, __u32 ino);
+int ux_inode_inuse(struct ux_image *im, __u32 ino);
+int ux_data_block(struct ux_image *im, __u32 blk);
+
+/* which times ux_touch() sets to now */
+#define UX_ATIME 0x1
+#define UX_MTIME 0x2
+#define UX_CTIME 0x4
+void ux_touch(struct ux_inode *ip, int which);
+int ux_extents(struct ux_inode *ip, struct ux_extent *ext);
+
+__u32 ux_ialloc(struct ux_image *im);
+void ux_ifree(struct ux_image *im, __u32 ino);
+__u32 ux_balloc(struct ux_image *im, __u32 goal);
+void ux_bfree(struct ux_image *im, __u32 blk);
+
+typedef int (*ux_dir_actor)(struct ux_dirent *de, void *arg);
+int ux_dir_iterate(struct ux_image *im, struct ux_inode *dp, ux_dir_actor fn, void *arg);
+struct ux_dirent *ux_dir_find(struct ux_image *im, struct ux_inode *dp, const char *name);
+int ux_dir_add(struct ux_image *im, __u32 dir, const char *name, __u32 ino);
+int ux_dir_remove(struct ux_image *im, __u32 dir, const char *name);
+__u32 ux_namei(struct ux_image *im, const char *path);
+
+int ux_bmap(struct ux_image *im, struct ux_inode *ip, __u32 lblk, int create, __u32 *blk);
+void ux_truncate_blocks(struct ux_image *im, struct ux_inode *ip, __u32 first);
+ssize_t ux_read(struct ux_image *im, struct ux_inode *ip, void *buf, size_t len, off_t off);
+ssize_t ux_write(struct ux_image *im, struct ux_inode *ip, const void *buf, size_t len, off_t off);
+int ux_truncate(struct ux_image *im, struct ux_inode *ip, off_t size);
+void ux_free_inode(struct ux_image *im, __u32 ino);
+
+int ux_create(struct ux_image *im, __u32 dir, const char *name, __u32 mode, __u32 *inop);
+int ux_symlink(struct ux_image *im, __u32 dir, const char *name, const char *target, __u32 *inop);
+int ux_readlink(struct ux_image *im, struct ux_inode *ip, char *buf, size_t size);
+int ux_link(struct ux_image *im, __u32 ino, __u32 dir, const char *name);
+int ux_unlink(struct ux_image *im, __u32 dir, const char *name);
+int ux_rmdir(struct ux_image *im, __u32 dir, const char *name);
+int ux_rename(struct ux_image *im, __u32 odir, const char *oname, __u32 ndir, const char *nname);
+
+__u32 ux_crc32_le(__u32 crc, const unsigned char *p, size_t len);
+__u32 ux_journal_pending(struct ux_image *im, __u32 *start);
+int ux_journal_replay(struct ux_image *im);
+void ux_journal_reset(struct ux_image *im);
+
+#endif
@@ -1,118 +1,297 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <fcntl.h>
 #include <time.h>
 #include <linux/fs.h>
+#include <linux/falloc.h>
 #include <string.h>
-#include "../kern/ux_fs.h"
+#include "libuxfs.h"
+
+/*
+ * The layout is sized to the device: one inode for every
+ * BLOCKS_PER_INODE data blocks, but never fewer than UX_MAXFILES,
+ * and maps just big enough for both. Devices larger than
+ * MAX_FS_BLOCKS are only used up to that size.
+ */
+
+#define BLOCKS_PER_INODE 8
+#define MAX_FS_BLOCKS    (1 << 25)
+#define ZERO_BLOCKS      256
+
+/*
+ * Everything mkfs writes lives in a few runs of blocks. Each run
+ * is built in memory and written with one pwritev.
+ */
+
+struct run{
+	off_t        r_block;
+	int          r_cnt;
+	struct iovec r_iov[4];
+};
+
+static void add_iov(struct run *r, void *buf, size_t blocks)
+{
+	if(blocks){
+		r->r_iov[r->r_cnt].iov_base = buf;
+		r->r_iov[r->r_cnt].iov_len = blocks * UX_BSIZE;
+		r->r_cnt++;
+	}
+}
+
+static int write_run(int devfd, struct run *r)
+{
+	ssize_t len = 0, done;
+	int i;
+
+	for(i = 0; i < r->r_cnt; i++){
+		len += r->r_iov[i].iov_len;
+	}
+	done = pwritev(devfd, r->r_iov, r->r_cnt, r->r_block * UX_BSIZE);
+	return done == len ? 0 : -1;
+}
+
+/*
+ * Write "count" zeroed blocks from "block" on, ZERO_BLOCKS at a time.
+ */
+
+static int zero_blocks(int devfd, char *zero, off_t block, off_t count)
+{
+	struct run r;
+	off_t n;
+
+	while(count > 0){
+		n = count < ZERO_BLOCKS ? count : ZERO_BLOCKS;
+		memset(&r, 0, sizeof(r));
+		r.r_block = block;
+		add_iov(&r, zero, n);
+		if(write_run(devfd, &r) < 0){
+			return -1;
+		}
+		block += n;
+		count -= n;
+	}
+	return 0;
+}
+
+/*
+ * Fill in the layout of a file system of "total" blocks.
+ */
+
+static void layout(struct ux_superblock *sb, uint32_t total)
+{
+	uint32_t avail = total - 1 - UX_JOURNAL_BLOCKS, rest;
+
+	sb->s_ninodes = avail / (BLOCKS_PER_INODE + 1);
+	if(sb->s_ninodes < UX_MAXFILES){
+		sb->s_ninodes = UX_MAXFILES;
+	}
+	sb->s_imap_blocks = (sb->s_ninodes + UX_BITS_PER_BLOCK - 1) / UX_BITS_PER_BLOCK;
+	rest = avail - sb->s_ninodes - sb->s_imap_blocks;
+	sb->s_bmap_blocks = (rest + UX_BITS_PER_BLOCK) / (UX_BITS_PER_BLOCK + 1);
+	sb->s_nblocks = rest - sb->s_bmap_blocks;
+
+	sb->s_imap_block = UX_IMAP_BLOCK;
+	sb->s_bmap_block = sb->s_imap_block + sb->s_imap_blocks;
+	sb->s_inode_block = sb->s_bmap_block + sb->s_bmap_blocks;
+	sb->s_data_block = sb->s_inode_block + sb->s_ninodes;
+	sb->s_journal_block = sb->s_data_block + sb->s_nblocks;
+	sb->s_journal_blocks = UX_JOURNAL_BLOCKS;
+	sb->s_nifree = sb->s_ninodes - UX_ROOT_NO - 1;
+	sb->s_nbfree = sb->s_nblocks - 1;
+}
+
+/*
+ * Discarding the whole device up front lets thin and flash storage
+ * drop the old contents. Image files get the same effect by
+ * punching out their blocks.
+ */
+
+static void discard_device(int devfd, struct stat *st, uint64_t bytes)
+{
+	uint64_t range[2] = { 0, bytes };
+	int error;
+
+	if(S_ISBLK(st->st_mode)){
+		error = ioctl(devfd, BLKDISCARD, range);
+	} else {
+		error = fallocate(devfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, bytes);
+	}
+	if(error){
+		fprintf(stderr, "uxmkfs:discard failed, continuing\n");
+	}
+}
 
 int main(int argc, char* argv[])
 {
-	struct ux_dirent dir;
-	struct ux_superblock sb;
-	struct ux_inode inode;	
+	struct ux_image im;
+	struct ux_superblock *sb, geo;
+	struct ux_inode *inode;
+	struct ux_dirent *de;
+	struct stat st;
+	struct run runs[4];
 
 	time_t tm;
-	off_t  nsectors = UX_MAXBLOCKS;
-	int    devfd, error, i;
-	int    mapblocks;
-	char   block[UX_BSIZE];
+	off_t  nsectors = UX_FIRST_DATA_BLOCK + UX_MAXBLOCKS + UX_JOURNAL_BLOCKS;
+	uint64_t devsize, fssize = (uint64_t)nsectors * UX_BSIZE;
+	uint32_t total, nmeta;
+	int    devfd, c, discard = 0, lazy = 0;
+	int    itable, nruns = 0, i;
+	char   *meta, *root, *zero;
 
-	if(argc != 2){
-		fprintf(stderr, "uxmkfs:needs device name\n");
-		_exit(1);
+	while((c = getopt(argc, argv, "dl")) != -1){
+		switch(c){
+		case 'd':
+			discard = 1;
+			break;
+		case 'l':
+			lazy = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: uxmkfs [-d] [-l] device\n");
+			_exit(1);
+		}
 	}
-	
-	devfd = open(argv[1], O_WRONLY);	
-	if(devfd < 0){
-		fprintf(stderr, "uxmkfs:failed to open device\n");
+	if(optind != argc - 1){
+		fprintf(stderr, "uxmkfs:needs device name\n");
 		_exit(1);
 	}
 
-	error = lseek(devfd, (off_t)(nsectors*UX_BSIZE), SEEK_SET);
-	if(error == -1){
-		fprintf(stderr, "uxmkfs:can not create file system of specified size\n");
+	devfd = open(argv[optind], O_RDWR);
+	if(devfd < 0 || fstat(devfd, &st) < 0){
+		fprintf(stderr, "uxmkfs:failed to open device\n");
 		_exit(1);
 	}
-	lseek(devfd, 0, SEEK_SET);
-	
-	/*
-	fill in the super block, then write it to the first block of device
-	*/
-	
-	sb.s_magic = UX_MAGIC;
-	sb.s_mode = UX_FSCLEAN;
-	sb.s_nifree = UX_MAXFILES - 2;
-	sb.s_nbfree = UX_MAXBLOCKS - 2;
 
 	/*
-	first 2 nodes are in use. 
-	Inodes 0 is not used by anything, 2 is the root directory
+	size the device. block devices must already be big enough,
+	image files are extended to the smallest size
 	*/
 
-	sb.s_inode[0] = UX_INODE_INUSE;
-	sb.s_inode[1] = UX_INODE_INUSE;
+	if(S_ISBLK(st.st_mode)){
+		if(ioctl(devfd, BLKGETSIZE64, &devsize) < 0){
+			fprintf(stderr, "uxmkfs:can not get device size\n");
+			_exit(1);
+		}
+	} else if(S_ISREG(st.st_mode)){
+		devsize = st.st_size;
+	} else {
+		fprintf(stderr, "uxmkfs:not a block device or regular file\n");
+		_exit(1);
+	}
+	if(devsize < fssize){
+		if(!S_ISREG(st.st_mode) || ftruncate(devfd, fssize) < 0){
+			fprintf(stderr, "uxmkfs:can not create file system of specified size\n");
+			_exit(1);
+		}
+		devsize = fssize;
+	}
+	total = devsize / UX_BSIZE < MAX_FS_BLOCKS ? devsize / UX_BSIZE : MAX_FS_BLOCKS;
+	if(discard){
+		discard_device(devfd, &st, (uint64_t)total * UX_BSIZE);
+	}
 
 	/*
-	rest nodes are marked as unused
+	the superblock, the maps and the inodes up to the root inode
+	are built in one buffer, the root directory block in another.
+	the rest of the inode table is written as zeroes, or with -l
+	left to the kernel
 	*/
-	for(i = 2; i < UX_MAXFILES; i++){
-		sb.s_inode[i] = UX_INODE_FREE;
+
+	memset(&geo, 0, sizeof(geo));
+	layout(&geo, total);
+	nmeta = geo.s_inode_block + UX_ROOT_NO + 1;
+	if(posix_memalign((void **)&meta, 4096, (size_t)nmeta * UX_BSIZE) ||
+	   posix_memalign((void **)&root, 4096, UX_BSIZE) ||
+	   posix_memalign((void **)&zero, 4096, ZERO_BLOCKS * UX_BSIZE)){
+		fprintf(stderr, "uxmkfs:out of memory\n");
+		_exit(1);
 	}
+	memset(meta, 0, (size_t)nmeta * UX_BSIZE);
+	memset(root, 0, UX_BSIZE);
+	memset(zero, 0, ZERO_BLOCKS * UX_BSIZE);
 
 	/*
-	the first 2 blocks are allocated for the entries of the root directory
+	fill in the super block
 	*/
 
-	sb.s_block[0] = UX_BLOCK_INUSE;
-	sb.s_block[1] = UX_BLOCK_INUSE;
+	sb = (struct ux_superblock *)meta;
+	*sb = geo;
+	itable = lazy ? UX_ROOT_NO + 1 : sb->s_ninodes;
+	sb->s_magic = UX_MAGIC;
+	sb->s_mode = UX_FSCLEAN;
+	sb->s_flags = lazy ? UX_LAZY_ITABLE : 0;
+	sb->s_inode_init = itable;
 
 	/*
-	the rest blocks are marked as free
+	inodes 0 and 1 are not used by anything, 2 is the root directory.
+	the first data block is allocated for the entries of the root
+	directory. the rest of both maps is free
 	*/
 
-	for(i = 2; i < UX_MAXBLOCKS; i++){
-		sb.s_block[i] = UX_BLOCK_FREE;
+	ux_image_init(&im, meta, (size_t)nmeta * UX_BSIZE);
+	for(i = 0; i <= UX_ROOT_NO; i++){
+		ux_map_set(im.im_imap, i);
 	}
-
-	write(devfd, &sb, sizeof(struct ux_superblock));
+	ux_map_set(im.im_bmap, 0);
 
 	/*
 	the root directory inode must be initialized
 	*/
+
 	time(&tm);
-	memset((void*)&inode, 0, sizeof(struct ux_inode));
-	inode.i_mode = S_IFDIR | 0755;
-	inode.i_nlink = 2;
-	inode.i_atime = tm;
-	inode.i_mtime = tm;
-	inode.i_ctime = tm;
-	
-	inode.i_gid = 0;
-	inode.i_uid = 0;
-	inode.i_size = UX_BSIZE;
-	inode.i_blocks = 1;
-	inode.i_addr[0] = UX_FIRST_DATA_BLOCK;
-
-	lseek(devfd, UX_INODE_BLOCK * UX_BSIZE + 1024, SEEK_SET );
-	write(devfd, (char*)&inode, sizeof(struct ux_superblock));
+	inode = ux_inode(&im, UX_ROOT_NO);
+	inode->i_mode = S_IFDIR | 0755;
+	inode->i_nlink = 2;
+	inode->i_atime = tm;
+	inode->i_mtime = tm;
+	inode->i_ctime = tm;
+	inode->i_gid = 0;
+	inode->i_uid = 0;
+	inode->i_size = UX_BSIZE;
+	inode->i_blocks = 1;
+	inode->i_addr[0] = sb->s_data_block;
 
 	/* fill in the directory for root */
 
-	lseek(devfd, UX_FIRST_DATA_BLOCK * UX_BSIZE, SEEK_SET);
-	memset((void*)&block, 0, UX_BSIZE);
-	write(devfd, block, UX_BSIZE);
-	lseek(devfd, UX_FIRST_DATA_BLOCK * UX_BSIZE, SEEK_SET);
-	
-	memset(&dir, 0, sizeof(dir));
-	dir.d_ino = 2;
-	strcpy(dir.d_name, ".");
-	write(devfd, (char*)&dir, sizeof(struct ux_dirent));
-	
-	memset(&dir, 0, sizeof(dir));
-	dir.d_ino = 2;
-	strcpy(dir.d_name, "..");
-	write(devfd, (char*)&dir, sizeof(struct ux_dirent));
+	de = (struct ux_dirent *)root;
+	ux_set_dirent(&de[0], ".", 1, UX_ROOT_NO);
+	ux_set_dirent(&de[1], "..", 2, UX_ROOT_NO);
+
+	/*
+	the journal follows the data blocks. clearing the first block of
+	each half is enough for it to hold no transaction
+	*/
+
+	memset(runs, 0, sizeof(runs));
+	add_iov(&runs[nruns++], meta, nmeta);
+	runs[nruns].r_block = sb->s_data_block;
+	add_iov(&runs[nruns++], root, 1);
+	runs[nruns].r_block = sb->s_journal_block;
+	add_iov(&runs[nruns++], zero, 1);
+	runs[nruns].r_block = sb->s_journal_block + UX_JOURNAL_BLOCKS / 2;
+	add_iov(&runs[nruns++], zero, 1);
+
+	for(i = 0; i < nruns; i++){
+		if(write_run(devfd, &runs[i]) < 0){
+			fprintf(stderr, "uxmkfs:write failed\n");
+			_exit(1);
+		}
+	}
+	if(zero_blocks(devfd, zero, sb->s_inode_block + UX_ROOT_NO + 1,
+		       itable - (UX_ROOT_NO + 1)) < 0){
+		fprintf(stderr, "uxmkfs:write failed\n");
+		_exit(1);
+	}
+	if(fsync(devfd) < 0){
+		fprintf(stderr, "uxmkfs:write failed\n");
+		_exit(1);
+	}
+	return 0;
 }
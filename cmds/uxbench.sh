@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# Run uxbench against a fresh uxfs image on a loop device.
+#
+#   uxbench.sh [-f] [-l] [-b baseline] [-o results] [uxbench options]
+#
+# -f mounts the image with uxfuse instead of the kernel module, -l
+# makes it with a lazy inode table. The table goes to stdout and the
+# JSON results to the -o file (default uxbench.json), which a later
+# run can take as its -b baseline. The kernel mount needs root and
+# uxfs.ko loaded.
+#
+
+set -e
+
+here=$(cd "$(dirname "$0")" && pwd)
+fuse=0
+mkfsopt=
+out=uxbench.json
+base=
+
+while getopts flb:o: c; do
+	case $c in
+	f) fuse=1 ;;
+	l) mkfsopt=-l ;;
+	b) base=$OPTARG ;;
+	o) out=$OPTARG ;;
+	*) echo "usage: uxbench.sh [-f] [-l] [-b baseline] [-o results] [uxbench options]" >&2
+	   exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+work=$(mktemp -d)
+img=$work/img
+mnt=$work/mnt
+mkdir "$mnt"
+: > "$img"
+"$here/uxmkfs" $mkfsopt "$img"
+
+if [ $fuse = 1 ]; then
+	"$here/uxfuse" "$img" "$mnt"
+	umount_cmd="fusermount3 -u $mnt"
+else
+	mount -t uxfs -o loop "$img" "$mnt"
+	umount_cmd="umount $mnt"
+fi
+trap '$umount_cmd; rm -rf "$work"' EXIT
+
+"$here/uxbench" -o "$out" ${base:+-b "$base"} "$@" "$mnt"
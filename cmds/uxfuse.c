@@ -0,0 +1,578 @@
+#define FUSE_USE_VERSION 31
+#include <fuse.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "libuxfs.h"
+
+/*
+ * uxfuse: mount a uxfs image through FUSE, for hosts that can not
+ * load the kernel module. The file system code is libuxfs; this
+ * file only turns paths into inode numbers. Every operation holds
+ * one lock, so libuxfs never sees two callers at once.
+ *
+ * There is no journal here. The image is marked dirty while it is
+ * mounted and clean again at unmount, and uxfsck checks an image
+ * that was not unmounted cleanly.
+ */
+
+static struct ux_image img;
+static pthread_mutex_t ux_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Split path into its parent directory and last component.
+ */
+
+static int ux_parent(const char *path, __u32 *dir, char *name)
+{
+	const char *p = strrchr(path, '/');
+	char parent[4096];
+	size_t len;
+
+	if(!p || !p[1]){
+		return -EINVAL;
+	}
+	if(strlen(p + 1) > UX_NAMELEN){
+		return -ENAMETOOLONG;
+	}
+	strcpy(name, p + 1);
+	len = p - path;
+	if(len >= sizeof(parent)){
+		return -ENAMETOOLONG;
+	}
+	memcpy(parent, path, len);
+	parent[len] = '\0';
+	*dir = ux_namei(&img, len ? parent : "/");
+	return *dir ? 0 : -ENOENT;
+}
+
+static struct ux_inode *ux_path(const char *path, __u32 *inop)
+{
+	__u32 ino = ux_namei(&img, path);
+
+	if(inop){
+		*inop = ino;
+	}
+	return ino ? ux_inode(&img, ino) : NULL;
+}
+
+/*
+ * Open files carry their inode number, so I/O does not depend on
+ * the path staying valid.
+ */
+
+static struct ux_inode *ux_file(const char *path, struct fuse_file_info *fi)
+{
+	if(fi && fi->fh){
+		return ux_inode(&img, fi->fh);
+	}
+	return ux_path(path, NULL);
+}
+
+static void ux_stat(__u32 ino, struct ux_inode *ip, struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_ino = ino;
+	st->st_mode = ip->i_mode;
+	st->st_nlink = ip->i_nlink;
+	st->st_uid = ip->i_uid;
+	st->st_gid = ip->i_gid;
+	st->st_size = ip->i_size;
+	st->st_blksize = UX_BSIZE;
+	st->st_blocks = ip->i_blocks;
+	st->st_atim.tv_sec = ip->i_atime;
+	st->st_atim.tv_nsec = ip->i_atime_nsec;
+	st->st_mtim.tv_sec = ip->i_mtime;
+	st->st_mtim.tv_nsec = ip->i_mtime_nsec;
+	st->st_ctim.tv_sec = ip->i_ctime;
+	st->st_ctim.tv_nsec = ip->i_ctime_nsec;
+}
+
+static int uxf_getattr(const char *path, struct stat *st, struct fuse_file_info *fi)
+{
+	struct ux_inode *ip;
+	__u32 ino;
+	int err = 0;
+
+	pthread_mutex_lock(&ux_lock);
+	if(fi && fi->fh){
+		ino = fi->fh;
+		ip = ux_inode(&img, ino);
+	}
+	else{
+		ip = ux_path(path, &ino);
+	}
+	if(ip){
+		ux_stat(ino, ip, st);
+	}
+	else{
+		err = -ENOENT;
+	}
+	pthread_mutex_unlock(&ux_lock);
+	return err;
+}
+
+struct ux_fill{
+	void            *buf;
+	fuse_fill_dir_t  filler;
+};
+
+static int uxf_fill(struct ux_dirent *de, void *arg)
+{
+	struct ux_fill *f = arg;
+	struct ux_inode *ip = ux_inode(&img, de->d_ino);
+	struct stat st;
+
+	memset(&st, 0, sizeof(st));
+	st.st_ino = de->d_ino;
+	st.st_mode = ip ? ip->i_mode : 0;
+	return f->filler(f->buf, de->d_name, &st, 0, 0);
+}
+
+static int uxf_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off,
+		       struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+	struct ux_fill f = { buf, filler };
+	struct ux_inode *dp;
+	int err = 0;
+
+	(void)off;
+	(void)fi;
+	(void)flags;
+	pthread_mutex_lock(&ux_lock);
+	dp = ux_path(path, NULL);
+	if(!dp){
+		err = -ENOENT;
+	}
+	else if(!S_ISDIR(dp->i_mode)){
+		err = -ENOTDIR;
+	}
+	else{
+		ux_dir_iterate(&img, dp, uxf_fill, &f);
+	}
+	pthread_mutex_unlock(&ux_lock);
+	return err;
+}
+
+static int ux_make(const char *path, mode_t mode, __u32 *inop)
+{
+	struct fuse_context *ctx = fuse_get_context();
+	struct ux_inode *ip;
+	char name[UX_NAMELEN + 1];
+	__u32 dir;
+	int err;
+
+	pthread_mutex_lock(&ux_lock);
+	err = ux_parent(path, &dir, name);
+	if(!err){
+		err = ux_create(&img, dir, name, mode, inop);
+	}
+	if(!err){
+		ip = ux_inode(&img, *inop);
+		ip->i_uid = ctx->uid;
+		ip->i_gid = ctx->gid;
+	}
+	pthread_mutex_unlock(&ux_lock);
+	return err;
+}
+
+/*
+ * Only regular files and directories can be created, as with the
+ * kernel module.
+ */
+
+static int uxf_mknod(const char *path, mode_t mode, dev_t dev)
+{
+	__u32 ino;
+
+	(void)dev;
+	if(!S_ISREG(mode)){
+		return -EPERM;
+	}
+	return ux_make(path, mode, &ino);
+}
+
+static int uxf_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	__u32 ino;
+	int err;
+
+	err = ux_make(path, S_IFREG | (mode & 07777), &ino);
+	if(!err){
+		fi->fh = ino;
+	}
+	return err;
+}
+
+static int uxf_mkdir(const char *path, mode_t mode)
+{
+	__u32 ino;
+
+	return ux_make(path, S_IFDIR | (mode & 07777), &ino);
+}
+
+static int uxf_unlink(const char *path)
+{
+	char name[UX_NAMELEN + 1];
+	__u32 dir;
+	int err;
+
+	pthread_mutex_lock(&ux_lock);
+	err = ux_parent(path, &dir, name);
+	if(!err){
+		err = ux_unlink(&img, dir, name);
+	}
+	pthread_mutex_unlock(&ux_lock);
+	return err;
+}
+
+static int uxf_rmdir(const char *path)
+{
+	char name[UX_NAMELEN + 1];
+	__u32 dir;
+	int err;
+
+	pthread_mutex_lock(&ux_lock);
+	err = ux_parent(path, &dir, name);
+	if(!err){
+		err = ux_rmdir(&img, dir, name);
+	}
+	pthread_mutex_unlock(&ux_lock);
+	return err;
+}
+
+static int uxf_symlink(const char *target, const char *path)
+{
+	struct fuse_context *ctx = fuse_get_context();
+	struct ux_inode *ip;
+	char name[UX_NAMELEN + 1];
+	__u32 dir, ino;
+	int err;
+
+	pthread_mutex_lock(&ux_lock);
+	err = ux_parent(path, &dir, name);
+	if(!err){
+		err = ux_symlink(&img, dir, name, target, &ino);
+	}
+	if(!err){
+		ip = ux_inode(&img, ino);
+		ip->i_uid = ctx->uid;
+		ip->i_gid = ctx->gid;
+	}
+	pthread_mutex_unlock(&ux_lock);
+	return err;
+}
+
+static int uxf_readlink(const char *path, char *buf, size_t size)
+{
+	struct ux_inode *ip;
+	int err;
+
+	pthread_mutex_lock(&ux_lock);
+	ip = ux_path(path, NULL);
+	err = ip ? ux_readlink(&img, ip, buf, size) : -ENOENT;
+	pthread_mutex_unlock(&ux_lock);
+	return err;
+}
+
+static int uxf_link(const char *from, const char *to)
+{
+	char name[UX_NAMELEN + 1];
+	__u32 dir, ino;
+	int err;
+
+	pthread_mutex_lock(&ux_lock);
+	err = ux_parent(to, &dir, name);
+	if(!err){
+		err = ux_path(from, &ino) ? ux_link(&img, ino, dir, name) : -ENOENT;
+	}
+	pthread_mutex_unlock(&ux_lock);
+	return err;
+}
+
+static int uxf_rename(const char *from, const char *to, unsigned int flags)
+{
+	char oname[UX_NAMELEN + 1], nname[UX_NAMELEN + 1];
+	__u32 odir, ndir;
+	int err;
+
+	if(flags){
+		return -EINVAL;
+	}
+	pthread_mutex_lock(&ux_lock);
+	err = ux_parent(from, &odir, oname);
+	if(!err){
+		err = ux_parent(to, &ndir, nname);
+	}
+	if(!err){
+		err = ux_rename(&img, odir, oname, ndir, nname);
+	}
+	pthread_mutex_unlock(&ux_lock);
+	return err;
+}
+
+static int uxf_chmod(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	struct ux_inode *ip;
+	int err = 0;
+
+	pthread_mutex_lock(&ux_lock);
+	ip = ux_file(path, fi);
+	if(ip){
+		ip->i_mode = (ip->i_mode & S_IFMT) | (mode & 07777);
+		ux_touch(ip, UX_CTIME);
+	}
+	else{
+		err = -ENOENT;
+	}
+	pthread_mutex_unlock(&ux_lock);
+	return err;
+}
+
+static int uxf_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi)
+{
+	struct ux_inode *ip;
+	int err = 0;
+
+	pthread_mutex_lock(&ux_lock);
+	ip = ux_file(path, fi);
+	if(ip){
+		if(uid != (uid_t)-1){
+			ip->i_uid = uid;
+		}
+		if(gid != (gid_t)-1){
+			ip->i_gid = gid;
+		}
+		ux_touch(ip, UX_CTIME);
+	}
+	else{
+		err = -ENOENT;
+	}
+	pthread_mutex_unlock(&ux_lock);
+	return err;
+}
+
+static int uxf_truncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+	struct ux_inode *ip;
+	int err;
+
+	pthread_mutex_lock(&ux_lock);
+	ip = ux_file(path, fi);
+	if(!ip){
+		err = -ENOENT;
+	}
+	else if(S_ISDIR(ip->i_mode)){
+		err = -EISDIR;
+	}
+	else{
+		err = ux_truncate(&img, ip, size);
+	}
+	pthread_mutex_unlock(&ux_lock);
+	return err;
+}
+
+static int uxf_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi)
+{
+	struct ux_inode *ip;
+	int err = 0;
+
+	pthread_mutex_lock(&ux_lock);
+	ip = ux_file(path, fi);
+	if(ip){
+		ux_touch(ip, UX_CTIME);
+		if(tv[0].tv_nsec == UTIME_NOW){
+			ux_touch(ip, UX_ATIME);
+		}
+		else if(tv[0].tv_nsec != UTIME_OMIT){
+			ip->i_atime = tv[0].tv_sec;
+			ip->i_atime_nsec = tv[0].tv_nsec;
+		}
+		if(tv[1].tv_nsec == UTIME_NOW){
+			ux_touch(ip, UX_MTIME);
+		}
+		else if(tv[1].tv_nsec != UTIME_OMIT){
+			ip->i_mtime = tv[1].tv_sec;
+			ip->i_mtime_nsec = tv[1].tv_nsec;
+		}
+	}
+	else{
+		err = -ENOENT;
+	}
+	pthread_mutex_unlock(&ux_lock);
+	return err;
+}
+
+static int uxf_open(const char *path, struct fuse_file_info *fi)
+{
+	struct ux_inode *ip;
+	__u32 ino;
+	int err = 0;
+
+	pthread_mutex_lock(&ux_lock);
+	ip = ux_path(path, &ino);
+	if(!ip){
+		err = -ENOENT;
+	}
+	else if(S_ISDIR(ip->i_mode)){
+		err = -EISDIR;
+	}
+	else{
+		fi->fh = ino;
+		if(fi->flags & O_TRUNC){
+			err = ux_truncate(&img, ip, 0);
+		}
+	}
+	pthread_mutex_unlock(&ux_lock);
+	return err;
+}
+
+static int uxf_read(const char *path, char *buf, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	struct ux_inode *ip;
+	ssize_t n;
+
+	pthread_mutex_lock(&ux_lock);
+	ip = ux_file(path, fi);
+	n = ip ? ux_read(&img, ip, buf, size, off) : -ENOENT;
+	pthread_mutex_unlock(&ux_lock);
+	return n;
+}
+
+static int uxf_write(const char *path, const char *buf, size_t size, off_t off,
+		     struct fuse_file_info *fi)
+{
+	struct ux_inode *ip;
+	ssize_t n;
+
+	pthread_mutex_lock(&ux_lock);
+	ip = ux_file(path, fi);
+	if(ip && (fi->flags & O_APPEND)){
+		off = ip->i_size;
+	}
+	n = ip ? ux_write(&img, ip, buf, size, off) : -ENOENT;
+	pthread_mutex_unlock(&ux_lock);
+	return n;
+}
+
+static int uxf_statfs(const char *path, struct statvfs *st)
+{
+	struct ux_superblock *sb = img.im_sb;
+
+	(void)path;
+	memset(st, 0, sizeof(*st));
+	pthread_mutex_lock(&ux_lock);
+	st->f_bsize = UX_BSIZE;
+	st->f_frsize = UX_BSIZE;
+	st->f_blocks = sb->s_nblocks;
+	st->f_bfree = sb->s_nbfree;
+	st->f_bavail = sb->s_nbfree;
+	st->f_files = sb->s_ninodes;
+	st->f_ffree = sb->s_nifree;
+	st->f_favail = sb->s_nifree;
+	st->f_namemax = UX_NAMELEN;
+	pthread_mutex_unlock(&ux_lock);
+	return 0;
+}
+
+static int uxf_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	int err;
+
+	(void)path;
+	(void)datasync;
+	(void)fi;
+	pthread_mutex_lock(&ux_lock);
+	err = ux_sync(&img);
+	pthread_mutex_unlock(&ux_lock);
+	return err;
+}
+
+static void *uxf_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+	(void)conn;
+	cfg->use_ino = 1;
+	return NULL;
+}
+
+static void uxf_destroy(void *data)
+{
+	(void)data;
+	img.im_sb->s_mode = UX_FSCLEAN;
+	if(ux_sync(&img) < 0){
+		fprintf(stderr, "uxfuse: failed to write image\n");
+	}
+	ux_close(&img);
+}
+
+static const struct fuse_operations uxf_ops = {
+	.getattr  = uxf_getattr,
+	.readlink = uxf_readlink,
+	.mknod    = uxf_mknod,
+	.mkdir    = uxf_mkdir,
+	.unlink   = uxf_unlink,
+	.rmdir    = uxf_rmdir,
+	.symlink  = uxf_symlink,
+	.rename   = uxf_rename,
+	.link     = uxf_link,
+	.chmod    = uxf_chmod,
+	.chown    = uxf_chown,
+	.truncate = uxf_truncate,
+	.open     = uxf_open,
+	.read     = uxf_read,
+	.write    = uxf_write,
+	.statfs   = uxf_statfs,
+	.fsync    = uxf_fsync,
+	.readdir  = uxf_readdir,
+	.init     = uxf_init,
+	.destroy  = uxf_destroy,
+	.create   = uxf_create,
+	.utimens  = uxf_utimens,
+};
+
+/*
+ * uxfuse image mountpoint [fuse options]
+ */
+
+int main(int argc, char *argv[])
+{
+	__u32 seq, start;
+	int err;
+
+	if(argc < 3){
+		fprintf(stderr, "usage: uxfuse image mountpoint [fuse options]\n");
+		return 1;
+	}
+	err = ux_open(&img, argv[1], UX_RDWR);
+	if(err){
+		fprintf(stderr, "uxfuse: %s: %s\n", argv[1], ux_strerror(err));
+		return 1;
+	}
+
+	/*
+	 * Finish what the kernel left in its journal, then empty it so
+	 * the kernel does not replay it over our changes later.
+	 */
+
+	seq = ux_journal_pending(&img, &start);
+	if(seq){
+		fprintf(stderr, "uxfuse: replaying journal transaction %u (%d blocks)\n",
+			seq, ux_journal_replay(&img));
+	}
+	ux_journal_reset(&img);
+	img.im_sb->s_mode = UX_FSDIRTY;
+	if(ux_sync(&img) < 0){
+		fprintf(stderr, "uxfuse: failed to write image\n");
+		ux_close(&img);
+		return 1;
+	}
+	argv[1] = argv[0];
+	return fuse_main(argc - 1, argv + 1, &uxf_ops, NULL);
+}
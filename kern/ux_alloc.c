@@ -3,11 +3,83 @@
 #include <linux/fs.h>
 #include <linux/slab.h>
 #include <linux/init.h>
+#include <linux/percpu.h>
+#include <linux/bitops.h>
+#include <linux/string.h>
+#include <linux/sort.h>
+#include <linux/list_sort.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
 #include <asm/uaccess.h>
 #include "ux_fs.h"
+#include "ux_map.h"
 
 /*
- * Allocate a new inode. We update the superblock and return
+ * Count the clear bits of a map.
+ */
+
+static __u32 ux_count_free(struct buffer_head **map, __u32 nbits)
+{
+	__u32 blk, len, used = 0;
+
+	for (blk = 0 ; blk * UX_BITS_PER_BLOCK < nbits ; blk++) {
+		len = min_t(__u32, UX_BITS_PER_BLOCK, nbits - blk * UX_BITS_PER_BLOCK);
+		used += memweight(map[blk]->b_data, len / 8);
+		while (len % 8)
+			used += test_bit_le(--len, map[blk]->b_data);
+	}
+	return nbits - used;
+}
+
+/*
+ * Set or clear one bit of a map and log the map block that
+ * holds it. Only that block is written back, never the superblock.
+ * Called with u_lock held.
+ */
+
+static void ux_set_bit(struct super_block *sb, struct buffer_head **map, __u32 nr)
+{
+	struct buffer_head *bh = map[nr / UX_BITS_PER_BLOCK];
+
+	__set_bit_le(nr % UX_BITS_PER_BLOCK, bh->b_data);
+	ux_journal_dirty(sb, bh);
+}
+
+static int ux_clear_bit(struct super_block *sb, struct buffer_head **map, __u32 nr)
+{
+	struct buffer_head *bh = map[nr / UX_BITS_PER_BLOCK];
+
+	if (!__test_and_clear_bit_le(nr % UX_BITS_PER_BLOCK, bh->b_data))
+		return 0;
+	ux_journal_dirty(sb, bh);
+	return 1;
+}
+
+/*
+ * Clear an inode block that mkfs left unwritten. The block is
+ * logged in the same transaction as the superblock that records
+ * it as initialized.
+ */
+
+static int ux_itable_init(struct super_block *sb, __u32 ino)
+{
+	struct ux_fs	   *fs = (struct ux_fs *)sb->s_fs_info;
+	struct buffer_head *bh;
+
+	bh = sb_getblk(sb, fs->u_sb->s_inode_block + ino);
+	if (!bh)
+		return -EIO;
+	lock_buffer(bh);
+	memset(bh->b_data, 0, UX_BSIZE);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	ux_journal_dirty(sb, bh);
+	brelse(bh);
+	return 0;
+}
+
+/*
+ * Allocate a new inode. We update the inode map and return
  * the inode number.
  */
 
@@ -15,52 +87,808 @@ ino_t ux_ialloc(struct super_block *sb)
 {
 	struct ux_fs	      *fs = (struct ux_fs *)sb->s_fs_info;
 	struct ux_superblock  *usb = fs->u_sb;
-	int		      i;
+	__u32		      i;
+	int		      init = 0;
 
-	if (usb->s_nifree == 0) {
+	spin_lock(&fs->u_lock);
+	if (fs->u_nifree == 0) {
+		spin_unlock(&fs->u_lock);
 		printk("uxfs: Out of inodes\n");
 		return 0;
 	}
-	for (i = 3 ; i < UX_MAXFILES ; i++) {
-		if (usb->s_inode[i] == UX_INODE_FREE) {
-			usb->s_inode[i] = UX_INODE_INUSE;
-			usb->s_nifree--;
-			usb->s_nbfree--;
-			return i;
+	i = ux_map_find(fs->u_imap, usb->s_ninodes, UX_ROOT_NO + 1, 0);
+	if (i < usb->s_ninodes) {
+		ux_set_bit(sb, fs->u_imap, i);
+		fs->u_nifree--;
+
+		/*
+		 * The lowest free inode is never more than one past
+		 * the initialized part of a lazy table.
+		 */
+		if ((usb->s_flags & UX_LAZY_ITABLE) && i >= usb->s_inode_init) {
+			usb->s_inode_init = i + 1;
+			ux_journal_dirty(sb, fs->u_sbh);
+			init = 1;
+		}
+		spin_unlock(&fs->u_lock);
+		if (init && ux_itable_init(sb, i)) {
+			printk("uxfs: unable to initialize inode %u\n", i);
+			ux_ifree(sb, i);
+			return 0;
 		}
+		return i;
 	}
+	spin_unlock(&fs->u_lock);
 	printk("uxfs: ux_ialloc - We should never reach here\n");
 	return 0;
 }
 
 /*
- * Allocate a new data block. We update the superblock and return
- * the new block  number.
+ * Release an inode back to the inode map.
+ */
+
+void ux_ifree(struct super_block *sb, ino_t inum)
+{
+	struct ux_fs	      *fs = (struct ux_fs *)sb->s_fs_info;
+
+	if (inum <= UX_ROOT_NO || inum >= fs->u_sb->s_ninodes) {
+		printk("uxfs: ux_ifree - bad inode %lu\n", (unsigned long)inum);
+		return;
+	}
+	spin_lock(&fs->u_lock);
+	if (ux_clear_bit(sb, fs->u_imap, inum))
+		fs->u_nifree++;
+	else
+		printk("uxfs: ux_ifree - inode %lu already free\n", (unsigned long)inum);
+	spin_unlock(&fs->u_lock);
+}
+
+/*
+ * Claim up to UX_ALLOC_BATCH free blocks for one CPU's cache,
+ * starting at that cache's own search position. Called with the
+ * cache lock held. The claimed blocks are marked in u_claimed,
+ * which keeps them out of everybody else's way until this CPU
+ * hands them out or gives them back, but not in the block map:
+ * a block only becomes in use on disk once it is handed out.
+ */
+
+static void ux_refill_cache(struct super_block *sb, struct ux_alloc_cache *cache)
+{
+	struct ux_fs	      *fs = (struct ux_fs *)sb->s_fs_info;
+	struct ux_superblock  *usb = fs->u_sb;
+
+	spin_lock(&fs->u_lock);
+	fs->u_nbfree -= ux_cache_refill(cache, fs->u_bmap, fs->u_claimed, usb->s_nblocks,
+					usb->s_data_block, fs->u_nbfree);
+	spin_unlock(&fs->u_lock);
+}
+
+/*
+ * The map is empty, but other CPUs may still be sitting on
+ * pre-claimed blocks. Take one of theirs.
+ */
+
+static __u32 ux_steal_block(struct super_block *sb)
+{
+	struct ux_fs	      *fs = (struct ux_fs *)sb->s_fs_info;
+	struct ux_alloc_cache *cache;
+	__u32		      blk = 0;
+	int		      cpu;
+
+	for_each_possible_cpu(cpu) {
+		cache = per_cpu_ptr(fs->u_cache, cpu);
+		spin_lock(&cache->c_lock);
+		blk = ux_cache_take(cache);
+		spin_unlock(&cache->c_lock);
+		if (blk)
+			break;
+	}
+	return blk;
+}
+
+/*
+ * A block leaves a per-CPU cache. Mark it in use in the block map
+ * and log the map block, in the caller's transaction.
+ */
+
+static void ux_use_block(struct super_block *sb, __u32 blk)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+	__u32	     nr = blk - fs->u_sb->s_data_block;
+
+	spin_lock(&fs->u_lock);
+	__clear_bit_le(nr, fs->u_claimed);
+	ux_set_bit(sb, fs->u_bmap, nr);
+	spin_unlock(&fs->u_lock);
+}
+
+/*
+ * Allocate a new data block and return the new block number.
+ * Blocks come from a small per-CPU cache, so writers running
+ * on different CPUs only meet on the map lock once per
+ * UX_ALLOC_BATCH blocks, and each CPU allocates from its own
+ * region of the disk.
  */
 
 __u32 ux_block_alloc(struct super_block *sb)
+{
+	struct ux_fs	      *fs = (struct ux_fs *)sb->s_fs_info;
+	struct ux_alloc_cache *cache;
+	__u32		      blk = 0;
+
+	cache = raw_cpu_ptr(fs->u_cache);
+	spin_lock(&cache->c_lock);
+	blk = ux_cache_take(cache);
+	spin_unlock(&cache->c_lock);
+
+	/*
+	 * Refilling takes free blocks from the map, which discard
+	 * holds still while it works on them.
+	 */
+
+	if (!blk) {
+		down_read(&fs->u_trim_sem);
+		spin_lock(&cache->c_lock);
+		blk = ux_cache_take(cache);
+		if (!blk) {
+			ux_refill_cache(sb, cache);
+			blk = ux_cache_take(cache);
+		}
+		spin_unlock(&cache->c_lock);
+		up_read(&fs->u_trim_sem);
+	}
+
+	if (!blk)
+		blk = ux_steal_block(sb);
+	if (blk)
+		ux_use_block(sb, blk);
+	else
+		printk("uxfs: Out of space\n");
+	return blk;
+}
+
+/*
+ * Claim "count" contiguous data blocks, straight from the map
+ * rather than from the per-CPU caches. Like a cache's blocks they
+ * are only marked in u_claimed, so a crash before they are used
+ * loses nothing. Returns the first block, or 0 if there is no free
+ * run that long.
+ */
+
+__u32 ux_block_claim_run(struct super_block *sb, __u32 count)
+{
+	struct ux_fs	      *fs = (struct ux_fs *)sb->s_fs_info;
+	struct ux_superblock  *usb = fs->u_sb;
+	__u32		      start, i, blk = 0;
+
+	down_read(&fs->u_trim_sem);
+	spin_lock(&fs->u_lock);
+	if (count && fs->u_nbfree >= count) {
+		start = ux_find_free_run(fs->u_bmap, fs->u_claimed, usb->s_nblocks, count);
+		if (start < usb->s_nblocks) {
+			for (i = start ; i < start + count ; i++)
+				__set_bit_le(i, fs->u_claimed);
+			fs->u_nbfree -= count;
+			blk = usb->s_data_block + start;
+		}
+	}
+	spin_unlock(&fs->u_lock);
+	up_read(&fs->u_trim_sem);
+	return blk;
+}
+
+/*
+ * Mark a claimed run in use in the block map, in the caller's
+ * transaction.
+ */
+
+void ux_block_use_run(struct super_block *sb, __u32 blk, __u32 count)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+	__u32	     nr = blk - fs->u_sb->s_data_block, i;
+
+	spin_lock(&fs->u_lock);
+	for (i = nr ; i < nr + count ; i++) {
+		__clear_bit_le(i, fs->u_claimed);
+		ux_set_bit(sb, fs->u_bmap, i);
+	}
+	spin_unlock(&fs->u_lock);
+}
+
+/*
+ * Give back a claimed run that was never used.
+ */
+
+void ux_block_unclaim_run(struct super_block *sb, __u32 blk, __u32 count)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+	__u32	     nr = blk - fs->u_sb->s_data_block, i;
+
+	spin_lock(&fs->u_lock);
+	for (i = nr ; i < nr + count ; i++)
+		__clear_bit_le(i, fs->u_claimed);
+	fs->u_nbfree += count;
+	spin_unlock(&fs->u_lock);
+}
+
+/*
+ * Allocate "count" contiguous data blocks in the caller's
+ * transaction. Returns the first block, or 0 if there is no free
+ * run that long.
+ */
+
+__u32 ux_block_alloc_run(struct super_block *sb, __u32 count)
+{
+	__u32 blk = ux_block_claim_run(sb, count);
+
+	if (blk)
+		ux_block_use_run(sb, blk, count);
+	return blk;
+}
+
+static int ux_cmp_block(const void *a, const void *b)
+{
+	__u32 x = *(const __u32 *)a, y = *(const __u32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * A run of freed blocks, numbered from the start of the data
+ * area, waiting to be discarded.
+ */
+
+struct ux_discard_extent{
+	struct list_head d_list;
+	__u32 d_start;
+	__u32 d_len;
+};
+
+/*
+ * Add a freed block to a list of extents, merging it into the last
+ * one when it follows it. A discard is only a hint, so a block that
+ * can't be recorded is simply not discarded.
+ */
+
+static void ux_discard_add(struct list_head *list, __u32 nr)
+{
+	struct ux_discard_extent *ex;
+
+	if (!list_empty(list)) {
+		ex = list_last_entry(list, struct ux_discard_extent, d_list);
+		if (ex->d_start + ex->d_len == nr) {
+			ex->d_len++;
+			return;
+		}
+	}
+	ex = kmalloc(sizeof(*ex), GFP_NOFS);
+	if (!ex)
+		return;
+	ex->d_start = nr;
+	ex->d_len = 1;
+	list_add_tail(&ex->d_list, list);
+}
+
+static void ux_discard_free(struct list_head *list)
+{
+	struct ux_discard_extent *ex, *next;
+
+	list_for_each_entry_safe(ex, next, list, d_list)
+		kfree(ex);
+	INIT_LIST_HEAD(list);
+}
+
+/*
+ * Return a number of data blocks to the block map. They are
+ * sorted first, so the map lock is taken once and each map
+ * block is logged once however many of its bits are cleared.
+ * If a block held metadata, any cached copy of it is thrown
+ * away so that it can't be written over the block's next owner.
+ * With "discard" the blocks are queued to be discarded by
+ * u_discard_work once the transaction freeing them has committed.
+ */
+
+static void ux_free_blocks(struct super_block *sb, __u32 *blks, int count, int discard)
 {
 	struct ux_fs	      *fs = (struct ux_fs *)sb->s_fs_info;
 	struct ux_superblock  *usb = fs->u_sb;
+	struct buffer_head    *bh, *map = NULL;
+	__u32		      nr;
 	int		      i;
+	LIST_HEAD(freed);
 
-	if (usb->s_nbfree == 0) {
-		printk("uxfs: Out of space\n");
-		return 0;
+	if (count > 1)
+		sort(blks, count, sizeof(__u32), ux_cmp_block, NULL);
+	for (i = 0 ; i < count ; i++) {
+		if (blks[i] <= usb->s_data_block ||
+		    blks[i] >= usb->s_data_block + usb->s_nblocks) {
+			printk("uxfs: ux_block_free - bad block %u\n", blks[i]);
+			blks[i] = 0;
+			continue;
+		}
+		bh = sb_find_get_block(sb, blks[i]);
+		if (bh) {
+			ux_journal_forget(sb, bh);
+			bforget(bh);
+		}
+		if (discard)
+			ux_discard_add(&freed, blks[i] - usb->s_data_block);
 	}
 
+	spin_lock(&fs->u_lock);
+	for (i = 0 ; i < count ; i++) {
+		if (!blks[i])
+			continue;
+		nr = blks[i] - usb->s_data_block;
+		bh = fs->u_bmap[nr / UX_BITS_PER_BLOCK];
+		if (!__test_and_clear_bit_le(nr % UX_BITS_PER_BLOCK, bh->b_data)) {
+			printk("uxfs: ux_block_free - block %u already free\n", blks[i]);
+			continue;
+		}
+		fs->u_nbfree++;
+		if (bh != map) {
+			if (map)
+				ux_journal_dirty(sb, map);
+			map = bh;
+		}
+	}
+	if (map)
+		ux_journal_dirty(sb, map);
+
 	/*
-	 * Start looking at block 1. Block 0 is 
-	 * for the root directory.
+	 * Without a journal the free is as done as it gets.
 	 */
 
-	for (i = 1 ; i < UX_MAXBLOCKS ; i++) {
-		if (usb->s_block[i] == UX_BLOCK_FREE) {
-			usb->s_block[i] = UX_BLOCK_INUSE;
-			usb->s_nbfree--;
-			return UX_FIRST_DATA_BLOCK + i;
+	list_splice_tail(&freed, fs->u_journal ? &fs->u_discard : &fs->u_discard_ready);
+	spin_unlock(&fs->u_lock);
+	if (discard && !fs->u_journal)
+		queue_work(system_long_wq, &fs->u_discard_work);
+}
+
+void ux_block_free_batch(struct super_block *sb, __u32 *blks, int count)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+
+	ux_free_blocks(sb, blks, count, fs->u_mount_opt & UX_MOUNT_DISCARD);
+}
+
+void ux_block_free(struct super_block *sb, __u32 blk)
+{
+	ux_block_free_batch(sb, &blk, 1);
+}
+
+/*
+ * Discard the free runs of data blocks in [start, end) that are at
+ * least minlen long. Returns the number of blocks discarded. Called
+ * with u_trim_sem held for writing, so no free bit can be claimed
+ * meanwhile. Blocks already claimed by a per-CPU cache are skipped,
+ * they may be written at any time.
+ */
+
+static __u32 ux_discard_range(struct super_block *sb, __u32 start, __u32 end, __u32 minlen)
+{
+	struct ux_fs	      *fs = (struct ux_fs *)sb->s_fs_info;
+	struct ux_superblock  *usb = fs->u_sb;
+	__u32		      next, trimmed = 0;
+
+	while ((start = ux_find_free_block(fs->u_bmap, fs->u_claimed, end, start)) < end) {
+		next = ux_find_used_block(fs->u_bmap, fs->u_claimed, end, start);
+		if (next - start >= minlen &&
+		    !sb_issue_discard(sb, usb->s_data_block + start, next - start, GFP_NOFS, 0))
+			trimmed += next - start;
+		start = next;
+	}
+	return trimmed;
+}
+
+/*
+ * Discard the blocks of [start, end) that are still free. Each
+ * free run is claimed while its discard is in flight, the way a
+ * per-CPU cache claims blocks, so that nothing can allocate it and
+ * write to it meanwhile; allocation carries on around it.
+ */
+
+static void ux_discard_run(struct ux_fs *fs, __u32 start, __u32 end)
+{
+	__u32 data = fs->u_sb->s_data_block;
+	__u32 next, i;
+
+	while (start < end) {
+		spin_lock(&fs->u_lock);
+		start = ux_find_free_block(fs->u_bmap, fs->u_claimed, end, start);
+		next = ux_find_used_block(fs->u_bmap, fs->u_claimed, end, start);
+		next = min_t(__u32, next, start + UX_BITS_PER_BLOCK);
+		for (i = start ; i < next ; i++)
+			__set_bit_le(i, fs->u_claimed);
+		spin_unlock(&fs->u_lock);
+		if (start >= end)
+			break;
+
+		sb_issue_discard(fs->u_vfs_sb, data + start, next - start, GFP_NOFS, 0);
+
+		spin_lock(&fs->u_lock);
+		for (i = start ; i < next ; i++)
+			__clear_bit_le(i, fs->u_claimed);
+		spin_unlock(&fs->u_lock);
+		start = next;
+		cond_resched();
+	}
+}
+
+static int ux_cmp_extent(void *priv, struct list_head *a, struct list_head *b)
+{
+	struct ux_discard_extent *x = list_entry(a, struct ux_discard_extent, d_list);
+	struct ux_discard_extent *y = list_entry(b, struct ux_discard_extent, d_list);
+
+	return x->d_start < y->d_start ? -1 : x->d_start > y->d_start;
+}
+
+/*
+ * u_discard_work: issue the discards queued by committed frees,
+ * sorted and merged into runs. It runs outside the journal and the
+ * trim lock, so handles and allocation never wait for the device.
+ */
+
+static void ux_discard_work(struct work_struct *work)
+{
+	struct ux_fs		  *fs = container_of(work, struct ux_fs, u_discard_work);
+	struct ux_discard_extent  *ex;
+	__u32			  start, end;
+	LIST_HEAD(list);
+
+	spin_lock(&fs->u_lock);
+	list_splice_init(&fs->u_discard_ready, &list);
+	spin_unlock(&fs->u_lock);
+
+	list_sort(NULL, &list, ux_cmp_extent);
+	while (!list_empty(&list)) {
+		ex = list_first_entry(&list, struct ux_discard_extent, d_list);
+		start = ex->d_start;
+		end = start;
+		do {
+			end = max_t(__u32, end, ex->d_start + ex->d_len);
+			list_del(&ex->d_list);
+			kfree(ex);
+			if (list_empty(&list))
+				break;
+			ex = list_first_entry(&list, struct ux_discard_extent, d_list);
+		} while (ex->d_start <= end);
+		ux_discard_run(fs, start, end);
+	}
+}
+
+/*
+ * The running transaction has committed, so the blocks it freed are
+ * free on disk too. Hand them to u_discard_work. Called with the
+ * journal locked; this only moves a list.
+ */
+
+void ux_discard_commit(struct super_block *sb)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+	int	     ready;
+
+	spin_lock(&fs->u_lock);
+	list_splice_tail_init(&fs->u_discard, &fs->u_discard_ready);
+	ready = !list_empty(&fs->u_discard_ready);
+	spin_unlock(&fs->u_lock);
+	if (ready)
+		queue_work(system_long_wq, &fs->u_discard_work);
+}
+
+/*
+ * The running transaction did not make it to the disk, so the
+ * blocks it freed may still be in use there. Forget them.
+ */
+
+void ux_discard_cancel(struct super_block *sb)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+	LIST_HEAD(list);
+
+	spin_lock(&fs->u_lock);
+	list_splice_init(&fs->u_discard, &list);
+	spin_unlock(&fs->u_lock);
+	ux_discard_free(&list);
+}
+
+/*
+ * FITRIM: discard the free blocks between the byte offsets in
+ * range. Works one map block at a time, so allocation is only
+ * held off briefly. Each map block is trimmed with the journal
+ * committed and locked: a block freed in the running transaction
+ * is still in use on disk until the commit, and must not lose its
+ * contents before then. On return range->len holds the bytes
+ * trimmed.
+ */
+
+int ux_trim_fs(struct super_block *sb, struct fstrim_range *range)
+{
+	struct ux_fs	      *fs = (struct ux_fs *)sb->s_fs_info;
+	struct ux_superblock  *usb = fs->u_sb;
+	u64		      first, last;
+	__u32		      start, end, stop, minlen;
+	u64		      trimmed = 0;
+	int		      err = 0;
+
+	first = range->start >> UX_BSIZE_BITS;
+	last = first + (range->len >> UX_BSIZE_BITS);
+	if (last < first)
+		last = U64_MAX;
+	minlen = max_t(u64, 1, range->minlen >> UX_BSIZE_BITS);
+	if (first < usb->s_data_block)
+		first = usb->s_data_block;
+	if (last > usb->s_data_block + usb->s_nblocks)
+		last = usb->s_data_block + usb->s_nblocks;
+	if (first >= last || minlen > usb->s_nblocks)
+		return -EINVAL;
+
+	start = first - usb->s_data_block;
+	stop = last - usb->s_data_block;
+	while (start < stop) {
+		end = min_t(__u32, stop, (start / UX_BITS_PER_BLOCK + 1) * UX_BITS_PER_BLOCK);
+		err = ux_journal_lock(sb);
+		if (!err) {
+			down_write(&fs->u_trim_sem);
+			trimmed += ux_discard_range(sb, start, end, minlen);
+			up_write(&fs->u_trim_sem);
+		}
+		ux_journal_unlock(sb);
+		if (err)
+			break;
+		start = end;
+		if (fatal_signal_pending(current))
+			break;
+		cond_resched();
+	}
+	range->len = trimmed << UX_BSIZE_BITS;
+	return err;
+}
+
+/*
+ * Fragmentation report for UX_IOC_FRAGSTAT. The block map is
+ * scanned one map block at a time under u_lock; blocks parked in
+ * the per-CPU caches count as free, as they do for statfs. Inodes
+ * are read from their
+ * buffers, which ux_update_inode() keeps current.
+ */
+
+int ux_fragstat(struct super_block *sb, struct ux_fragstat *st)
+{
+	struct ux_fs	      *fs = (struct ux_fs *)sb->s_fs_info;
+	struct ux_superblock  *usb = fs->u_sb;
+	struct buffer_head    *bh;
+	__u32		      blk, ino, len, run = 0;
+	int		      used;
+
+	memset(st, 0, sizeof(*st));
+	for (blk = 0 ; blk * UX_BITS_PER_BLOCK < usb->s_nblocks ; blk++) {
+		len = min_t(__u32, UX_BITS_PER_BLOCK, usb->s_nblocks - blk * UX_BITS_PER_BLOCK);
+		spin_lock(&fs->u_lock);
+		run = ux_frag_scan_free(st, (unsigned char *)fs->u_bmap[blk]->b_data, len, run);
+		spin_unlock(&fs->u_lock);
+	}
+	ux_frag_add_free(st, run);
+
+	for (ino = UX_ROOT_NO ; ino < usb->s_ninodes ; ino++) {
+		if ((usb->s_flags & UX_LAZY_ITABLE) && ino >= usb->s_inode_init)
+			break;
+		spin_lock(&fs->u_lock);
+		used = test_bit_le(ino % UX_BITS_PER_BLOCK, fs->u_imap[ino / UX_BITS_PER_BLOCK]->b_data);
+		spin_unlock(&fs->u_lock);
+		if (!used)
+			continue;
+		bh = sb_bread(sb, usb->s_inode_block + ino);
+		if (!bh)
+			return -EIO;
+		ux_frag_add_file(st, (struct ux_inode *)bh->b_data);
+		brelse(bh);
+		cond_resched();
+	}
+	return 0;
+}
+
+/*
+ * Number of blocks currently parked in the per-CPU caches.
+ * They are free as far as statfs is concerned.
+ */
+
+__u32 ux_cached_blocks(struct super_block *sb)
+{
+	struct ux_fs	      *fs = (struct ux_fs *)sb->s_fs_info;
+	struct ux_alloc_cache *cache;
+	__u32		      count = 0;
+	int		      cpu;
+
+	if (!fs->u_cache)
+		return 0;
+	for_each_possible_cpu(cpu) {
+		cache = per_cpu_ptr(fs->u_cache, cpu);
+		count += cache->c_count - cache->c_next;
+	}
+	return count;
+}
+
+static struct buffer_head **ux_read_map(struct super_block *sb, __u32 start, __u32 count)
+{
+	struct buffer_head **map;
+	__u32 i;
+
+	map = kcalloc(count, sizeof(struct buffer_head *), GFP_KERNEL);
+	if (!map)
+		return NULL;
+	for (i = 0 ; i < count ; i++) {
+		map[i] = sb_bread(sb, start + i);
+		if (!map[i]) {
+			printk("uxfs: unable to read map block %u\n", start + i);
+			while (i--)
+				brelse(map[i]);
+			kfree(map);
+			return NULL;
 		}
 	}
-	printk("uxfs: ux_block_alloc - We should never reach here\n");
+	return map;
+}
+
+static void ux_put_map(struct buffer_head **map, __u32 count)
+{
+	__u32 i;
+
+	if (!map)
+		return;
+	for (i = 0 ; i < count ; i++)
+		brelse(map[i]);
+	kfree(map);
+}
+
+/*
+ * Read the inode and block maps, which stay pinned in memory
+ * while the filesystem is mounted, and set up the per-CPU caches.
+ * The free counts are recomputed from the maps, so it doesn't
+ * matter if the ones in the superblock are stale.
+ */
+
+int ux_alloc_init(struct super_block *sb)
+{
+	struct ux_fs	      *fs = (struct ux_fs *)sb->s_fs_info;
+	struct ux_superblock  *usb = fs->u_sb;
+	struct ux_alloc_cache *cache;
+	int		      cpu, ret;
+
+	if (usb->s_ninodes <= UX_ROOT_NO || usb->s_nblocks < 2 ||
+	    usb->s_imap_blocks * UX_BITS_PER_BLOCK < usb->s_ninodes ||
+	    usb->s_bmap_blocks * UX_BITS_PER_BLOCK < usb->s_nblocks) {
+		printk("uxfs: bad filesystem layout\n");
+		return -EINVAL;
+	}
+
+	spin_lock_init(&fs->u_lock);
+	init_rwsem(&fs->u_trim_sem);
+	INIT_LIST_HEAD(&fs->u_discard);
+	INIT_LIST_HEAD(&fs->u_discard_ready);
+	INIT_WORK(&fs->u_discard_work, ux_discard_work);
+	fs->u_vfs_sb = sb;
+	fs->u_imap = ux_read_map(sb, usb->s_imap_block, usb->s_imap_blocks);
+	if (!fs->u_imap)
+		return -EIO;
+	ret = -EIO;
+	fs->u_bmap = ux_read_map(sb, usb->s_bmap_block, usb->s_bmap_blocks);
+	if (!fs->u_bmap)
+		goto out_imap;
+	fs->u_nifree = ux_count_free(fs->u_imap, usb->s_ninodes);
+	fs->u_nbfree = ux_count_free(fs->u_bmap, usb->s_nblocks);
+
+	ret = -ENOMEM;
+	fs->u_claimed = kcalloc(BITS_TO_LONGS(usb->s_nblocks), sizeof(unsigned long),
+				GFP_KERNEL);
+	if (!fs->u_claimed)
+		goto out_bmap;
+	fs->u_cache = alloc_percpu(struct ux_alloc_cache);
+	if (!fs->u_cache)
+		goto out_claimed;
+
+	/*
+	 * Spread the CPUs' starting points over the disk so that
+	 * parallel writers don't interleave their blocks.
+	 */
+
+	for_each_possible_cpu(cpu) {
+		cache = per_cpu_ptr(fs->u_cache, cpu);
+		spin_lock_init(&cache->c_lock);
+		cache->c_goal = 1 + cpu * (usb->s_nblocks / nr_cpu_ids);
+		cache->c_next = 0;
+		cache->c_count = 0;
+	}
 	return 0;
+
+out_claimed:
+	kfree(fs->u_claimed);
+	fs->u_claimed = NULL;
+out_bmap:
+	ux_put_map(fs->u_bmap, usb->s_bmap_blocks);
+	fs->u_bmap = NULL;
+out_imap:
+	ux_put_map(fs->u_imap, usb->s_imap_blocks);
+	fs->u_imap = NULL;
+	return ret;
+}
+
+/*
+ * Give back every pre-claimed block. They were never marked in
+ * the block map, so only the claims and the free count change, and
+ * nothing is logged. Called before the filesystem is frozen or
+ * unmounted.
+ */
+
+void ux_alloc_drain(struct super_block *sb)
+{
+	struct ux_fs	      *fs = (struct ux_fs *)sb->s_fs_info;
+	struct ux_superblock  *usb = fs->u_sb;
+	struct ux_alloc_cache *cache;
+	int		      cpu;
+
+	if (!fs->u_cache)
+		return;
+	for_each_possible_cpu(cpu) {
+		cache = per_cpu_ptr(fs->u_cache, cpu);
+		spin_lock(&cache->c_lock);
+		spin_lock(&fs->u_lock);
+		fs->u_nbfree += ux_cache_drain(cache, fs->u_claimed, usb->s_data_block);
+		spin_unlock(&fs->u_lock);
+		spin_unlock(&cache->c_lock);
+	}
+}
+
+/*
+ * Write out the dirty map blocks and wait for them. The caller
+ * issues the cache flush, once, when it writes the superblock.
+ */
+
+int ux_sync_maps(struct super_block *sb)
+{
+	struct ux_fs	      *fs = (struct ux_fs *)sb->s_fs_info;
+	struct ux_superblock  *usb = fs->u_sb;
+	struct buffer_head    *bh;
+	__u32		      i, nr = usb->s_imap_blocks + usb->s_bmap_blocks;
+	int		      err = 0;
+
+	for (i = 0 ; i < nr ; i++) {
+		bh = i < usb->s_imap_blocks ? fs->u_imap[i] :
+			fs->u_bmap[i - usb->s_imap_blocks];
+		write_dirty_buffer(bh, WRITE);
+	}
+	for (i = 0 ; i < nr ; i++) {
+		bh = i < usb->s_imap_blocks ? fs->u_imap[i] :
+			fs->u_bmap[i - usb->s_imap_blocks];
+		wait_on_buffer(bh);
+		if (buffer_write_io_error(bh))
+			err = -EIO;
+	}
+	return err;
+}
+
+/*
+ * Drop the per-CPU caches and the map buffers at unmount, once the
+ * last discards are done.
+ */
+
+void ux_alloc_release(struct super_block *sb)
+{
+	struct ux_fs	      *fs = (struct ux_fs *)sb->s_fs_info;
+	struct ux_superblock  *usb = fs->u_sb;
+
+	flush_work(&fs->u_discard_work);
+	ux_discard_free(&fs->u_discard);
+	ux_discard_free(&fs->u_discard_ready);
+	if (fs->u_cache) {
+		ux_alloc_drain(sb);
+		free_percpu(fs->u_cache);
+		fs->u_cache = NULL;
+	}
+	ux_put_map(fs->u_bmap, usb->s_bmap_blocks);
+	fs->u_bmap = NULL;
+	ux_put_map(fs->u_imap, usb->s_imap_blocks);
+	fs->u_imap = NULL;
+	kfree(fs->u_claimed);
+	fs->u_claimed = NULL;
 }
@@ -2,247 +2,201 @@
 #include <linux/string.h>
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
+#include <linux/blkdev.h>
 #include "ux_fs.h"
+#include "ux_dirent.h"
 
-static inline void dir_put_page(struct page *page)
-{
-	kunmap(page);
-	page_cache_release(page);
-}
-
-static unsigned ux_last_byte(struct inode *inode, unsigned long page_nr)
-{
-	unsigned last_byte = PAGE_CACHE_SIZE;
-
-	if (page_nr == (inode->i_size >> PAGE_CACHE_SHIFT))
-		last_byte = inode->i_size & (PAGE_CACHE_SIZE - 1);
-	return last_byte;
-}
+/*
+ * A new directory starts out inline, with "." and ".." in the
+ * inode. It is only given a block once it outgrows the inode.
+ */
 
-static int dir_commit_chunk(struct page *page, loff_t pos, unsigned len)
+int ux_make_empty(struct inode *inode, struct inode *dir)
 {
-	struct address_space *mapping = page->mapping;
-	struct inode *dir = mapping->host;
-	int err = 0;
-	block_write_end(NULL, mapping, pos, len, len, page, NULL);
-
-	if (pos+len > dir->i_size) {
-		i_size_write(dir, pos+len);
-		mark_inode_dirty(dir);
-	}
-	if (IS_DIRSYNC(dir))
-		err = write_one_page(page, 1);
-	else
-		unlock_page(page);
-	return err;
+	struct uxfs_inode_info *ui = UXFS_I(inode);
 
+	ux_dir_init_inline(ui->i_inline, inode->i_ino, dir->i_ino);
+	ui->i_flags |= UX_INLINE_DATA;
+	ui->i_nentries = 2;
+	ui->i_blocks = 0;
+	inode->i_blocks = 0;
+	inode->i_size = UX_INLINE_SIZE;
+	return 0;
 }
 
-static struct page *dir_get_page(struct inode *dir, unsigned long n)
-{
-	struct address_space *mapping = dir->i_mapping;
-	struct page *page = read_mapping_page(mapping, n, NULL);
-	if (!IS_ERR(page))
-		kmap(page);
-	return page;
-}
-
-static inline int namecompare(int len, int maxlen, const char *name, const char *buffer)
-{
-	if (len < maxlen && buffer[len])
-		return 0;
-	return !memcmp(name, buffer, len);
-}
+/*
+ * Move the entries of an inline directory into its first block.
+ * They keep their offsets, so readdir positions stay valid.
+ */
 
-int ux_make_empty(struct inode *inode, struct inode *dir)
+static int ux_dir_convert(struct inode *dir)
 {
-	struct page *page = grab_cache_page(inode->i_mapping, 0);
-	char *kaddr;
-	int err;
-	struct ux_dirent *de;
+	struct super_block *sb = dir->i_sb;
+	struct uxfs_inode_info *ui = UXFS_I(dir);
+	struct buffer_head *bh;
+	__u32 blk;
 
-	if (!page)
-		return -ENOMEM;
-	err = ux_prepare_chunk(page, 0, 2 * UX_DIRENT_SIZE);
-	if (err){
-		unlock_page(page);
-		goto fail;
+	blk = ux_block_alloc(sb);
+	if (!blk)
+		return -ENOSPC;
+	bh = sb_getblk(sb, blk);
+	if (!bh) {
+		ux_block_free(sb, blk);
+		return -EIO;
 	}
 
-	kaddr = kmap_atomic(page);
-	memset(kaddr, 0, PAGE_CACHE_SIZE);
-
-	de = (struct ux_dirent*)kaddr;
-	de->d_ino = inode->i_ino;
-	strcpy(de->d_name, ".");
-
-	de = (struct ux_dirent*)((char*)de + UX_DIRENT_SIZE);
-	de->d_ino = dir->i_ino;
-	strcpy(de->d_name, "..");
-		
-	kunmap_atomic(kaddr);
-
-	err = dir_commit_chunk(page, 0, 2 * UX_DIRENT_SIZE);
-fail:
-	page_cache_release(page);
-	return err;	
+	lock_buffer(bh);
+	ux_dir_move_inline(bh->b_data, ui->i_inline);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	ux_journal_dirty_inode(bh, dir);
+	brelse(bh);
+
+	ui->i_flags &= ~UX_INLINE_DATA;
+	ui->i_addr[0] = blk;
+	ui->i_blocks = 1;
+	dir->i_blocks = 1;
+	dir->i_size = UX_BSIZE;
+	mark_inode_dirty(dir);
+	return 0;
 }
 
-int ux_add_link(struct dentry *dentry, struct inode *inode)
+/*
+ * Look "name" up in dir. On success *bhp holds the block the entry
+ * lives in, or NULL if it lives in the inode. Either way the
+ * caller releases *bhp with brelse().
+ */
+
+static struct ux_dirent *ux_find_entry(struct inode *dir, const char *name, int namelen,
+				       struct buffer_head **bhp)
 {
-	struct inode *dir = d_inode(dentry->d_parent);
-	const char *name = dentry->d_name.name;
-	int namelen = dentry->d_name.len;
 	struct super_block *sb = dir->i_sb;
 	struct uxfs_inode_info *ui = UXFS_I(dir);
 	struct buffer_head *bh = NULL;
-	int    i, blk = 0;
-	int err;
-	char *namx = NULL;
-	__u32 inumber;
-	struct ux_dirent *de;
-
+	struct ux_dirent   *dirent;
+	int    blk = 0;
+
+	*bhp = NULL;
+	if (namelen > UX_NAMELEN)
+		return NULL;
+	if (ui->i_flags & UX_INLINE_DATA)
+		return ux_dirent_find((struct ux_dirent *)ui->i_inline, UX_INLINE_DIRS,
+				      name, namelen);
 	for (blk=0 ; blk < dir->i_blocks ; blk++) {
 		bh = sb_bread(sb, ui->i_addr[blk]);
-		de = (struct ux_dirent *)bh->b_data;
-
-		for (i=0 ; i < UX_DIRS_PER_BLOCK ; i++) {
-			namx = de->d_name;
-			inumber = de->d_ino;
-			if (i == UX_DIRS_PER_BLOCK - 1 && blk == dir->i_blocks - 1 ){
-				de->d_ino = 0;
-				goto got_it;
-			}
-			if (!inumber)
-				goto got_it;
-
-			err = -EEXIST;
-
-			if (namecompare(namelen, UX_NAMELEN, name, namx))
-				goto out_put; 
-			de++;
+		if (!bh)
+			return NULL;
+		dirent = ux_dirent_find((struct ux_dirent *)bh->b_data, UX_DIRS_PER_BLOCK,
+					name, namelen);
+		if (dirent) {
+			*bhp = bh;
+			return dirent;
 		}
+		brelse(bh);
 	}
+	return NULL;
+}
 
-	if (bh)
-		brelse(bh);
-	BUG();
-	return -EINVAL;
-
-got_it:
-	printk("memcpy!!!!\n");
-	memcpy (namx, name, namelen);
-	memset (namx + namelen, 0, UX_DIRENT_SIZE - namelen - 4);
-	de->d_ino = inode->i_ino;
-	dir->i_mtime = dir->i_ctime = CURRENT_TIME_SEC;
-	mark_inode_dirty(dir);
-	mark_buffer_dirty_inode(bh, dir);
+/*
+ * Read ahead the inode blocks of every entry in dir, the first time
+ * it is looked in after being read in. Otherwise "ls -l" of a cold
+ * directory reads its inodes one synchronous block at a time, as
+ * lookup gets to each of them. Entries added later have their
+ * inodes in core already.
+ */
 
-out_put:
-	if (bh)
+static void ux_dir_prefetch(struct inode *dir)
+{
+	struct super_block *sb = dir->i_sb;
+	struct uxfs_inode_info *ui = UXFS_I(dir);
+	struct buffer_head *bh;
+	struct ux_dirent   *dirent;
+	struct blk_plug    plug;
+	int		   i, blk;
+
+	if (ui->i_prefetched)
+		return;
+	ui->i_prefetched = 1;
+
+	blk_start_plug(&plug);
+	if (ui->i_flags & UX_INLINE_DATA) {
+		dirent = (struct ux_dirent *)ui->i_inline;
+		for (i=0 ; i < UX_INLINE_DIRS ; i++, dirent++)
+			if (dirent->d_ino)
+				ux_inode_readahead(sb, dirent->d_ino);
+		blk_finish_plug(&plug);
+		return;
+	}
+	for (blk=0 ; blk < dir->i_blocks ; blk++)
+		sb_breadahead(sb, ui->i_addr[blk]);
+	for (blk=0 ; blk < dir->i_blocks ; blk++) {
+		bh = sb_bread(sb, ui->i_addr[blk]);
+		if (!bh)
+			break;
+		dirent = (struct ux_dirent *)bh->b_data;
+		for (i=0 ; i < UX_DIRS_PER_BLOCK ; i++, dirent++)
+			if (dirent->d_ino)
+				ux_inode_readahead(sb, dirent->d_ino);
 		brelse(bh);
+	}
+	blk_finish_plug(&plug);
+}
 
-out:
-	return err;
+/*
+ * Log a changed entry returned by ux_find_entry(). Inline entries
+ * go to disk with the next ux_update_inode() of the directory.
+ */
 
+static void ux_dirent_dirty(struct inode *dir, struct buffer_head *bh)
+{
+	if (bh)
+		ux_journal_dirty_inode(bh, dir);
+	dir->i_ctime = dir->i_mtime = current_fs_time(dir->i_sb);
+	mark_inode_dirty(dir);
 }
+
 /*
-int ux_add_link(struct dentry *dentry, struct inode *inode)
+ * Number of live entries in dir, "." and ".." included. It is
+ * counted once, the first time it is needed, and then kept up to
+ * date by ux_count_entry(), so rmdir doesn't rescan the directory.
+ */
+
+static int ux_dir_entries(struct inode *dir)
 {
-	struct inode *dir = d_inode(dentry->d_parent);
-	const char *name = dentry->d_name.name;
-	int namelen = dentry->d_name.len;
-	struct page *page = NULL;
-	unsigned long pages = dir_pages(dir);
-	unsigned long n;
-	char *kaddr, *p;
-	struct ux_dirent *de;
-	loff_t pos;
-	int err;
-	char *namx = NULL;
-	__u32 inumber;
-	printk("pages = %u\n", pages);
-	for(n = 0; n <= pages; n++){
-		char *limit, *dir_end;
-
-		printk("dir->i_mapping = %p\n", dir->i_mapping);
-		if (dir->i_mapping)
-			printk("dir->i_mapping->a_ops %p\n", dir->i_mapping->a_ops);
-		page = dir_get_page(dir, n);
-		printk("page = %p\n", page);
-		err = PTR_ERR(page);
-		if (IS_ERR(page))
-			goto out;
-		lock_page(page);
-		kaddr = (char*)page_address(page);
-		printk("kaddr = %p\n", kaddr);
-		dir_end = kaddr + ux_last_byte(dir, n);
-		limit = kaddr + PAGE_CACHE_SIZE - UX_DIRENT_SIZE;
-		for (p = kaddr; p <= limit; p += UX_DIRENT_SIZE){
-			de = (struct ux_dirent*)p;
-			namx = de->d_name;
-			inumber = de->d_ino;
-			if (p == dir_end ){
-				de->d_ino = 0;
-				goto got_it;
-			}
-			if (!inumber)
-				goto got_it;
-			err = -EEXIST;
-			if (namecompare(namelen, UX_NAMELEN, name, namx))
-				goto out_unlock; 
+	struct uxfs_inode_info *ui = UXFS_I(dir);
+	struct buffer_head *bh;
+	struct ux_dirent *dirent;
+	int i, blk, count = 0;
+
+	if (ui->i_nentries >= 0)
+		return ui->i_nentries;
+	if (ui->i_flags & UX_INLINE_DATA) {
+		dirent = (struct ux_dirent *)ui->i_inline;
+		for (i=0 ; i < UX_INLINE_DIRS ; i++, dirent++)
+			if (dirent->d_ino)
+				count++;
+	} else {
+		for (blk=0 ; blk < dir->i_blocks ; blk++) {
+			bh = sb_bread(dir->i_sb, ui->i_addr[blk]);
+			if (!bh)
+				return -EIO;
+			dirent = (struct ux_dirent *)bh->b_data;
+			for (i=0 ; i < UX_DIRS_PER_BLOCK ; i++, dirent++)
+				if (dirent->d_ino)
+					count++;
+			brelse(bh);
 		}
-		unlock_page(page);
-		dir_put_page(page);
 	}
-	BUG();
-	return -EINVAL;
-
-got_it:
-	pos = page_offset(page) + p - (char*)page_address(page);
-	err = ux_prepare_chunk(page, pos, UX_DIRENT_SIZE);
-	if (err)
-		goto out_unlock;
-	printk("memcpy!!!!\n");
-	memcpy (namx, name, namelen);
-	memset (namx + namelen, 0, UX_DIRENT_SIZE - namelen - 4);
-	de->d_ino = inode->i_ino;
-	err = dir_commit_chunk(page, pos, UX_DIRENT_SIZE);
-	dir->i_mtime = dir->i_ctime = CURRENT_TIME_SEC;
-	mark_inode_dirty(dir);
-out_put:
-	dir_put_page(page);
-out:
-	return err;
-out_unlock:
-	unlock_page(page);
-	goto out_put;
+	ui->i_nentries = count;
+	return count;
 }
-*/
 
-static struct buffer_head* ux_find_entry(struct inode *dir, const char *name, struct ux_dirent **res_dir)
+static void ux_count_entry(struct inode *dir, int delta)
 {
-	struct super_block *sb = dir->i_sb;
 	struct uxfs_inode_info *ui = UXFS_I(dir);
-	struct buffer_head *bh = NULL;
-	struct ux_dirent   *dirent;
-	int    i, blk = 0;
-	printk("ux_find_entry: name=%s\n", name);
-	for (blk=0 ; blk < dir->i_blocks ; blk++) {
-		bh = sb_bread(sb, ui->i_addr[blk]);
-		dirent = (struct ux_dirent *)bh->b_data;
-		for (i=0 ; i < UX_DIRS_PER_BLOCK ; i++) {
-			if (strcmp(dirent->d_name, name) == 0) {
-				*res_dir = dirent;
-				return bh;
-			}
-			dirent++;
-		}
-	}
 
-	if (bh)
-		brelse(bh);
-	return NULL;
+	if (ui->i_nentries >= 0)
+		ui->i_nentries += delta;
 }
 
 /*
@@ -256,31 +210,35 @@ int ux_add_entry(struct inode *dir, const char *name, int namelen, int inum)
 	struct super_block    *sb = dir->i_sb;
 	struct ux_dirent      *dirent;
 	__u32		      blk = 0;
-	int		      i, j, pos;
-
-	printk("dir->i_size: %d\n", (int)dir->i_size);
-	printk("dir->i_blocks: %d\n", (int)dir->i_blocks);
+	int		      pos, err;
+
+	if (ui->i_flags & UX_INLINE_DATA) {
+		dirent = ux_dirent_free((struct ux_dirent *)ui->i_inline, UX_INLINE_DIRS);
+		if (dirent) {
+			ux_set_dirent(dirent, name, namelen, inum);
+			ux_count_entry(dir, 1);
+			dir->i_mtime = current_fs_time(dir->i_sb);
+			mark_inode_dirty(dir);
+			return 0;
+		}
+		err = ux_dir_convert(dir);
+		if (err)
+			return err;
+	}
 
 	for (blk=0 ; blk < dir->i_blocks ; blk++) {
-		printk("ui->i_addr[%d] = %d\n", blk, (int)ui->i_addr[blk]);
 		bh = sb_bread(sb, ui->i_addr[blk]);
 		if (!bh)
 			return -EIO;
-		dirent = (struct ux_dirent *)bh->b_data;
-		for (i=0 ; i < UX_DIRS_PER_BLOCK ; i++) {
-			if (dirent->d_ino != 0) {
-				dirent++;
-				continue;
-			} else {
-				dirent->d_ino = inum;
-				for(j = 0; j < UX_NAMELEN; j++)
-					dirent->d_name[j] = ((j < namelen) ? name[j] : 0);
-				dir->i_mtime = CURRENT_TIME_SEC;
-				mark_inode_dirty(dir);
-				mark_buffer_dirty_inode(bh, dir);
-				brelse(bh);
-				return 0;
-			}
+		dirent = ux_dirent_free((struct ux_dirent *)bh->b_data, UX_DIRS_PER_BLOCK);
+		if (dirent) {
+			ux_set_dirent(dirent, name, namelen, inum);
+			ux_count_entry(dir, 1);
+			dir->i_mtime = current_fs_time(dir->i_sb);
+			mark_inode_dirty(dir);
+			ux_journal_dirty_inode(bh, dir);
+			brelse(bh);
+			return 0;
 		}
 		brelse(bh);
 	}
@@ -290,25 +248,44 @@ int ux_add_entry(struct inode *dir, const char *name, int namelen, int inum)
 	 * a new block if there's space in the inode.
 	 */
 
-	if (dir->i_blocks < UX_DIRECT_BLOCKS) {
-		pos = dir->i_blocks;
-		blk = ux_block_alloc(sb);
-		dir->i_blocks++;
-		dir->i_size += UX_BSIZE;
-		ui->i_addr[pos] = blk;
-		bh = sb_bread(sb, blk);
-		memset(bh->b_data, 0, UX_BSIZE);
-		mark_inode_dirty(dir);
-		dirent = (struct ux_dirent *)bh->b_data;
-		dirent->d_ino = inum;
-		strcpy(dirent->d_name, name);
-		mark_buffer_dirty(bh);
-		brelse(bh);
-	}
+	if (dir->i_blocks >= UX_DIRECT_BLOCKS)
+		return -ENOSPC;
 
+	pos = dir->i_blocks;
+	blk = ux_block_alloc(sb);
+	if (!blk)
+		return -ENOSPC;
+	bh = sb_getblk(sb, blk);
+	if (!bh) {
+		ux_block_free(sb, blk);
+		return -EIO;
+	}
+	dir->i_blocks++;
+	dir->i_size += UX_BSIZE;
+	ui->i_addr[pos] = blk;
+	ui->i_blocks++;
+	lock_buffer(bh);
+	memset(bh->b_data, 0, UX_BSIZE);
+	dirent = (struct ux_dirent *)bh->b_data;
+	ux_set_dirent(dirent, name, namelen, inum);
+	ux_count_entry(dir, 1);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	dir->i_mtime = current_fs_time(dir->i_sb);
+	mark_inode_dirty(dir);
+	ux_journal_dirty_inode(bh, dir);
+	brelse(bh);
 	return 0;
 }
 
+static int ux_emit(struct dir_context *ctx, struct ux_dirent *udir)
+{
+	if (!udir->d_ino)
+		return 1;
+	return dir_emit(ctx, udir->d_name, strnlen(udir->d_name, UX_NAMELEN),
+			(u64)udir->d_ino, DT_UNKNOWN);
+}
+
 int ux_readdir(struct file *filp, struct dir_context *ctx)
 {
 	struct inode	      *dir = file_inode(filp);
@@ -324,22 +301,31 @@ int ux_readdir(struct file *filp, struct dir_context *ctx)
 		printk("Bad f_pos=%08lx for %s:%08lx\n", (unsigned long)ctx->pos, dir->i_sb->s_id, dir->i_ino);
 		return -EINVAL;
 	}
+	ux_dir_prefetch(dir);
+
+	if (ui->i_flags & UX_INLINE_DATA) {
+		while (ctx->pos < UX_INLINE_SIZE) {
+			udir = (struct ux_dirent *)(ui->i_inline + ctx->pos);
+			if (!ux_emit(ctx, udir))
+				return 0;
+			ctx->pos += sizeof(struct ux_dirent);
+		}
+		return 0;
+	}
 	
 	while (ctx->pos < dir->i_size) {
 		blk = ctx->pos >> UX_BSIZE_BITS;
 		blk = ui->i_addr[blk];
 		bh = sb_bread(dir->i_sb, blk);
+		if (!bh)
+			return -EIO;
 		offset = ctx->pos & (UX_BSIZE - 1);
 
 		do {
 			udir = (struct ux_dirent *)(bh->b_data + offset);
-			printk("ux_readdir udir->d_ino = %u , udir->d_name = %s\n", udir->d_ino, udir->d_name);
-			if (udir->d_ino){
-				int size = strnlen(udir->d_name, UX_NAMELEN);
-				if(!dir_emit(ctx, udir->d_name, size, (u64)udir->d_ino, DT_UNKNOWN)){
-					brelse(bh);
-					return 0;
-				}
+			if (!ux_emit(ctx, udir)) {
+				brelse(bh);
+				return 0;
 			}
 			ctx->pos += sizeof(struct ux_dirent);
 			offset += sizeof(struct ux_dirent);
@@ -354,6 +340,7 @@ struct file_operations ux_dir_operations = {
 	.iterate    = ux_readdir,
 	.fsync      = generic_file_fsync,
     .llseek     = generic_file_llseek,
+	.unlocked_ioctl = ux_ioctl,
 };
 
 /*
@@ -369,6 +356,8 @@ static int ux_create(struct inode *dir, struct dentry *dentry, umode_t mode, boo
 	ino_t					inum = 0;
 	struct buffer_head		*bh = NULL;
 	struct ux_dirent		*de = NULL;
+	struct ux_handle		*handle;
+	int						err;
 		
 	/*
 	 * See if the entry exists. If not, create a new 
@@ -377,21 +366,26 @@ static int ux_create(struct inode *dir, struct dentry *dentry, umode_t mode, boo
 	 */ 
 
 	printk("ux_create \n");
-	bh = ux_find_entry(dir, (char *)dentry->d_name.name, &de);
-	if (bh) {
-		brelse(bh);
-		return -EEXIST;
-	}
+	handle = ux_journal_start(sb, UX_DIROP_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+	err = -EEXIST;
+	de = ux_find_entry(dir, dentry->d_name.name, dentry->d_name.len, &bh);
+	brelse(bh);
+	if (de)
+		goto out;
 	
+	err = -ENOSPC;
 	inode = new_inode(sb);
 	if (!inode) {
-		return -ENOSPC;
+		goto out;
 	}
 
 	inum = ux_ialloc(sb);
 	if (!inum) {
 		iput(inode);
-		return -ENOSPC;
+		goto out;
 	}
 
 	printk("ux_create : inum = %d\n", (int)inum);
@@ -401,7 +395,7 @@ static int ux_create(struct inode *dir, struct dentry *dentry, umode_t mode, boo
 	 */
 
 	inode_init_owner(inode, dir, mode);
-	inode->i_mtime = inode->i_atime = inode->i_ctime = CURRENT_TIME_SEC;
+	inode->i_mtime = inode->i_atime = inode->i_ctime = current_fs_time(inode->i_sb);
 	inode->i_blkbits = UX_BSIZE_BITS;
 	inode->i_blocks = 0;
 	inode->i_op = &ux_file_inops;
@@ -409,14 +403,119 @@ static int ux_create(struct inode *dir, struct dentry *dentry, umode_t mode, boo
 	inode->i_mapping->a_ops = &ux_aops;
 	inode->i_mode = mode;
 	inode->i_ino = inum;
+	UXFS_I(inode)->i_flags = UX_INLINE_DATA;
 	insert_inode_hash(inode); 
 	mark_inode_dirty(inode);
+	ux_update_inode(inode);
 
-	ux_add_entry(dir, (char *)dentry->d_name.name, dentry->d_name.len, inum);
+	err = ux_add_entry(dir, (char *)dentry->d_name.name, dentry->d_name.len, inum);
+	if (err) {
+		inode_dec_link_count(inode);
+		goto out_iput;
+	}
+	ux_update_inode(dir);
 
 	d_instantiate(dentry, inode);
-	mark_buffer_dirty(((struct ux_fs *)sb->s_fs_info)->u_sbh);
-	return 0;
+out:
+	ux_journal_stop(handle);
+	return err;
+
+	/*
+	 * Freeing the inode needs a handle of its own, which may have
+	 * to wait for a commit, so drop it after this one is stopped.
+	 */
+
+out_iput:
+	ux_journal_stop(handle);
+	iput(inode);
+	return err;
+}
+
+/*
+ * Targets that fit in the inode's inline area make fast symlinks,
+ * followed straight from the in-core inode. Longer ones are kept
+ * in the page cache and written to data blocks like a file.
+ */
+
+static int ux_symlink(struct inode *dir, struct dentry *dentry, const char *symname)
+{
+	struct super_block	*sb = dir->i_sb;
+	struct uxfs_inode_info	*ui;
+	struct inode		*inode;
+	struct buffer_head	*bh = NULL;
+	struct ux_dirent	*de;
+	struct ux_handle	*handle;
+	unsigned		l = strlen(symname) + 1;
+	ino_t			inum;
+	int			err;
+
+	if (l > PAGE_SIZE || l > UX_DIRECT_BLOCKS * UX_BSIZE)
+		return -ENAMETOOLONG;
+
+	handle = ux_journal_start(sb, UX_SYMLINK_CREDITS(l));
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+	err = -EEXIST;
+	de = ux_find_entry(dir, dentry->d_name.name, dentry->d_name.len, &bh);
+	brelse(bh);
+	if (de)
+		goto out;
+
+	err = -ENOSPC;
+	inode = new_inode(sb);
+	if (!inode)
+		goto out;
+
+	inum = ux_ialloc(sb);
+	if (!inum) {
+		iput(inode);
+		goto out;
+	}
+
+	inode_init_owner(inode, dir, S_IFLNK | S_IRWXUGO);
+	inode->i_mtime = inode->i_atime = inode->i_ctime = current_fs_time(inode->i_sb);
+	inode->i_blkbits = UX_BSIZE_BITS;
+	inode->i_blocks = 0;
+	inode->i_ino = inum;
+	insert_inode_hash(inode);
+
+	ui = UXFS_I(inode);
+	if (l <= UX_INLINE_SIZE) {
+		inode->i_op = &ux_fast_symlink_inops;
+		memcpy(ui->i_inline, symname, l);
+		ui->i_flags = UX_INLINE_DATA;
+		inode->i_link = ui->i_inline;
+		inode->i_size = l - 1;
+	} else {
+		inode->i_op = &ux_symlink_inops;
+		inode_nohighmem(inode);
+		inode->i_mapping->a_ops = &ux_aops;
+		err = page_symlink(inode, symname, l);
+		if (err) {
+			inode_dec_link_count(inode);
+			goto out_iput;
+		}
+	}
+	mark_inode_dirty(inode);
+	ux_update_inode(inode);
+
+	err = ux_add_entry(dir, dentry->d_name.name, dentry->d_name.len, inum);
+	if (err) {
+		inode_dec_link_count(inode);
+		goto out_iput;
+	}
+	ux_update_inode(dir);
+
+	d_instantiate(dentry, inode);
+out:
+	ux_journal_stop(handle);
+	return err;
+
+out_iput:
+	ux_journal_stop(handle);
+	iput(inode);
+	return err;
 }
 
 /*
@@ -427,60 +526,23 @@ static int ux_create(struct inode *dir, struct dentry *dentry, umode_t mode, boo
 static struct dentry* ux_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags)
 {
 	struct inode		*inode = NULL;
-	struct ux_inode		*ui;
-	struct buffer_head	*bh, *bh1;
+	struct buffer_head	*bh;
 	struct ux_dirent	*de;
-	int					inum;
+	int					inum = 0;
 
 	if (dentry->d_name.len > UX_NAMELEN) {
 		return ERR_PTR(-ENAMETOOLONG);
 	}
 
-	printk("ux_lookup dentry->d_name.name=%s, dentry->d_name.len=%u\n", dentry->d_name.name, dentry->d_name.len);
-	bh1 = ux_find_entry(dir, (char *)dentry->d_name.name, &de);
-	if (bh1 && (inum = de->d_ino)) {
-		printk("ux_lookup inum = %d\n", inum);
-		inode = iget_locked(dir->i_sb, inum);
-		if (!inode) {
-			return ERR_PTR(-EACCES);
-		}
-		bh = sb_bread(inode->i_sb, inum + 8);
-		if (!bh) {
-			printk("Unable to read inode %s:%08lx\n", inode->i_sb->s_id, inum);
-			return ERR_CAST(ERR_PTR(-EIO));
-		}
-
-		ui = (struct ux_inode*)bh->b_data;
-		printk(" ui->i_mode = %08lx\n", ui->i_mode);
-		inode->i_mode = ui->i_mode;
-		if (ui->i_mode & S_IFDIR){
-			printk("folder!!!\n");
-			inode->i_op = &ux_dir_inops;
-			inode->i_fop = &ux_dir_operations;
-			inode->i_mapping->a_ops = &ux_aops;
-		}else if (ui->i_mode & S_IFREG){
-			printk("regular file!!!\n");
-			inode->i_op = &ux_file_inops;
-			inode->i_fop = &ux_file_operations;
-			inode->i_mapping->a_ops = &ux_aops;
-		}
-
-		i_uid_write(inode, ui->i_uid);	
-		i_gid_write(inode, ui->i_gid);	
-		set_nlink(inode, ui->i_nlink);
-
-		memcpy(UXFS_I(inode)->i_addr, ui->i_addr, sizeof(ui->i_addr));
-
-		inode->i_size = ui->i_size;
-		inode->i_blocks = ui->i_blocks;
-		inode->i_atime.tv_sec = ui->i_atime;
-		inode->i_mtime.tv_sec = ui->i_mtime;
-		inode->i_ctime.tv_sec = ui->i_ctime;
-		inode->i_atime.tv_nsec = 0;
-		inode->i_mtime.tv_nsec = 0;
-		inode->i_ctime.tv_nsec = 0;
-		brelse(bh);
-		unlock_new_inode(inode);
+	ux_dir_prefetch(dir);
+	de = ux_find_entry(dir, dentry->d_name.name, dentry->d_name.len, &bh);
+	if (de)
+		inum = de->d_ino;
+	brelse(bh);
+	if (inum) {
+		inode = ux_iget(dir->i_sb, inum);
+		if (IS_ERR(inode))
+			return ERR_CAST(inode);
 	}
 	d_add(dentry, inode);
 	return NULL;
@@ -493,24 +555,35 @@ static struct dentry* ux_lookup(struct inode *dir, struct dentry *dentry, unsign
 static int ux_link(struct dentry *old, struct inode *dir, struct dentry *new)
 {
 	struct inode	   *inode = d_inode(old);
+	struct ux_handle   *handle;
 	int		   error;
 
 	printk("ux_link\n");
+	handle = ux_journal_start(dir->i_sb, UX_DIROP_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
 	/*
 	 * Add the new file (new) to its parent directory (dir)
 	 */
 
 	error = ux_add_entry(dir, new->d_name.name, new->d_name.len,inode->i_ino);
+	if (error)
+		goto out;
 
 	/*
 	 * Increment the link count of the target inode
 	 */
 
-	inode->i_ctime = CURRENT_TIME_SEC;
+	inode->i_ctime = current_fs_time(inode->i_sb);
 	inode_inc_link_count(inode);
+	ux_update_inode(inode);
+	ux_update_inode(dir);
 	ihold(inode);
 	d_instantiate(new, inode);
-	return 0;
+out:
+	ux_journal_stop(handle);
+	return error;
 }
 
 /*
@@ -520,35 +593,29 @@ static int ux_link(struct dentry *old, struct inode *dir, struct dentry *new)
 static int ux_unlink(struct inode *dir, struct dentry *dentry)
 {
 	struct inode *inode = d_inode(dentry);
-	struct uxfs_inode_info	*ui = UXFS_I(dir);
 	struct buffer_head	*bh;
-	struct super_block	*sb = dir->i_sb;
 	struct ux_dirent	*dirent;
-	__u32			blk = 0;
-	int			i;
+	struct ux_handle	*handle;
 
 	printk("ux_unlink, inode->i_nlink = %d inode->i_count = %d\n", inode->i_nlink, inode->i_count);
-	while (blk < dir->i_blocks) {
-		bh = sb_bread(sb, ui->i_addr[blk]);
-		blk++;
-		dirent = (struct ux_dirent *)bh->b_data;
-		for (i=0 ; i < UX_DIRS_PER_BLOCK ; i++) {
-			if (strcmp(dirent->d_name, dentry->d_name.name) != 0) {
-				dirent++;
-				continue;
-			} else {
-				dirent->d_ino = 0;
-				dirent->d_name[0] = '\0';
-				mark_buffer_dirty(bh);
-				dir->i_ctime = dir->i_mtime = CURRENT_TIME_SEC;
-				mark_inode_dirty(dir);
-				break;
-			}
-		}
+	handle = ux_journal_start(dir->i_sb, UX_DIROP_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+	dirent = ux_find_entry(dir, dentry->d_name.name, dentry->d_name.len, &bh);
+	if (dirent) {
+		ux_dirent_clear(dirent);
+		ux_count_entry(dir, -1);
+		ux_dirent_dirty(dir, bh);
 		brelse(bh);
 	}
 	inode->i_ctime = dir->i_ctime;
 	inode_dec_link_count(inode);
+	if (!inode->i_nlink)
+		ux_orphan_add(inode);
+	ux_update_inode(inode);
+	ux_update_inode(dir);
+	ux_journal_stop(handle);
 	return 0;
 }
 
@@ -558,46 +625,72 @@ static int ux_rename(struct inode *old_dir, struct dentry *old_dentry,
 	struct inode *old_inode, *new_inode;
 	struct buffer_head *old_bh = NULL, *new_bh = NULL;
 	struct ux_dirent *old_de, *new_de;
+	struct ux_handle *handle;
 	int error = -ENOENT;
 
 	old_inode = d_inode(old_dentry);
 	if (S_ISDIR(old_inode->i_mode))
 		return -EINVAL;
 
-	old_bh = ux_find_entry(old_dir, old_dentry->d_name.name, &old_de);
+	handle = ux_journal_start(old_dir->i_sb, UX_DIROP_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
 
-	if (!old_bh || (old_de->d_ino != old_inode->i_ino))
+	old_de = ux_find_entry(old_dir, old_dentry->d_name.name, old_dentry->d_name.len, &old_bh);
+
+	if (!old_de || (old_de->d_ino != old_inode->i_ino))
 		goto end_rename;
 
 	error = -EPERM;
 	new_inode = d_inode(new_dentry);
-	new_bh = ux_find_entry(new_dir, new_dentry->d_name.name, &new_de);
+	new_de = ux_find_entry(new_dir, new_dentry->d_name.name, new_dentry->d_name.len, &new_bh);
 
-	if(new_bh && !new_inode){
+	if(new_de && !new_inode){
 		brelse(new_bh);
 		new_bh = NULL;
+		new_de = NULL;
 	}
-	if (!new_bh) {
+	if (!new_de) {
 		error = ux_add_entry(new_dir, 
 					new_dentry->d_name.name,
 					new_dentry->d_name.len,
 					old_inode->i_ino);
 		if (error)
 			goto end_rename;
+
+		/*
+		 * Adding may have moved an inline old_dir into a block.
+		 */
+
+		if (new_dir == old_dir && !old_bh) {
+			old_de = ux_find_entry(old_dir, old_dentry->d_name.name, old_dentry->d_name.len, &old_bh);
+			error = -EIO;
+			if (!old_de)
+				goto end_rename;
+		}
+	} else {
+		new_de->d_ino = old_inode->i_ino;
+		ux_dirent_dirty(new_dir, new_bh);
 	}
-	old_de->d_ino = 0;
-	old_dir->i_ctime = old_dir->i_mtime = CURRENT_TIME_SEC;
-	mark_inode_dirty(old_dir);
+	ux_dirent_clear(old_de);
+	ux_count_entry(old_dir, -1);
+	ux_dirent_dirty(old_dir, old_bh);
 	if (new_inode) {
-		new_inode->i_ctime = CURRENT_TIME_SEC;
+		new_inode->i_ctime = current_fs_time(new_inode->i_sb);
 		inode_dec_link_count(new_inode);
+		if (!new_inode->i_nlink)
+			ux_orphan_add(new_inode);
+		ux_update_inode(new_inode);
 	}
-	mark_buffer_dirty_inode(old_bh, old_dir);
+	ux_update_inode(old_dir);
+	if (new_dir != old_dir)
+		ux_update_inode(new_dir);
 	error = 0;
 
 end_rename:
 	brelse(old_bh);
 	brelse(new_bh);
+	ux_journal_stop(handle);
 	return error;
 }
 
@@ -606,25 +699,31 @@ static int ux_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 	struct buffer_head *bh;
 	struct inode *inode;
 	struct ux_dirent* de;
+	struct ux_handle *handle;
 	ino_t inum;
+	int err;
 
 	printk("%s\n", __func__);
-	inode_inc_link_count(dir);
-	bh = ux_find_entry(dir, (char *)dentry->d_name.name, &de);
-	if (bh) {
-		brelse(bh);
-		return -EEXIST;
-	}
+	handle = ux_journal_start(dir->i_sb, UX_DIROP_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+	err = -EEXIST;
+	de = ux_find_entry(dir, dentry->d_name.name, dentry->d_name.len, &bh);
+	brelse(bh);
+	if (de)
+		goto out;
 	
+	err = -ENOSPC;
 	inode = new_inode(dir->i_sb);
 	if (!inode) {
-		return -ENOSPC;
+		goto out;
 	}
 
 	inum = ux_ialloc(dir->i_sb);
 	if (!inum) {
 		iput(inode);
-		return -ENOSPC;
+		goto out;
 	}
 
 	printk("ux_create : inum = %d\n", (int)inum);
@@ -634,13 +733,8 @@ static int ux_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 	 */
 
 	inode_init_owner(inode, dir, mode|S_IFDIR);
-	inode->i_mtime = inode->i_atime = inode->i_ctime = CURRENT_TIME_SEC;
+	inode->i_mtime = inode->i_atime = inode->i_ctime = current_fs_time(inode->i_sb);
 	inode->i_blkbits = UX_BSIZE_BITS;
-	inode->i_blocks = 1;
-	inode->i_size = UX_BSIZE;
-	inode->i_op = &ux_file_inops;
-	inode->i_fop = &ux_file_operations;
-	inode->i_mapping->a_ops = &ux_aops;
 	inode->i_mode = mode|S_IFDIR;
 	inode->i_ino = inum;
 
@@ -649,31 +743,85 @@ static int ux_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 	inode->i_mapping->a_ops = &ux_aops;
 
 	insert_inode_hash(inode); 
-	mark_inode_dirty(inode);
-
-
 	inode_inc_link_count(inode);
 
-	ux_make_empty(inode, dir);
-	printk("%s:before ux_add_link\n", __func__);
-	ux_add_link(dentry, inode);
-	printk("%s:after ux_add_link\n", __func__);
+	err = ux_make_empty(inode, dir);
+	if (!err)
+		err = ux_add_entry(dir, dentry->d_name.name, dentry->d_name.len, inum);
+	if (err) {
+		clear_nlink(inode);
+		mark_inode_dirty(inode);
+		goto out_iput;
+	}
+
+	inode_inc_link_count(dir);
+	mark_inode_dirty(inode);
+	ux_update_inode(inode);
+	ux_update_inode(dir);
 	d_instantiate(dentry, inode);
+out:
+	ux_journal_stop(handle);
+	return err;
 
-	return 0;
+out_iput:
+	ux_journal_stop(handle);
+	iput(inode);
+	return err;
 }
 
 static int ux_rmdir(struct inode *dir, struct dentry *dentry)
 {
+	struct inode *inode = d_inode(dentry);
+	struct buffer_head *bh;
+	struct ux_dirent *de;
+	struct ux_handle *handle;
+	int err;
+
 	printk("%s\n", __func__);
-	return 0;
+	handle = ux_journal_start(dir->i_sb, UX_DIROP_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+	err = ux_dir_entries(inode);
+	if (err < 0)
+		goto out;
+	err = -ENOTEMPTY;
+	if (UXFS_I(inode)->i_nentries > 2)
+		goto out;
+
+	err = -ENOENT;
+	de = ux_find_entry(dir, dentry->d_name.name, dentry->d_name.len, &bh);
+	if (!de || de->d_ino != inode->i_ino) {
+		brelse(bh);
+		goto out;
+	}
+	ux_dirent_clear(de);
+	ux_count_entry(dir, -1);
+	ux_dirent_dirty(dir, bh);
+	brelse(bh);
+
+	/*
+	 * The directory may still be someone's cwd, so it is freed
+	 * by the last iput() like any unlinked file.
+	 */
+
+	inode->i_ctime = dir->i_ctime;
+	clear_nlink(inode);
+	ux_orphan_add(inode);
+	ux_update_inode(inode);
+	inode_dec_link_count(dir);
+	ux_update_inode(dir);
+	err = 0;
+out:
+	ux_journal_stop(handle);
+	return err;
 }
 
-	
 struct inode_operations ux_dir_inops = {
 	.create = ux_create,
 	.lookup = ux_lookup,
 	.link   = ux_link,
+	.symlink = ux_symlink,
 	.unlink = ux_unlink,
 	.rename = ux_rename,
 	.mkdir  = ux_mkdir,
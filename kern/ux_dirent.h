@@ -0,0 +1,83 @@
+#ifndef _UX_DIRENT_H
+#define _UX_DIRENT_H
+
+/*
+ * Directory entry search, insertion and removal, and the inline
+ * directory layout, shared by the kernel and the tools so that both
+ * agree on which names match, which slot a new entry takes and where
+ * entries live. Include after ux_fs.h.
+ */
+
+static inline int namecompare(int len, int maxlen, const char *name, const char *buffer)
+{
+	if (len < maxlen && buffer[len])
+		return 0;
+	return !memcmp(name, buffer, len);
+}
+
+/*
+ * Search n entries for a name. Unlinking only clears d_ino, so a
+ * free slot still holds the name it last had; only live entries
+ * are compared.
+ */
+
+static inline struct ux_dirent *ux_dirent_find(struct ux_dirent *dirent, int n,
+					       const char *name, int namelen)
+{
+	for ( ; n > 0 ; n--, dirent++)
+		if (dirent->d_ino && namecompare(namelen, UX_NAMELEN, name, dirent->d_name))
+			return dirent;
+	return NULL;
+}
+
+static inline struct ux_dirent *ux_dirent_free(struct ux_dirent *dirent, int n)
+{
+	for ( ; n > 0 ; n--, dirent++)
+		if (!dirent->d_ino)
+			return dirent;
+	return NULL;
+}
+
+static inline void ux_set_dirent(struct ux_dirent *dirent, const char *name, int namelen,
+				 __u32 inum)
+{
+	int j;
+
+	dirent->d_ino = inum;
+	for (j = 0 ; j < UX_NAMELEN ; j++)
+		dirent->d_name[j] = ((j < namelen) ? name[j] : 0);
+}
+
+static inline void ux_dirent_clear(struct ux_dirent *dirent)
+{
+	dirent->d_ino = 0;
+	dirent->d_name[0] = '\0';
+}
+
+/*
+ * A new directory starts out inline, with "." and ".." in the
+ * inode's inline area.
+ */
+
+static inline void ux_dir_init_inline(char *area, __u32 ino, __u32 parent)
+{
+	struct ux_dirent *de = (struct ux_dirent *)area;
+
+	memset(area, 0, UX_INLINE_SIZE);
+	ux_set_dirent(&de[0], ".", 1, ino);
+	ux_set_dirent(&de[1], "..", 2, parent);
+}
+
+/*
+ * Move the entries of an inline directory into its first block.
+ * They keep their offsets, so readdir positions stay valid.
+ */
+
+static inline void ux_dir_move_inline(char *block, char *area)
+{
+	memset(block, 0, UX_BSIZE);
+	memcpy(block, area, UX_INLINE_SIZE);
+	memset(area, 0, UX_INLINE_SIZE);
+}
+
+#endif
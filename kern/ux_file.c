@@ -1,71 +1,255 @@
 #include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/pagemap.h>
 #include <linux/buffer_head.h>
+#include <linux/blkdev.h>
 #include "ux_fs.h"
+#include "ux_map.h"
+
+/*
+ * Blocks that were never written have a zero address and read
+ * back as zeroes, so SEEK_DATA and SEEK_HOLE only need to look at
+ * the block list. A page dirtied through mmap is only given its
+ * block at writeback, so write back the range first. An inline
+ * file is all data.
+ */
+
+static loff_t ux_file_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct inode *inode = file->f_mapping->host;
+	struct uxfs_inode_info *ui = UXFS_I(inode);
+	loff_t size, pos;
+	sector_t blk;
+	int err;
+
+	if (whence != SEEK_DATA && whence != SEEK_HOLE)
+		return generic_file_llseek(file, offset, whence);
+
+	inode_lock(inode);
+	size = i_size_read(inode);
+	if (offset < 0 || offset >= size) {
+		inode_unlock(inode);
+		return -ENXIO;
+	}
+	err = filemap_write_and_wait_range(inode->i_mapping, offset, LLONG_MAX);
+	if (err) {
+		inode_unlock(inode);
+		return err;
+	}
+
+	pos = (whence == SEEK_DATA) ? offset : size;
+	if (!(ui->i_flags & UX_INLINE_DATA)) {
+		pos = (whence == SEEK_DATA) ? -ENXIO : size;
+		for (blk = offset >> UX_BSIZE_BITS ;
+		     blk < UX_DIRECT_BLOCKS && ((loff_t)blk << UX_BSIZE_BITS) < size ; blk++) {
+			if (!ui->i_addr[blk] == (whence == SEEK_HOLE)) {
+				pos = max_t(loff_t, offset, (loff_t)blk << UX_BSIZE_BITS);
+				break;
+			}
+		}
+	}
+	if (pos >= 0)
+		pos = vfs_setpos(file, min(pos, size), inode->i_sb->s_maxbytes);
+	inode_unlock(inode);
+	return pos;
+}
+
+/*
+ * __generic_file_fsync() writes the pages and the inode. The blocks
+ * they were given are recorded in the maps, which the journal
+ * commit writes, or without a journal ux_sync_maps(). The cache
+ * flush then covers the lot.
+ */
+
+static int ux_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+	struct inode *inode = file->f_mapping->host;
+	struct super_block *sb = inode->i_sb;
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+	int err;
+
+	err = __generic_file_fsync(file, start, end, datasync);
+	if (err)
+		return err;
+	if (fs->u_journal)
+		err = ux_journal_commit(sb);
+	else
+		err = ux_sync_maps(sb);
+	if (err)
+		return err;
+	return blkdev_issue_flush(sb->s_bdev, GFP_KERNEL, NULL);
+}
 
 struct file_operations ux_file_operations = {
-	.llseek     = generic_file_llseek,
+	.llseek     = ux_file_llseek,
+	.fsync      = ux_fsync,
 	.read_iter  = generic_file_read_iter,
 	.write_iter = generic_file_write_iter,
 	.mmap       = generic_file_mmap,
 	.splice_read = generic_file_splice_read,
+	.splice_write = iter_file_splice_write,
+	.unlocked_ioctl = ux_ioctl,
 };
 
 int ux_get_block(struct inode *inode, sector_t block, struct buffer_head *bh_result, int create)
 {
 	struct super_block *sb = inode->i_sb;
 	struct uxfs_inode_info *ui = UXFS_I(inode);
-	int blk = 0;
+	struct ux_handle *handle;
+	__u32 blk;
+	int err;
 
 	/*
-	 * First check to see is the file can be extended.
+	 * First check to see is the file can be extended. A lookup
+	 * past the last block, such as generic_block_fiemap() probing
+	 * for the end of the file, just finds a hole.
 	 */
 
 	printk("uxfs: ux_get_block block = %u, create = %d\n", (unsigned int)block, create);
 	printk("uxfs: ux_get_block inode->i_blocks = %u, inode->i_size = %u\n", (unsigned int)inode->i_blocks, (unsigned int)inode->i_size);
-	if (block >= UX_DIRECT_BLOCKS) {
-		return -EFBIG;
+	err = ux_bmap_lookup(ui->i_addr, block, create, &blk);
+	if (err)
+		return err;
+	if (blk) {
+		map_bh(bh_result, inode->i_sb, blk);
+		return 0;
 	}
 
-	if (!create) {
-		if (block < inode->i_blocks) {
-			map_bh(bh_result, inode->i_sb, ui->i_addr[block]);
-		}
+	/*
+	 * A zero address is a hole, which reads as zeroes. Blocks
+	 * are only allocated when written, and a new block is flagged
+	 * so the parts of it the write doesn't cover are zeroed.
+	 */
+
+	if (!create)
 		return 0;
-	}
-	
-	if(inode->i_size > 0){
-		
-		/*
-	 	* If we're creating we must allocate a new block.
-		* do not allocate blocks for empty file
-	 	*/
-		
-		blk = ux_block_alloc(sb);
-		if (blk == 0){
-			printk("uxfs: ux_get_block - Out of space\n");
-			return -ENOSPC;
-		}
-	
-		printk("uxfs: ux_get_block - blk = %u\n", (unsigned int)blk);
 
-		ui->i_addr[block] = blk;
-		ui->i_blocks++;	
-		mark_inode_dirty(inode);
-		map_bh(bh_result, inode->i_sb, ui->i_addr[block]);
+	handle = ux_journal_start(sb, UX_ALLOC_CREDITS + UX_INODE_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	blk = ux_block_alloc(sb);
+	if (blk == 0){
+		ux_journal_stop(handle);
+		printk("uxfs: ux_get_block - Out of space\n");
+		return -ENOSPC;
 	}
 
+	printk("uxfs: ux_get_block - blk = %u\n", (unsigned int)blk);
+
+	ui->i_addr[block] = blk;
+	ui->i_blocks++;	
+	inode->i_blocks = ui->i_blocks;
+	mark_inode_dirty(inode);
+	ux_update_inode(inode);
+	ux_journal_stop(handle);
+	map_bh(bh_result, inode->i_sb, ui->i_addr[block]);
+	set_buffer_new(bh_result);
 	return 0;
 }
 
+/*
+ * Fill a page of an inline file from the in-core inode. Anything
+ * past the inline area reads as zeroes. Called with the page locked.
+ */
+
+static void ux_read_inline_page(struct inode *inode, struct page *page)
+{
+	struct uxfs_inode_info *ui = UXFS_I(inode);
+	size_t len = 0;
+	char *kaddr;
+
+	if (page->index == 0)
+		len = min_t(loff_t, i_size_read(inode), UX_INLINE_SIZE);
+	kaddr = kmap_atomic(page);
+	memcpy(kaddr, ui->i_inline, len);
+	memset(kaddr + len, 0, PAGE_SIZE - len);
+	flush_dcache_page(page);
+	kunmap_atomic(kaddr);
+	SetPageUptodate(page);
+}
+
+/*
+ * Move the data of an inline file out to a real block, before a
+ * write that no longer fits in the inode. Called with i_mutex held.
+ */
+
+static int ux_inline_convert(struct inode *inode, unsigned flags)
+{
+	struct uxfs_inode_info *ui = UXFS_I(inode);
+	struct ux_handle *handle;
+	struct page *page;
+	unsigned len;
+	int err = 0;
+
+	page = grab_cache_page_write_begin(inode->i_mapping, 0, flags);
+	if (!page)
+		return -ENOMEM;
+	handle = ux_journal_start(inode->i_sb, UX_ALLOC_CREDITS + UX_INODE_CREDITS);
+	if (IS_ERR(handle)) {
+		err = PTR_ERR(handle);
+		goto out;
+	}
+	if (!PageUptodate(page))
+		ux_read_inline_page(inode, page);
+
+	ui->i_flags &= ~UX_INLINE_DATA;
+	len = min_t(loff_t, i_size_read(inode), UX_INLINE_SIZE);
+	if (len) {
+		err = __block_write_begin(page, 0, len, ux_get_block);
+		if (err) {
+			ui->i_flags |= UX_INLINE_DATA;
+			goto out_stop;
+		}
+		block_commit_write(page, 0, len);
+	}
+	memset(ui->i_inline, 0, sizeof(ui->i_inline));
+	mark_inode_dirty(inode);
+	ux_update_inode(inode);
+out_stop:
+	ux_journal_stop(handle);
+out:
+	unlock_page(page);
+	put_page(page);
+	return err;
+}
+
 int ux_writepage(struct page *page, struct writeback_control *wbc)
 {
+	struct inode *inode = page->mapping->host;
+	struct uxfs_inode_info *ui = UXFS_I(inode);
+	char *kaddr;
+
 	printk("%s\n", __func__);
+	if (ui->i_flags & UX_INLINE_DATA) {
+
+		/*
+		 * Only reached through a shared mapping, writes
+		 * copy into the inode from ux_write_end().
+		 */
+
+		if (page->index == 0) {
+			kaddr = kmap_atomic(page);
+			memcpy(ui->i_inline, kaddr, UX_INLINE_SIZE);
+			kunmap_atomic(kaddr);
+			mark_inode_dirty(inode);
+		}
+		unlock_page(page);
+		return 0;
+	}
 	return block_write_full_page(page, ux_get_block, wbc);
 }
 
 int ux_readpage(struct file *file, struct page *page)
 {
+	struct inode *inode = page->mapping->host;
+
 	printk("%s\n", __func__);
+	if (UXFS_I(inode)->i_flags & UX_INLINE_DATA) {
+		ux_read_inline_page(inode, page);
+		unlock_page(page);
+		return 0;
+	}
 	return block_read_full_page(page, ux_get_block);
 }
 
@@ -80,14 +264,158 @@ static void ux_write_failed(struct address_space *mapping, loff_t to)
 
 int ux_write_begin(struct file *file, struct address_space *mapping, loff_t pos, unsigned len, unsigned flags, struct page **pagep, void **fsdata)
 {
+	struct inode *inode = mapping->host;
+	struct page *page;
 	int ret;
+
 	printk("%s\n", __func__);
+	if (UXFS_I(inode)->i_flags & UX_INLINE_DATA) {
+		if (pos + len <= UX_INLINE_SIZE) {
+			page = grab_cache_page_write_begin(mapping, 0, flags);
+			if (!page)
+				return -ENOMEM;
+			if (!PageUptodate(page))
+				ux_read_inline_page(inode, page);
+			*pagep = page;
+			return 0;
+		}
+		ret = ux_inline_convert(inode, flags);
+		if (ret)
+			return ret;
+	}
 	ret = block_write_begin(mapping, pos, len, flags, pagep, ux_get_block);
 	if (unlikely(ret))
 		ux_write_failed(mapping, pos + len);
 	return ret;
 }
 
+static int ux_write_end(struct file *file, struct address_space *mapping, loff_t pos, unsigned len, unsigned copied, struct page *page, void *fsdata)
+{
+	struct inode *inode = mapping->host;
+	struct uxfs_inode_info *ui = UXFS_I(inode);
+	char *kaddr;
+
+	if (!(ui->i_flags & UX_INLINE_DATA))
+		return generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+
+	kaddr = kmap_atomic(page);
+	memcpy(ui->i_inline + pos, kaddr + pos, copied);
+	kunmap_atomic(kaddr);
+	if (pos + copied > inode->i_size)
+		i_size_write(inode, pos + copied);
+	unlock_page(page);
+	put_page(page);
+	mark_inode_dirty(inode);
+	return copied;
+}
+
+/*
+ * Free the blocks of an inode from index "first" onwards, in one
+ * batch. Called inside a handle.
+ */
+
+void ux_truncate_blocks(struct inode *inode, unsigned first)
+{
+	struct uxfs_inode_info *ui = UXFS_I(inode);
+	__u32 blks[UX_DIRECT_BLOCKS];
+	int n;
+
+	n = ux_bmap_truncate(ui->i_addr, first, blks);
+	if (!n)
+		return;
+	ux_block_free_batch(inode->i_sb, blks, n);
+	ui->i_blocks -= min_t(__u32, n, ui->i_blocks);
+	inode->i_blocks = ui->i_blocks;
+}
+
+static int ux_truncate(struct inode *inode, loff_t size)
+{
+	struct uxfs_inode_info *ui = UXFS_I(inode);
+	struct ux_handle *handle;
+	int err;
+
+	if (size > UX_DIRECT_BLOCKS * UX_BSIZE)
+		return -EFBIG;
+
+	if (ui->i_flags & UX_INLINE_DATA) {
+		if (size <= UX_INLINE_SIZE) {
+			if (size < inode->i_size)
+				memset(ui->i_inline + size, 0, UX_INLINE_SIZE - size);
+			truncate_setsize(inode, size);
+			return 0;
+		}
+		err = ux_inline_convert(inode, 0);
+		if (err)
+			return err;
+	}
+
+	truncate_setsize(inode, size);
+	err = block_truncate_page(inode->i_mapping, size, ux_get_block);
+	if (err)
+		return err;
+
+	handle = ux_journal_start(inode->i_sb, UX_TRUNCATE_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	ux_truncate_blocks(inode, (size + UX_BSIZE - 1) >> UX_BSIZE_BITS);
+	inode->i_mtime = inode->i_ctime = current_fs_time(inode->i_sb);
+	ux_update_inode(inode);
+	ux_journal_stop(handle);
+	return 0;
+}
+
+static int ux_setattr(struct dentry *dentry, struct iattr *attr)
+{
+	struct inode *inode = d_inode(dentry);
+	int err;
+
+	err = inode_change_ok(inode, attr);
+	if (err)
+		return err;
+
+	if ((attr->ia_valid & ATTR_SIZE) && attr->ia_size != i_size_read(inode)) {
+		err = ux_truncate(inode, attr->ia_size);
+		if (err)
+			return err;
+	}
+	setattr_copy(inode, attr);
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+/*
+ * Block files are mapped by the generic code, which merges runs of
+ * contiguous blocks into extents. Inline data is reported as one
+ * extent at its byte address inside the inode's block.
+ */
+
+static int ux_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo, u64 start, u64 len)
+{
+	struct ux_fs *fs = (struct ux_fs *)inode->i_sb->s_fs_info;
+	u64 phys, size;
+	int err;
+
+	if (!(UXFS_I(inode)->i_flags & UX_INLINE_DATA))
+		return generic_block_fiemap(inode, fieinfo, start, len, ux_get_block);
+
+	err = fiemap_check_flags(fieinfo, FIEMAP_FLAG_SYNC);
+	if (err)
+		return err;
+
+	inode_lock(inode);
+	size = i_size_read(inode);
+	if (start < size) {
+		phys = (u64)(fs->u_sb->s_inode_block + inode->i_ino) * UX_BSIZE +
+			offsetof(struct ux_inode, i_inline);
+		err = fiemap_fill_next_extent(fieinfo, 0, phys, size,
+					      FIEMAP_EXTENT_DATA_INLINE |
+					      FIEMAP_EXTENT_NOT_ALIGNED |
+					      FIEMAP_EXTENT_LAST);
+	}
+	inode_unlock(inode);
+	return err < 0 ? err : 0;
+}
+
 static sector_t ux_bmap(struct address_space *mapping, sector_t block)
 {
     printk("%s\n", __func__);
@@ -98,8 +426,21 @@ struct address_space_operations ux_aops = {
 	.readpage	    = ux_readpage,
 	.writepage	    = ux_writepage,
 	.write_begin    = ux_write_begin,
-	.write_end	    = generic_write_end,
+	.write_end	    = ux_write_end,
 	.bmap		    = ux_bmap,
 };
 
-struct inode_operations ux_file_inops; 
+struct inode_operations ux_file_inops = {
+	.setattr	= ux_setattr,
+	.fiemap		= ux_fiemap,
+};
+
+struct inode_operations ux_fast_symlink_inops = {
+	.readlink	= generic_readlink,
+	.get_link	= simple_get_link,
+};
+
+struct inode_operations ux_symlink_inops = {
+	.readlink	= generic_readlink,
+	.get_link	= page_get_link,
+}; 
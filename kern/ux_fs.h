@@ -1,6 +1,8 @@
 extern struct address_space_operations ux_aops;
 extern struct inode_operations ux_file_inops;
 extern struct inode_operations ux_dir_inops;
+extern struct inode_operations ux_symlink_inops;
+extern struct inode_operations ux_fast_symlink_inops;
 extern struct file_operations ux_file_operations;
 extern struct file_operations ux_dir_operations;
 
@@ -16,15 +18,54 @@ extern struct file_operations ux_dir_operations;
 #define UX_INODE_BLOCK 8
 #define UX_ROOT_NO 2
 
+/*
+ * Small files keep their data in the inode itself, in the space
+ * the one-inode-per-block layout leaves unused.
+ */
+#define UX_INLINE_SIZE 384
+#define UX_INLINE_DATA 0x1	/* i_flags: data is in i_inline */
+
+/*
+ * The inode and block maps are bitmaps in their own blocks
+ * following the superblock, one bit per inode and one bit per
+ * data block.
+ */
+#define UX_IMAP_BLOCK 1
+#define UX_BMAP_BLOCK 2
+#define UX_BITS_PER_BLOCK (UX_BSIZE * 8)
+
+/*
+ * The superblock only records the layout and the summary counters.
+ * The counters are rebuilt from the maps at mount, so the kernel
+ * writes them back lazily.
+ */
 struct ux_superblock{
 	__u32 s_magic;
 	__u32 s_mode;
 	__u32 s_nifree;
-	__u32 s_inode[UX_MAXFILES];
 	__u32 s_nbfree;
-	__u32 s_block[UX_MAXBLOCKS];
+	__u32 s_ninodes;	/* inodes in the inode table */
+	__u32 s_nblocks;	/* blocks in the data area */
+	__u32 s_imap_block;	/* first inode map block */
+	__u32 s_imap_blocks;
+	__u32 s_bmap_block;	/* first block map block */
+	__u32 s_bmap_blocks;
+	__u32 s_inode_block;	/* first inode table block */
+	__u32 s_data_block;	/* first data block */
+	__u32 s_journal_block;	/* first journal block, 0 if none */
+	__u32 s_journal_blocks;
+	__u32 s_orphan;		/* first inode on the orphan list */
+	__u32 s_flags;
+	__u32 s_inode_init;	/* inode table blocks below this are initialized */
 };
 
+/*
+ * Superblock flags. mkfs -l leaves the inode table unwritten;
+ * the kernel then clears each inode block the first time the
+ * inode is allocated and advances s_inode_init past it.
+ */
+#define UX_LAZY_ITABLE 0x1
+
 struct ux_inode{
 	__u32 i_mode;
 	__u32 i_nlink;
@@ -36,6 +77,20 @@ struct ux_inode{
 	__u32 i_size;
 	__u32 i_blocks;
 	__u32 i_addr[UX_DIRECT_BLOCKS];
+	__u32 i_next_orphan;	/* next inode on the orphan list */
+	__u32 i_flags;
+	char i_inline[UX_INLINE_SIZE];
+
+	/*
+	 * Sub-second parts of the times, in the space left at the end
+	 * of the block. Older images read them as zero because inode
+	 * blocks start out zeroed, written so by mkfs or, with -l, by
+	 * ux_itable_init() on first use, and older kernels only ever
+	 * wrote the fields above.
+	 */
+	__u32 i_atime_nsec;
+	__u32 i_mtime_nsec;
+	__u32 i_ctime_nsec;
 };
 
 
@@ -55,17 +110,166 @@ struct ux_dirent{
 };
 
 #define UX_DIRENT_SIZE 32
+#define UX_INLINE_DIRS (UX_INLINE_SIZE / UX_DIRENT_SIZE)
+
+/*
+ * The metadata journal is split into two halves used in turn by
+ * odd and even transactions. A transaction is a descriptor block
+ * listing the home locations of the blocks that follow it, the
+ * copies of those blocks, and a commit block carrying a checksum
+ * of the copies. Recovery replays the newest committed transaction.
+ */
+#define UX_JOURNAL_MAGIC 0x4a584e55
+#define UX_JOURNAL_BLOCKS 256
+#define UX_JDESC 1
+#define UX_JCOMMIT 2
+#define UX_JDESC_BLOCKS ((UX_BSIZE - 20) / 4)
+
+struct ux_journal_header{
+	__u32 h_magic;
+	__u32 h_type;
+	__u32 h_sequence;
+	__u32 h_count;		/* blocks in the transaction */
+	__u32 h_checksum;	/* commit block: crc32 of the copies */
+	__u32 h_blocknr[UX_JDESC_BLOCKS];	/* descriptor: home blocks */
+};
+
+/*
+ * Fragmentation report. Histograms are indexed by log2 of the
+ * length: bucket b counts lengths 2^b .. 2^(b+1)-1.
+ */
+#define UX_HIST_BUCKETS 16
+
+struct ux_fragstat{
+	__u32 f_free_blocks;
+	__u32 f_free_extents;
+	__u32 f_free_longest;			/* largest contiguous free run */
+	__u32 f_free_hist[UX_HIST_BUCKETS];	/* free extents by length */
+	__u32 f_free_hist_blocks[UX_HIST_BUCKETS];
+	__u32 f_files;
+	__u32 f_inline;
+	__u32 f_fragmented;			/* files in more than one extent */
+	__u32 f_frag_hist[UX_HIST_BUCKETS];	/* files by extent count */
+	__u32 f_frag_hist_blocks[UX_HIST_BUCKETS];
+};
+
+/*
+ * ioctls. UX_IOC_DEFRAG moves a file's blocks into one contiguous
+ * run and returns the number of blocks moved. UX_IOC_FRAGSTAT
+ * reports free space and file fragmentation for the filesystem.
+ */
+#define UX_IOC_DEFRAG _IO('u', 1)
+#define UX_IOC_FRAGSTAT _IOR('u', 2, struct ux_fragstat)
+
+/*
+ * Number of blocks an allocation cache claims from the block map
+ * at a time; the kernel keeps one cache per CPU, libuxfs one per
+ * image. Claimed blocks are only marked in a bitmap in memory, and
+ * reach the block map one at a time as they are handed out, so
+ * a crash loses nothing but the claims. The price is a map update
+ * under u_lock for each block handed out rather than each batch;
+ * the search for free blocks still happens once per batch.
+ */
+#define UX_ALLOC_BATCH 8
+
+struct ux_alloc_cache{
+#ifdef __KERNEL__
+	spinlock_t c_lock;
+#endif
+	__u32 c_goal;
+	__u32 c_next;
+	__u32 c_count;
+	__u32 c_blocks[UX_ALLOC_BATCH];
+};
+
+#ifdef __KERNEL__
+#include <linux/workqueue.h>
+
+/*
+ * Worst-case number of metadata blocks dirtied by one handle,
+ * including the handles nested inside it. Allocating a block logs
+ * the one map block that holds it. A symlink too long for the
+ * inode also allocates a block for each UX_BSIZE of its target.
+ */
+#define UX_ALLOC_CREDITS 1
+#define UX_INODE_CREDITS 1
+#define UX_IALLOC_CREDITS 2
+#define UX_DIROP_CREDITS (6 + UX_IALLOC_CREDITS + 2 * UX_ALLOC_CREDITS)
+#define UX_SYMLINK_CREDITS(len) (UX_DIROP_CREDITS + \
+	((len) > UX_INLINE_SIZE ? DIV_ROUND_UP(len, UX_BSIZE) * UX_ALLOC_CREDITS : 0))
+#define UX_ORPHAN_CREDITS 2
+#define UX_TRUNCATE_CREDITS (UX_INODE_CREDITS + UX_DIRECT_BLOCKS)
+#define UX_RUN_CREDITS UX_DIRECT_BLOCKS
+#define UX_EVICT_CREDITS (1 + UX_ORPHAN_CREDITS + UX_TRUNCATE_CREDITS)
+
+/*
+ * Metadata buffers that belong to the running transaction.
+ */
+enum ux_bh_state_bits {
+	BH_UxJournal = BH_PrivateStart,
+};
+BUFFER_FNS(UxJournal, ux_journal)
+TAS_BUFFER_FNS(UxJournal, ux_journal)
+
+struct ux_journal{
+	struct super_block *j_sb;
+	__u32 j_start;
+	__u32 j_half;			/* blocks in each half of the log */
+	__u32 j_max;			/* blocks per transaction */
+	__u32 j_sequence;		/* of the running transaction */
+	struct rw_semaphore j_barrier;	/* shared by handles, exclusive for commit */
+	spinlock_t j_lock;		/* protects j_nr, j_credits, j_bufs */
+	int j_nr;
+	int j_credits;
+	struct buffer_head **j_bufs;	/* the running transaction */
+	struct buffer_head **j_log;	/* their log copies during commit */
+	int j_aborted;			/* nothing more reaches the disk */
+	struct delayed_work j_work;
+};
+
+struct ux_handle{
+	struct ux_journal *h_journal;
+	int h_credits;
+	int h_ref;
+};
+
+/*
+ * Mount options.
+ */
+#define UX_MOUNT_DISCARD 0x1	/* discard freed blocks after commit */
+#define UX_MOUNT_PREFETCH 0x2	/* read the whole inode table at mount */
+
 struct ux_fs{
 	struct ux_superblock *u_sb;
 	struct buffer_head *u_sbh;
+	struct buffer_head **u_imap;
+	struct buffer_head **u_bmap;
+	spinlock_t u_lock;		/* protects the maps and counters */
+	__u32 u_nifree;
+	__u32 u_nbfree;
+	struct ux_alloc_cache __percpu *u_cache;
+	unsigned long *u_claimed;	/* blocks held in the per-CPU caches */
+	struct rw_semaphore u_trim_sem;	/* shared to refill a cache, exclusive to FITRIM */
+	struct list_head u_discard;	/* extents freed in the running transaction */
+	struct list_head u_discard_ready;	/* committed, waiting for u_discard_work */
+	struct work_struct u_discard_work;
+	struct super_block *u_vfs_sb;	/* for u_discard_work */
+	unsigned long u_mount_opt;
+	struct ux_journal *u_journal;
+	struct mutex u_orphan_lock;	/* protects the orphan list */
+	struct list_head u_orphans;	/* in-core copy, same order as on disk */
 };
 
-#ifdef __KERNEL__
-
 struct uxfs_inode_info{
 	struct inode vfs_inode;
 	__u32 i_blocks;
 	__u32 i_addr[UX_DIRECT_BLOCKS];
+	__u32 i_next_orphan;
+	struct list_head i_orphan;
+	__u32 i_flags;
+	char i_inline[UX_INLINE_SIZE];
+	int i_nentries;			/* live directory entries, -1 until counted */
+	int i_prefetched;		/* entries' inode blocks have been read ahead */
 };
 
 static inline struct uxfs_inode_info *UXFS_I(struct inode *inode)
@@ -74,8 +278,50 @@ static inline struct uxfs_inode_info *UXFS_I(struct inode *inode)
 }
 
 extern ino_t ux_ialloc(struct super_block *);
-//extern struct buffer_head* ux_find_entry(struct inode *, char *, struct ux_dirent**);
+extern void ux_ifree(struct super_block *, ino_t);
 __u32 ux_block_alloc(struct super_block *);
+__u32 ux_block_alloc_run(struct super_block *, __u32);
+__u32 ux_block_claim_run(struct super_block *, __u32);
+void ux_block_use_run(struct super_block *, __u32, __u32);
+void ux_block_unclaim_run(struct super_block *, __u32, __u32);
+void ux_block_free(struct super_block *, __u32);
+void ux_block_free_batch(struct super_block *, __u32 *, int);
+__u32 ux_cached_blocks(struct super_block *);
+int ux_alloc_init(struct super_block *);
+void ux_alloc_drain(struct super_block *);
+int ux_sync_maps(struct super_block *);
+void ux_alloc_release(struct super_block *);
+void ux_discard_commit(struct super_block *);
+void ux_discard_cancel(struct super_block *);
+int ux_trim_fs(struct super_block *, struct fstrim_range *);
+int ux_fragstat(struct super_block *, struct ux_fragstat *);
+long ux_ioctl(struct file *, unsigned int, unsigned long);
 int ux_get_block(struct inode *inode, sector_t block, struct buffer_head *bh_result, int create);
+void ux_truncate_blocks(struct inode *, unsigned);
 extern int ux_prepare_chunk(struct page *page, loff_t pos, unsigned len);
+extern int ux_update_inode(struct inode *);
+extern struct inode *ux_iget(struct super_block *, unsigned long);
+void ux_inode_readahead(struct super_block *, ino_t);
+void ux_orphan_add(struct inode *);
+void ux_orphan_del(struct inode *);
+
+int ux_journal_load(struct super_block *);
+void ux_journal_release(struct super_block *);
+struct ux_handle *ux_journal_start(struct super_block *, int);
+void ux_journal_stop(struct ux_handle *);
+void ux_journal_dirty(struct super_block *, struct buffer_head *);
+void ux_journal_dirty_inode(struct buffer_head *, struct inode *);
+void ux_journal_forget(struct super_block *, struct buffer_head *);
+int ux_journal_commit(struct super_block *);
+int ux_journal_lock(struct super_block *);
+void ux_journal_unlock(struct super_block *);
+
+#ifdef UXFS_SELFTEST
+int ux_run_selftests(void);
+#else
+static inline int ux_run_selftests(void)
+{
+	return 0;
+}
+#endif
 #endif
@@ -9,6 +9,9 @@
 #include <linux/init.h>
 #include <linux/highuid.h>
 #include <linux/vfs.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
+#include <linux/blkdev.h>
 #include "ux_fs.h"
 
 
@@ -21,6 +24,13 @@ static struct inode* ux_alloc_inode(struct super_block *sb)
 	ui = kmem_cache_alloc(uxfs_inode_cachep, GFP_KERNEL);
 	if (!ui)
 		return NULL;
+	ui->i_blocks = 0;
+	memset(ui->i_addr, 0, sizeof(ui->i_addr));
+	ui->i_next_orphan = 0;
+	ui->i_flags = 0;
+	memset(ui->i_inline, 0, sizeof(ui->i_inline));
+	ui->i_nentries = -1;
+	ui->i_prefetched = 0;
 	return &ui->vfs_inode; 
 }
 
@@ -29,42 +39,57 @@ int ux_prepare_chunk(struct page *page, loff_t pos, unsigned len)
 	return __block_write_begin(page, pos, len, ux_get_block);
 }
 
-static struct buffer_head* ux_find_entry(struct inode *dir, char *name, struct ux_dirent **res_dir)
-{
-	struct super_block *sb = dir->i_sb;
-	struct uxfs_inode_info *ui = UXFS_I(dir);
-	struct buffer_head *bh = NULL;
-	struct ux_dirent   *dirent;
-	int    i, blk = 0;
-	printk("ux_find_entry: name=%s\n", name);
-	for (blk=0 ; blk < dir->i_blocks ; blk++) {
-		bh = sb_bread(sb, ui->i_addr[blk]);
-		dirent = (struct ux_dirent *)bh->b_data;
-		for (i=0 ; i < UX_DIRS_PER_BLOCK ; i++) {
-			if (strcmp(dirent->d_name, name) == 0) {
-				*res_dir = dirent;
-				return bh;
-			}
-			dirent++;
-		}
-	}
+/*
+ * Start reading the block that holds inode ino, if it isn't
+ * cached already. Inodes a lazy table has never written are
+ * skipped, their blocks hold nothing yet.
+ */
 
-	if (bh)
-		brelse(bh);
-	return NULL;
+void ux_inode_readahead(struct super_block *sb, ino_t ino)
+{
+	struct ux_superblock *usb = ((struct ux_fs *)sb->s_fs_info)->u_sb;
+
+	if (ino < UX_ROOT_NO || ino >= usb->s_ninodes)
+		return;
+	if ((usb->s_flags & UX_LAZY_ITABLE) && ino >= usb->s_inode_init)
+		return;
+	sb_breadahead(sb, usb->s_inode_block + ino);
+}
+
+/*
+ * The "prefetch" mount option: read the whole inode table in at
+ * mount. The reads are plugged, so they go down as one sequential
+ * request and a cold scan of the tree finds every inode cached.
+ */
+
+static void ux_prefetch_itable(struct super_block *s)
+{
+	struct ux_fs	*fs = (struct ux_fs *)s->s_fs_info;
+	struct blk_plug plug;
+	ino_t		ino;
+
+	blk_start_plug(&plug);
+	for (ino = UX_ROOT_NO ; ino < fs->u_sb->s_ninodes ; ino++)
+		ux_inode_readahead(s, ino);
+	blk_finish_plug(&plug);
 }
 
-void ux_read_inode(struct inode *inode)
+static int ux_read_inode(struct inode *inode)
 {
 	struct buffer_head	  *bh;
 	struct ux_inode		  *ui;
+	struct ux_fs		  *fs = (struct ux_fs *)inode->i_sb->s_fs_info;
 	unsigned long		  ino = inode->i_ino;
 	int			  block;
 
 	printk("ux_read_inode ino = %lu \n", ino);
-	if (ino < UX_ROOT_NO || ino > UX_MAXFILES) {
+	if (ino < UX_ROOT_NO || ino >= fs->u_sb->s_ninodes) {
 		printk("uxfs: Bad inode number %lu\n", ino);
-		return;
+		return -EIO;
+	}
+	if ((fs->u_sb->s_flags & UX_LAZY_ITABLE) && ino >= fs->u_sb->s_inode_init) {
+		printk("uxfs: inode %lu was never allocated\n", ino);
+		return -ESTALE;
 	}
 
 	/*
@@ -72,26 +97,33 @@ void ux_read_inode(struct inode *inode)
 	 * inode per block!
 	 */
 
-	block = UX_INODE_BLOCK + ino;
+	block = fs->u_sb->s_inode_block + ino;
 	bh = sb_bread(inode->i_sb, block);
 	if (!bh) {
 		printk("Unable to read inode %lu\n", ino);
-		return;
+		return -EIO;
 	}
 
 	ui = (struct ux_inode *)(bh->b_data);
 
 	printk("ux_read_inode imode = %lu\n", (long unsigned int)ui->i_mode);
 	inode->i_mode = ui->i_mode;
-	if (ui->i_mode & S_IFDIR) {
-		inode->i_mode |= S_IFDIR;
+	if (S_ISDIR(inode->i_mode)) {
 		inode->i_op = &ux_dir_inops;
 		inode->i_fop = &ux_dir_operations;
-	} else if (ui->i_mode & S_IFREG) {
-		inode->i_mode |= S_IFREG;
+	} else if (S_ISREG(inode->i_mode)) {
 		inode->i_op = &ux_file_inops;
 		inode->i_fop = &ux_file_operations;
 		inode->i_mapping->a_ops = &ux_aops;
+	} else if (S_ISLNK(inode->i_mode)) {
+		if (ui->i_flags & UX_INLINE_DATA) {
+			inode->i_op = &ux_fast_symlink_inops;
+			inode->i_link = UXFS_I(inode)->i_inline;
+		} else {
+			inode->i_op = &ux_symlink_inops;
+			inode_nohighmem(inode);
+			inode->i_mapping->a_ops = &ux_aops;
+		}
 	}
 	
 	i_uid_write(inode, ui->i_uid);
@@ -103,67 +135,216 @@ void ux_read_inode(struct inode *inode)
 	inode->i_blocks = ui->i_blocks;
 	inode->i_blkbits = 9;
 	inode->i_atime.tv_sec = ui->i_atime;
+	inode->i_atime.tv_nsec = ui->i_atime_nsec % NSEC_PER_SEC;
 	inode->i_mtime.tv_sec = ui->i_mtime;
+	inode->i_mtime.tv_nsec = ui->i_mtime_nsec % NSEC_PER_SEC;
 	inode->i_ctime.tv_sec = ui->i_ctime;
+	inode->i_ctime.tv_nsec = ui->i_ctime_nsec % NSEC_PER_SEC;
 	printk("inode = %p\n", inode);
 	UXFS_I(inode)->i_blocks = ui->i_blocks;
 	memcpy(UXFS_I(inode)->i_addr, ui->i_addr, sizeof(ui->i_addr));
+	UXFS_I(inode)->i_next_orphan = ui->i_next_orphan;
+	UXFS_I(inode)->i_flags = ui->i_flags;
+	memcpy(UXFS_I(inode)->i_inline, ui->i_inline, sizeof(ui->i_inline));
 	printk("ui blocks = %u\n", UXFS_I(inode)->i_blocks);
 	brelse(bh);
+	return 0;
 }
 
-static struct ux_inode *find_inode(struct super_block* sb, u16 ino, struct buffer_head** p)
+struct inode *ux_iget(struct super_block *sb, unsigned long ino)
 {
+	struct inode *inode;
+	int err;
+
+	inode = iget_locked(sb, ino);
+	if (!inode)
+		return ERR_PTR(-ENOMEM);
+	if (!(inode->i_state & I_NEW))
+		return inode;
+
+	err = ux_read_inode(inode);
+	if (err) {
+		iget_failed(inode);
+		return ERR_PTR(err);
+	}
+	unlock_new_inode(inode);
+	return inode;
+}
+
+static struct ux_inode *find_inode(struct super_block* sb, ino_t ino, struct buffer_head** p)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+
 	printk("ux_find_inode %lu\n", (unsigned long)ino);
-	*p = sb_bread(sb, ino + UX_INODE_BLOCK); 
-	if (!*p)
+	*p = sb_bread(sb, ino + fs->u_sb->s_inode_block); 
+	if (!*p) {
 		printk("unable to read inode\n");
+		return ERR_PTR(-EIO);
+	}
 	return (struct ux_inode*)((*p)->b_data);
 }
 
-static int ux_write_inode(struct inode *inode, struct writeback_control *wbc)
+/*
+ * Copy the in-core inode into its block and log the block in
+ * the caller's transaction.
+ */
+
+int ux_update_inode(struct inode *inode)
 {
 	unsigned long ino = inode->i_ino;
 	struct ux_inode *ui;
 	struct uxfs_inode_info *info = UXFS_I(inode);
+	struct ux_fs *fs = (struct ux_fs *)inode->i_sb->s_fs_info;
 	struct buffer_head *bh;
-	__u32 blk;
 
-	printk("uxfs: ux_write_inode, ino = %lu, inode->i_mode = %lu, isize = %d, blocks=%d, inodeblocks=%d\n", ino, (long unsigned int)inode->i_mode, (unsigned int)inode->i_size, (unsigned int)info->i_blocks, (int)inode->i_blocks);
-	if(ino < UX_ROOT_NO || ino > UX_MAXFILES){
+	if(ino < UX_ROOT_NO || ino >= fs->u_sb->s_ninodes){
 		printk("uxfs: Bad inode number %lu\n", ino);
-		return -1;
+		return -EIO;
 	}
 	
 	ui = find_inode(inode->i_sb, inode->i_ino, &bh);
 	if (IS_ERR(ui))
 		return PTR_ERR(ui);
 	
-	blk = UX_INODE_BLOCK + ino;
 	ui->i_mode = inode->i_mode;
 	ui->i_nlink = inode->i_nlink;
 	ui->i_atime = inode->i_atime.tv_sec;
+	ui->i_atime_nsec = inode->i_atime.tv_nsec;
 	ui->i_mtime = inode->i_mtime.tv_sec;
+	ui->i_mtime_nsec = inode->i_mtime.tv_nsec;
 	ui->i_ctime = inode->i_ctime.tv_sec;
+	ui->i_ctime_nsec = inode->i_ctime.tv_nsec;
 	ui->i_uid = i_uid_read(inode);
 	ui->i_gid = i_gid_read(inode);
 	ui->i_size = inode->i_size;
-	ui->i_blocks = (ui->i_size + UX_BSIZE - 1)/UX_BSIZE;
+	ui->i_blocks = info->i_blocks;
 	memcpy(ui->i_addr, info->i_addr, sizeof(ui->i_addr));
-	memcpy(bh->b_data, ui, sizeof(struct ux_inode));
-	mark_buffer_dirty(bh);
+	ui->i_next_orphan = info->i_next_orphan;
+	ui->i_flags = info->i_flags;
+	memcpy(ui->i_inline, info->i_inline, sizeof(ui->i_inline));
+	ux_journal_dirty(inode->i_sb, bh);
 	brelse(bh);
 	return 0;
 }
 
+/*
+ * Inodes whose last link is gone but which may still be open are
+ * chained from the superblock through i_next_orphan, so that a
+ * crash before ux_evict_inode() runs does not leak them. Entries
+ * are added at the head. Both run inside the caller's handle.
+ */
+
+void ux_orphan_add(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+	struct uxfs_inode_info *ui = UXFS_I(inode);
+
+	mutex_lock(&fs->u_orphan_lock);
+	if (list_empty(&ui->i_orphan)) {
+		ui->i_next_orphan = fs->u_sb->s_orphan;
+		fs->u_sb->s_orphan = inode->i_ino;
+		list_add(&ui->i_orphan, &fs->u_orphans);
+		ux_journal_dirty(sb, fs->u_sbh);
+		ux_update_inode(inode);
+	}
+	mutex_unlock(&fs->u_orphan_lock);
+}
+
+void ux_orphan_del(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+	struct uxfs_inode_info *ui = UXFS_I(inode);
+	struct uxfs_inode_info *prev;
+
+	mutex_lock(&fs->u_orphan_lock);
+	if (!list_empty(&ui->i_orphan)) {
+		if (ui->i_orphan.prev == &fs->u_orphans) {
+			fs->u_sb->s_orphan = ui->i_next_orphan;
+			ux_journal_dirty(sb, fs->u_sbh);
+		} else {
+			prev = list_entry(ui->i_orphan.prev,
+					  struct uxfs_inode_info, i_orphan);
+			prev->i_next_orphan = ui->i_next_orphan;
+			ux_update_inode(&prev->vfs_inode);
+		}
+		list_del_init(&ui->i_orphan);
+		ui->i_next_orphan = 0;
+		ux_update_inode(inode);
+	}
+	mutex_unlock(&fs->u_orphan_lock);
+}
+
+/*
+ * Reclaim the inodes left on the orphan list by a crash. Each one
+ * is freed by the final iput(), which also takes it off the list,
+ * so this costs time in the number of orphans only.
+ */
+
+static void ux_orphan_cleanup(struct super_block *sb)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+	struct ux_handle *handle;
+	struct inode *inode;
+	__u32 ino, count = 0;
+
+	while ((ino = fs->u_sb->s_orphan) != 0) {
+		if (count++ >= fs->u_sb->s_ninodes) {
+			printk("uxfs: orphan list is looped\n");
+			break;
+		}
+		inode = ux_iget(sb, ino);
+		if (IS_ERR(inode)) {
+			printk("uxfs: bad orphan inode %u\n", ino);
+			break;
+		}
+		handle = ux_journal_start(sb, UX_ORPHAN_CREDITS);
+		if (IS_ERR(handle)) {
+			iput(inode);
+			break;
+		}
+		mutex_lock(&fs->u_orphan_lock);
+		if (list_empty(&UXFS_I(inode)->i_orphan))
+			list_add(&UXFS_I(inode)->i_orphan, &fs->u_orphans);
+		mutex_unlock(&fs->u_orphan_lock);
+		if (inode->i_nlink)
+			ux_orphan_del(inode);
+		ux_journal_stop(handle);
+		iput(inode);
+	}
+	if (count)
+		printk("uxfs: %u orphan inodes reclaimed\n", count);
+}
+
+static int ux_write_inode(struct inode *inode, struct writeback_control *wbc)
+{
+	struct ux_handle *handle;
+	int err;
+
+	handle = ux_journal_start(inode->i_sb, UX_INODE_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	err = ux_update_inode(inode);
+	ux_journal_stop(handle);
+
+	/*
+	 * fsync() needs the inode on disk now. For sync(2) the
+	 * whole lot is committed once from ux_sync_fs().
+	 */
+
+	if (!err && wbc->sync_mode == WB_SYNC_ALL && !wbc->for_sync)
+		err = ux_journal_commit(inode->i_sb);
+	return err;
+}
+
 static void ux_evict_inode(struct inode *inode)
 {
 	struct buffer_head *bh;
 	struct ux_inode* ui;
 	struct super_block *sb = inode->i_sb;
-	struct ux_fs *info = (struct uxfs_fs_info*)sb->s_fs_info;
-	struct ux_superblock *usb = info->u_sb;
-	int i = 0;
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+	struct ux_handle *handle;
 
 	printk("evict inode = %p, inode->i_nlink = %u inode->i_ino = %u\n", inode, inode->i_nlink, (unsigned int)inode->i_ino);
 	truncate_inode_pages_final(&inode->i_data);
@@ -173,22 +354,244 @@ static void ux_evict_inode(struct inode *inode)
 	if (inode->i_nlink)
 		return;
 	
-	ui = find_inode(sb, inode->i_ino, &bh);
-	if (IS_ERR(ui))
+	/*
+	 * Eviction never runs inside another handle, so this can only
+	 * fail once the journal has aborted and nothing more reaches
+	 * the disk. The inode stays on the on-disk orphan list and is
+	 * freed at the next mount; only the in-core entry, which goes
+	 * away with the inode, is unlinked.
+	 */
+
+	handle = ux_journal_start(sb, UX_EVICT_CREDITS);
+	if (IS_ERR(handle)) {
+		printk("uxfs: unable to free inode %lu, left on the orphan list\n",
+		       inode->i_ino);
+		mutex_lock(&fs->u_orphan_lock);
+		list_del_init(&UXFS_I(inode)->i_orphan);
+		mutex_unlock(&fs->u_orphan_lock);
 		return;
+	}
+
+	ux_orphan_del(inode);
+	ui = find_inode(sb, inode->i_ino, &bh);
+	if (!IS_ERR(ui)) {
+		ux_ifree(sb, inode->i_ino);
+		ux_truncate_blocks(inode, 0);
 
-	usb->s_nifree++;
-	usb->s_inode[inode->i_ino] = UX_INODE_FREE;	
-	for(i = 0; i < ui->i_blocks; i++){
-		usb->s_block[ui->i_addr[i] - UX_FIRST_DATA_BLOCK] = UX_BLOCK_FREE;
-		usb->s_nbfree++;
+		memset(ui, 0, sizeof(struct ux_inode));
+		ux_journal_dirty(sb, bh);
+		brelse(bh);
 	}
-	mark_buffer_dirty(info->u_sbh);
+	ux_journal_stop(handle);
+}
 
-	memset(ui, 0, sizeof(struct ux_inode));
-	mark_buffer_dirty(bh);
-	brelse(bh);
+/*
+ * Copy the in-core free counts and the mount state into the
+ * superblock. With a journal the superblock is logged in a handle
+ * of its own, like any other metadata, so it never reaches the
+ * disk part way through a transaction; "sync" then commits and
+ * flushes it home. Without one it is written in place, and "sync"
+ * makes the write carry the one cache flush, which also covers
+ * every block written and waited on before it.
+ */
+
+static int ux_commit_super(struct super_block *s, __u32 mode, int sync)
+{
+	struct ux_fs *fs = (struct ux_fs*)s->s_fs_info;
+	struct ux_superblock *usb = fs->u_sb;
+	struct ux_handle *handle;
+	int err;
+
+	handle = ux_journal_start(s, UX_INODE_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	spin_lock(&fs->u_lock);
+	usb->s_mode = mode;
+	usb->s_nifree = fs->u_nifree;
+	usb->s_nbfree = fs->u_nbfree + ux_cached_blocks(s);
+	spin_unlock(&fs->u_lock);
+
+	if (!handle) {
+		mark_buffer_dirty(fs->u_sbh);
+		if (sync)
+			return __sync_dirty_buffer(fs->u_sbh, WRITE_FLUSH_FUA);
+		return 0;
+	}
+	ux_journal_dirty(s, fs->u_sbh);
+	ux_journal_stop(handle);
+	if (!sync)
+		return 0;
+	err = ux_journal_commit(s);
+	if (!err)
+		err = blkdev_issue_flush(s->s_bdev, GFP_KERNEL, NULL);
+	return err;
+}
+
+/*
+ * Get everything on disk and the superblock marked clean. Used at
+ * unmount, freeze and remount read-only. The caches are drained
+ * first; that only gives back in-memory claims, so it needs no
+ * handle. The discards queued by the commit are waited for, so
+ * none is in flight once this returns.
+ */
+
+static int ux_make_clean(struct super_block *s)
+{
+	struct ux_fs *fs = (struct ux_fs*)s->s_fs_info;
+	int err, err2;
+
+	ux_alloc_drain(s);
+	err = ux_journal_commit(s);
+	flush_work(&fs->u_discard_work);
+	err2 = ux_sync_maps(s);
+	if (!err)
+		err = err2;
+	err2 = ux_commit_super(s, UX_FSCLEAN, 1);
+	return err ? err : err2;
+}
+
+static int ux_mark_dirty(struct super_block *s)
+{
+	return ux_commit_super(s, UX_FSDIRTY, 1);
+}
+
+static int ux_sync_fs(struct super_block *s, int wait)
+{
+	struct ux_fs *fs = (struct ux_fs*)s->s_fs_info;
+	int err, err2;
 
+	if (!wait) {
+		ux_commit_super(s, fs->u_sb->s_mode, 0);
+		return 0;
+	}
+	err = ux_journal_commit(s);
+	err2 = ux_sync_maps(s);
+	if (!err)
+		err = err2;
+	err2 = ux_commit_super(s, fs->u_sb->s_mode, 1);
+	return err ? err : err2;
+}
+
+static int ux_freeze_fs(struct super_block *s)
+{
+	return ux_make_clean(s);
+}
+
+static int ux_unfreeze_fs(struct super_block *s)
+{
+	return ux_mark_dirty(s);
+}
+
+enum {
+	Opt_discard, Opt_nodiscard, Opt_prefetch, Opt_noprefetch,
+	Opt_lazytime, Opt_nolazytime, Opt_err
+};
+
+static const match_table_t tokens = {
+	{Opt_discard, "discard"},
+	{Opt_nodiscard, "nodiscard"},
+	{Opt_prefetch, "prefetch"},
+	{Opt_noprefetch, "noprefetch"},
+	{Opt_lazytime, "lazytime"},
+	{Opt_nolazytime, "nolazytime"},
+	{Opt_err, NULL}
+};
+
+/*
+ * Parse the mount options into the filesystem. lazytime and
+ * nolazytime are applied to *flags, which are the superblock's
+ * flags at mount and the requested ones at remount.
+ */
+
+static int ux_parse_options(struct super_block *s, char *options, unsigned long *flags)
+{
+	struct ux_fs *fs = (struct ux_fs*)s->s_fs_info;
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+
+	if (!options)
+		return 0;
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+		switch (match_token(p, tokens, args)) {
+		case Opt_discard:
+			if (!blk_queue_discard(bdev_get_queue(s->s_bdev))) {
+				printk("uxfs: device does not support discard, option ignored\n");
+				break;
+			}
+			fs->u_mount_opt |= UX_MOUNT_DISCARD;
+			break;
+		case Opt_nodiscard:
+			fs->u_mount_opt &= ~UX_MOUNT_DISCARD;
+			break;
+		case Opt_prefetch:
+			fs->u_mount_opt |= UX_MOUNT_PREFETCH;
+			break;
+		case Opt_noprefetch:
+			fs->u_mount_opt &= ~UX_MOUNT_PREFETCH;
+			break;
+
+		/*
+		 * mount(8) passes lazytime as MS_LAZYTIME, but accept
+		 * it spelled out as well. The VFS does the rest: with
+		 * MS_LAZYTIME set, inodes whose only change is their
+		 * times stay off the writeback lists until something
+		 * else dirties them, they are synced or evicted, or
+		 * dirtytime_expire_seconds passes.
+		 */
+
+		case Opt_lazytime:
+			*flags |= MS_LAZYTIME;
+			break;
+		case Opt_nolazytime:
+			*flags &= ~MS_LAZYTIME;
+			break;
+		default:
+			printk("uxfs: unrecognized mount option \"%s\"\n", p);
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
+static int ux_show_options(struct seq_file *seq, struct dentry *root)
+{
+	struct ux_fs *fs = (struct ux_fs*)root->d_sb->s_fs_info;
+
+	if (fs->u_mount_opt & UX_MOUNT_DISCARD)
+		seq_puts(seq, ",discard");
+	if (fs->u_mount_opt & UX_MOUNT_PREFETCH)
+		seq_puts(seq, ",prefetch");
+	return 0;
+}
+
+static int ux_remount(struct super_block *s, int *flags, char *data)
+{
+	struct ux_fs *fs = (struct ux_fs*)s->s_fs_info;
+	unsigned long new_flags = *flags;
+	int err;
+
+	/*
+	 * The VFS applies MS_LAZYTIME from *flags once we return,
+	 * so "lazytime" spelled out in the options goes there too.
+	 */
+
+	sync_filesystem(s);
+	err = ux_parse_options(s, data, &new_flags);
+	if (err)
+		return err;
+	*flags = new_flags;
+	if ((*flags & MS_RDONLY) == (s->s_flags & MS_RDONLY))
+		return 0;
+	if (*flags & MS_RDONLY)
+		return ux_make_clean(s);
+	if (fs->u_journal && fs->u_journal->j_aborted) {
+		printk("uxfs: journal aborted, remount read-write refused\n");
+		return -EROFS;
+	}
+	ux_orphan_cleanup(s);
+	return ux_mark_dirty(s);
 }
 
 void ux_put_super(struct super_block* s)
@@ -196,6 +599,10 @@ void ux_put_super(struct super_block* s)
 	struct ux_fs *fs = (struct ux_fs*)s->s_fs_info;
 	if (!fs)
 		return;
+	if (!(s->s_flags & MS_RDONLY))
+		ux_make_clean(s);
+	ux_journal_release(s);
+	ux_alloc_release(s);
 	brelse(fs->u_sbh);
 	printk("ux_put_super\n");
 	kfree(fs);
@@ -208,6 +615,7 @@ int ux_statfs(struct dentry* dentry, struct kstatfs* buf)
 	struct ux_fs *fs;
 	struct ux_superblock *usb;
 	u64 id ;
+	__u32 nifree, nbfree;
 	
 	printk("ux_statfs\n");
 	s = dentry->d_sb;
@@ -215,13 +623,18 @@ int ux_statfs(struct dentry* dentry, struct kstatfs* buf)
 	usb = fs->u_sb;
 	id = huge_encode_dev(s->s_bdev->bd_dev);
 
+	spin_lock(&fs->u_lock);
+	nifree = fs->u_nifree;
+	nbfree = fs->u_nbfree;
+	spin_unlock(&fs->u_lock);
+
 	buf->f_type = UX_MAGIC;
 	buf->f_bsize = UX_BSIZE;
-	buf->f_blocks = UX_MAXBLOCKS;
-	buf->f_bfree = usb->s_nbfree;
-	buf->f_bavail = usb->s_nbfree;
-	buf->f_files = UX_MAXFILES;
-	buf->f_ffree = usb->s_nifree;
+	buf->f_blocks = usb->s_nblocks;
+	buf->f_bfree = nbfree + ux_cached_blocks(s);
+	buf->f_bavail = buf->f_bfree;
+	buf->f_files = usb->s_ninodes;
+	buf->f_ffree = nifree;
 	buf->f_fsid.val[0] = (u32)id;
 	buf->f_fsid.val[1] = (u32)(id >> 32);
 
@@ -245,6 +658,7 @@ static void init_once(void *foo)
 	struct uxfs_inode_info *ui = (struct uxfs_inode_info *) foo;
 
 	inode_init_once(&ui->vfs_inode);
+	INIT_LIST_HEAD(&ui->i_orphan);
 }
 
 static int __init init_inodecache(void)
@@ -265,6 +679,11 @@ struct super_operations uxfs_sops = {
 	.write_inode    = ux_write_inode,
 	.evict_inode    = ux_evict_inode,
 	.put_super      = ux_put_super,
+	.sync_fs        = ux_sync_fs,
+	.freeze_fs      = ux_freeze_fs,
+	.unfreeze_fs    = ux_unfreeze_fs,
+	.remount_fs     = ux_remount,
+	.show_options   = ux_show_options,
 	.statfs         = ux_statfs
 };
 
@@ -277,11 +696,13 @@ static int ux_fill_super(struct super_block *s, void *data, int silent)
 
 	int ret = -EINVAL;
 
-	fs = (struct ux_fs*)kmalloc(sizeof(struct ux_fs), GFP_KERNEL);
+	fs = (struct ux_fs*)kzalloc(sizeof(struct ux_fs), GFP_KERNEL);
 	if(!fs)
 		return -ENOMEM;
 
 	s->s_fs_info = fs;
+	mutex_init(&fs->u_orphan_lock);
+	INIT_LIST_HEAD(&fs->u_orphans);
 
 	if(!sb_set_blocksize(s, UX_BSIZE))
 		goto out;
@@ -294,42 +715,77 @@ static int ux_fill_super(struct super_block *s, void *data, int silent)
 	usb = (struct ux_superblock*)bh->b_data;
 	if(usb->s_magic != UX_MAGIC){
 		printk("unable to find ux filesystem\n");
-		goto out;
+		goto out_brelse;
+	}
+
+	if((usb->s_flags & UX_LAZY_ITABLE) &&
+	   (usb->s_inode_init <= UX_ROOT_NO || usb->s_inode_init > usb->s_ninodes)){
+		printk("uxfs: bad initialized inode count %u\n", usb->s_inode_init);
+		goto out_brelse;
 	}
 
-	if(usb->s_mode == UX_FSDIRTY){
+	if(usb->s_mode == UX_FSDIRTY && !usb->s_journal_blocks){
 		printk("filesystem is not clean, please run fsck\n");
 	}
 
+	fs->u_sb = usb;
+	fs->u_sbh = bh;
+
+	ret = ux_journal_load(s);
+	if (ret)
+		goto out_brelse;
+	ret = ux_alloc_init(s);
+	if (ret)
+		goto out_journal;
+	ret = ux_parse_options(s, data, &s->s_flags);
+	if (ret)
+		goto out_release;
+	ret = -EINVAL;
+
 	/*
 	mark the super block as dirty and wirte back to disk	
 	*/
 
-	fs->u_sb = usb;
-	fs->u_sbh = bh;
+	if (!(s->s_flags & MS_RDONLY))
+		ux_mark_dirty(s);
+
+	if (fs->u_mount_opt & UX_MOUNT_PREFETCH)
+		ux_prefetch_itable(s);
 
 	s->s_magic = UX_MAGIC;
+	s->s_maxbytes = UX_DIRECT_BLOCKS * UX_BSIZE;
+	s->s_time_gran = 1;
 	s->s_op = &uxfs_sops;
 
 	printk("try to get an inode with iget_locked\n");
-	inode = iget_locked(s, UX_ROOT_NO);
-	if(!inode){
-		goto out;
+	inode = ux_iget(s, UX_ROOT_NO);
+	if(IS_ERR(inode)){
+		ret = PTR_ERR(inode);
+		goto out_release;
 	}
 
 	printk("got inode\n");
-	ux_read_inode(inode);
-	
 	s->s_root = d_make_root(inode);
 	if(!s->s_root){
-		iput(inode);
-		goto out;
+		ret = -ENOMEM;
+		goto out_release;
 	}
 
 	printk("s_root = %p\n", s->s_root);
-	unlock_new_inode(inode);
+	if (!(s->s_flags & MS_RDONLY))
+		ux_orphan_cleanup(s);
+	else if (usb->s_orphan)
+		printk("uxfs: read-only mount, orphan inodes left in place\n");
 	return 0;
+out_release:
+	ux_alloc_release(s);
+out_journal:
+	ux_journal_release(s);
+out_brelse:
+	brelse(bh);
 out:
+	s->s_fs_info = NULL;
+	kfree(fs);
 	return ret;
 }
 
@@ -357,7 +813,10 @@ MODULE_ALIAS_FS("uxfs");
 
 static int __init init_uxfs_fs(void)
 {
-	int err = init_inodecache();
+	int err = ux_run_selftests();
+	if (err)
+		return err;
+	err = init_inodecache();
 	if (err)
 		goto out1;
 	err = register_filesystem(&uxfs_fs_type);
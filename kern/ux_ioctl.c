@@ -0,0 +1,200 @@
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/mount.h>
+#include <linux/pagemap.h>
+#include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+#include <linux/capability.h>
+#include <linux/uaccess.h>
+#include <linux/slab.h>
+#include "ux_fs.h"
+
+static int ux_ioctl_trim(struct super_block *sb, void __user *arg)
+{
+	struct request_queue *q = bdev_get_queue(sb->s_bdev);
+	struct fstrim_range range;
+	int err;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (!blk_queue_discard(q))
+		return -EOPNOTSUPP;
+	if (copy_from_user(&range, arg, sizeof(range)))
+		return -EFAULT;
+
+	range.minlen = max_t(u64, range.minlen, q->limits.discard_granularity);
+	err = ux_trim_fs(sb, &range);
+	if (err)
+		return err;
+	if (copy_to_user(arg, &range, sizeof(range)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * Point the page cache buffers of the file at the new run and write
+ * them out there. The data is copied by the write, the old blocks
+ * are left as they were.
+ */
+
+static int ux_defrag_copy(struct inode *inode, __u32 *newblk)
+{
+	struct address_space *mapping = inode->i_mapping;
+	struct buffer_head *bh, *head;
+	struct page *page;
+	pgoff_t index, last;
+	sector_t block;
+
+	last = (i_size_read(inode) - 1) >> PAGE_SHIFT;
+	for (index = 0 ; index <= last ; index++) {
+		page = read_mapping_page(mapping, index, NULL);
+		if (IS_ERR(page))
+			return PTR_ERR(page);
+		lock_page(page);
+		if (!page_has_buffers(page))
+			create_empty_buffers(page, UX_BSIZE, 0);
+		block = (sector_t)index << (PAGE_SHIFT - UX_BSIZE_BITS);
+		bh = head = page_buffers(page);
+		do {
+			if (block < UX_DIRECT_BLOCKS && newblk[block]) {
+				map_bh(bh, inode->i_sb, newblk[block]);
+				set_buffer_uptodate(bh);
+				mark_buffer_dirty(bh);
+			}
+			block++;
+			bh = bh->b_this_page;
+		} while (bh != head);
+		unlock_page(page);
+		put_page(page);
+	}
+	return filemap_write_and_wait(mapping);
+}
+
+/*
+ * Move the blocks of a file into one contiguous run. Holes stay
+ * holes. The run is only claimed in memory while the data goes to
+ * it through the page cache. Then, in a single transaction, it is
+ * marked in use, the block list is switched over and the old
+ * blocks are freed. After a crash the file has either the old
+ * layout or the new one, and the run is not lost either way.
+ */
+
+static long ux_ioctl_defrag(struct file *filp)
+{
+	struct inode *inode = file_inode(filp);
+	struct super_block *sb = inode->i_sb;
+	struct uxfs_inode_info *ui = UXFS_I(inode);
+	struct ux_handle *handle;
+	__u32 newblk[UX_DIRECT_BLOCKS], oldblk[UX_DIRECT_BLOCKS];
+	__u32 run, prev = 0, count = 0, i;
+	int frag = 0;
+	long err;
+
+	if (!S_ISREG(inode->i_mode))
+		return -EINVAL;
+	if (!(filp->f_mode & FMODE_WRITE))
+		return -EBADF;
+	err = mnt_want_write_file(filp);
+	if (err)
+		return err;
+
+	inode_lock(inode);
+	err = 0;
+	if (ui->i_flags & UX_INLINE_DATA)
+		goto out;
+	for (i = 0 ; i < UX_DIRECT_BLOCKS ; i++) {
+		if (!ui->i_addr[i])
+			continue;
+		if (count && ui->i_addr[i] != prev + 1)
+			frag = 1;
+		prev = ui->i_addr[i];
+		count++;
+	}
+	if (!frag || !i_size_read(inode))
+		goto out;
+
+	err = filemap_write_and_wait(inode->i_mapping);
+	if (err)
+		goto out;
+
+	run = ux_block_claim_run(sb, count);
+	err = -ENOSPC;
+	if (!run)
+		goto out;
+
+	memset(newblk, 0, sizeof(newblk));
+	for (i = 0, count = 0 ; i < UX_DIRECT_BLOCKS ; i++)
+		if (ui->i_addr[i])
+			newblk[i] = run + count++;
+
+	err = ux_defrag_copy(inode, newblk);
+	handle = ux_journal_start(sb, UX_TRUNCATE_CREDITS + UX_RUN_CREDITS);
+	if (IS_ERR(handle)) {
+		if (!err)
+			err = PTR_ERR(handle);
+		handle = NULL;
+	}
+	if (err) {
+
+		/*
+		 * Drop the cache, whose buffers point at the run,
+		 * so that nothing writes there once the run is given
+		 * back. The old blocks never changed and are read
+		 * again. The same goes when no handle could be had:
+		 * the block list was never switched over.
+		 */
+
+		truncate_pagecache(inode, 0);
+		ux_block_unclaim_run(sb, run, count);
+	} else {
+		ux_block_use_run(sb, run, count);
+		for (i = 0 ; i < UX_DIRECT_BLOCKS ; i++) {
+			oldblk[i] = ui->i_addr[i];
+			ui->i_addr[i] = newblk[i];
+		}
+		for (i = 0, count = 0 ; i < UX_DIRECT_BLOCKS ; i++)
+			if (oldblk[i])
+				oldblk[count++] = oldblk[i];
+		ux_block_free_batch(sb, oldblk, count);
+		ux_update_inode(inode);
+		err = count;
+	}
+	ux_journal_stop(handle);
+	if (err > 0)
+		ux_journal_commit(sb);
+out:
+	inode_unlock(inode);
+	mnt_drop_write_file(filp);
+	return err;
+}
+
+static int ux_ioctl_fragstat(struct super_block *sb, void __user *arg)
+{
+	struct ux_fragstat *st;
+	int err;
+
+	st = kmalloc(sizeof(*st), GFP_KERNEL);
+	if (!st)
+		return -ENOMEM;
+	err = ux_fragstat(sb, st);
+	if (!err && copy_to_user(arg, st, sizeof(*st)))
+		err = -EFAULT;
+	kfree(st);
+	return err;
+}
+
+long ux_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct super_block *sb = file_inode(filp)->i_sb;
+
+	switch (cmd) {
+	case FITRIM:
+		return ux_ioctl_trim(sb, (void __user *)arg);
+	case UX_IOC_DEFRAG:
+		return ux_ioctl_defrag(filp);
+	case UX_IOC_FRAGSTAT:
+		return ux_ioctl_fragstat(sb, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
@@ -0,0 +1,563 @@
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/crc32.h>
+#include <linux/blkdev.h>
+#include <linux/workqueue.h>
+#include <linux/buffer_head.h>
+#include "ux_fs.h"
+
+/*
+ * A small metadata journal. Operations run inside handles, which
+ * only reserve room in the one running transaction, so any number
+ * of them are committed together (group commit): every few seconds,
+ * at sync, at fsync, or when the transaction fills up.
+ *
+ * Metadata buffers are not dirtied while they are in the running
+ * transaction. At commit they are copied to the log, and only once
+ * the commit block is on stable storage are they written home.
+ */
+
+#define UX_COMMIT_INTERVAL (5 * HZ)
+
+static inline struct ux_journal *UX_JOURNAL(struct super_block *sb)
+{
+	return ((struct ux_fs *)sb->s_fs_info)->u_journal;
+}
+
+static __u32 ux_journal_area(struct ux_journal *j, __u32 sequence)
+{
+	return j->j_start + (sequence & 1) * j->j_half;
+}
+
+/*
+ * Check the transaction held in the log area starting at "start".
+ * Returns its sequence number if it is complete and undamaged, and
+ * then hands back its descriptor. Returns 0 otherwise.
+ */
+
+static __u32 ux_journal_check(struct super_block *sb, __u32 start, __u32 len,
+			      struct buffer_head **descp)
+{
+	struct ux_superblock	*usb = ((struct ux_fs *)sb->s_fs_info)->u_sb;
+	struct buffer_head	*dbh, *bh;
+	struct ux_journal_header *d, *c;
+	__u32			crc = ~0, seq = 0, i;
+
+	dbh = sb_bread(sb, start);
+	if (!dbh)
+		return 0;
+	d = (struct ux_journal_header *)dbh->b_data;
+	if (d->h_magic != UX_JOURNAL_MAGIC || d->h_type != UX_JDESC ||
+	    !d->h_sequence || !d->h_count ||
+	    d->h_count > UX_JDESC_BLOCKS || d->h_count + 2 > len)
+		goto out;
+
+	for (i = 0 ; i < d->h_count ; i++) {
+		if (d->h_blocknr[i] >= usb->s_journal_block)
+			goto out;
+		bh = sb_bread(sb, start + 1 + i);
+		if (!bh)
+			goto out;
+		crc = crc32_le(crc, bh->b_data, UX_BSIZE);
+		brelse(bh);
+	}
+
+	bh = sb_bread(sb, start + 1 + d->h_count);
+	if (!bh)
+		goto out;
+	c = (struct ux_journal_header *)bh->b_data;
+	if (c->h_magic == UX_JOURNAL_MAGIC && c->h_type == UX_JCOMMIT &&
+	    c->h_sequence == d->h_sequence && c->h_count == d->h_count &&
+	    c->h_checksum == crc)
+		seq = d->h_sequence;
+	brelse(bh);
+out:
+	if (seq)
+		*descp = dbh;
+	else
+		brelse(dbh);
+	return seq;
+}
+
+/*
+ * Copy the blocks of a committed transaction to their home locations.
+ */
+
+static int ux_journal_replay(struct super_block *sb, __u32 start, struct buffer_head *dbh)
+{
+	struct ux_journal_header *d = (struct ux_journal_header *)dbh->b_data;
+	struct buffer_head	*lbh, *bh;
+	__u32			i;
+	int			err = 0;
+
+	printk("uxfs: replaying journal transaction %u (%u blocks)\n",
+	       d->h_sequence, d->h_count);
+	for (i = 0 ; i < d->h_count ; i++) {
+		lbh = sb_bread(sb, start + 1 + i);
+		if (!lbh)
+			return -EIO;
+		bh = sb_getblk(sb, d->h_blocknr[i]);
+		if (!bh) {
+			brelse(lbh);
+			return -EIO;
+		}
+		lock_buffer(bh);
+		memcpy(bh->b_data, lbh->b_data, UX_BSIZE);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		if (sync_dirty_buffer(bh))
+			err = -EIO;
+		brelse(bh);
+		brelse(lbh);
+	}
+	if (!err)
+		err = blkdev_issue_flush(sb->s_bdev, GFP_KERNEL, NULL);
+	return err;
+}
+
+/*
+ * Write the running transaction to the log, then checkpoint it.
+ * Called with j_barrier held for writing, so no handle can touch
+ * the buffers meanwhile.
+ */
+
+static int ux_journal_write(struct ux_journal *j)
+{
+	struct super_block	*sb = j->j_sb;
+	__u32			start = ux_journal_area(j, j->j_sequence);
+	struct buffer_head	*dbh, *cbh, *bh;
+	struct ux_journal_header *h;
+	__u32			crc = ~0;
+	int			i, err = 0;
+
+	dbh = sb_getblk(sb, start);
+	cbh = sb_getblk(sb, start + 1 + j->j_nr);
+	if (!dbh || !cbh) {
+		brelse(dbh);
+		brelse(cbh);
+		err = -ENOMEM;
+		goto checkpoint;
+	}
+
+	lock_buffer(dbh);
+	memset(dbh->b_data, 0, UX_BSIZE);
+	h = (struct ux_journal_header *)dbh->b_data;
+	h->h_magic = UX_JOURNAL_MAGIC;
+	h->h_type = UX_JDESC;
+	h->h_sequence = j->j_sequence;
+	h->h_count = j->j_nr;
+	for (i = 0 ; i < j->j_nr ; i++)
+		h->h_blocknr[i] = j->j_bufs[i]->b_blocknr;
+	set_buffer_uptodate(dbh);
+	unlock_buffer(dbh);
+	mark_buffer_dirty(dbh);
+	write_dirty_buffer(dbh, WRITE);
+
+	for (i = 0 ; i < j->j_nr ; i++) {
+		bh = sb_getblk(sb, start + 1 + i);
+		j->j_log[i] = bh;
+		if (!bh) {
+			err = -ENOMEM;
+			continue;
+		}
+		lock_buffer(bh);
+		memcpy(bh->b_data, j->j_bufs[i]->b_data, UX_BSIZE);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		crc = crc32_le(crc, bh->b_data, UX_BSIZE);
+		mark_buffer_dirty(bh);
+		write_dirty_buffer(bh, WRITE);
+	}
+
+	wait_on_buffer(dbh);
+	if (!buffer_uptodate(dbh))
+		err = -EIO;
+	brelse(dbh);
+	for (i = 0 ; i < j->j_nr ; i++) {
+		bh = j->j_log[i];
+		if (!bh)
+			continue;
+		wait_on_buffer(bh);
+		if (!buffer_uptodate(bh))
+			err = -EIO;
+		brelse(bh);
+		j->j_log[i] = NULL;
+	}
+
+	/*
+	 * The flush ahead of the commit block makes the log copies
+	 * stable, and also the previous transaction's checkpoint,
+	 * which lives on in the other half of the log until now.
+	 */
+
+	if (!err) {
+		lock_buffer(cbh);
+		memset(cbh->b_data, 0, UX_BSIZE);
+		h = (struct ux_journal_header *)cbh->b_data;
+		h->h_magic = UX_JOURNAL_MAGIC;
+		h->h_type = UX_JCOMMIT;
+		h->h_sequence = j->j_sequence;
+		h->h_count = j->j_nr;
+		h->h_checksum = crc;
+		set_buffer_uptodate(cbh);
+		unlock_buffer(cbh);
+		mark_buffer_dirty(cbh);
+		err = __sync_dirty_buffer(cbh, WRITE_FLUSH_FUA);
+	}
+	brelse(cbh);
+
+checkpoint:
+	if (err)
+		printk("uxfs: journal commit %u failed (%d), writing metadata in place\n",
+		       j->j_sequence, err);
+	for (i = 0 ; i < j->j_nr ; i++) {
+		bh = j->j_bufs[i];
+		clear_buffer_ux_journal(bh);
+		mark_buffer_dirty(bh);
+		write_dirty_buffer(bh, WRITE);
+	}
+	for (i = 0 ; i < j->j_nr ; i++) {
+		bh = j->j_bufs[i];
+		wait_on_buffer(bh);
+		if (!buffer_uptodate(bh))
+			err = -EIO;
+		put_bh(bh);
+		j->j_bufs[i] = NULL;
+	}
+	j->j_nr = 0;
+	j->j_sequence++;
+	return err;
+}
+
+/*
+ * Stop the journal after a handle dirtied more blocks than the
+ * transaction can hold. The transaction is incomplete, so none of
+ * it may reach the disk: the filesystem goes read-only and the
+ * running transaction is dropped at the next commit. The disk
+ * keeps the state of the last commit.
+ */
+
+static void ux_journal_abort(struct ux_journal *j)
+{
+	if (j->j_aborted)
+		return;
+	j->j_aborted = 1;
+	j->j_sb->s_flags |= MS_RDONLY;
+	printk("uxfs: journal transaction overflow, aborting journal\n");
+}
+
+static void ux_journal_drop(struct ux_journal *j)
+{
+	struct buffer_head *bh;
+	int i;
+
+	for (i = 0 ; i < j->j_nr ; i++) {
+		bh = j->j_bufs[i];
+		clear_buffer_ux_journal(bh);
+		put_bh(bh);
+		j->j_bufs[i] = NULL;
+	}
+	j->j_nr = 0;
+}
+
+/*
+ * Commit the running transaction and hold off every handle until
+ * ux_journal_unlock(), so that what is on disk stays what is in
+ * memory meanwhile. Returns with the journal locked even when the
+ * commit fails. Without a journal this does nothing.
+ */
+
+int ux_journal_lock(struct super_block *sb)
+{
+	struct ux_journal *j = UX_JOURNAL(sb);
+	int err = 0;
+
+	if (!j)
+		return 0;
+	down_write(&j->j_barrier);
+	if (j->j_aborted) {
+		ux_journal_drop(j);
+		ux_discard_cancel(sb);
+		err = -EROFS;
+	} else if (j->j_nr) {
+		err = ux_journal_write(j);
+		if (err)
+			ux_discard_cancel(sb);
+		else
+			ux_discard_commit(sb);
+	}
+	return err;
+}
+
+void ux_journal_unlock(struct super_block *sb)
+{
+	struct ux_journal *j = UX_JOURNAL(sb);
+
+	if (j)
+		up_write(&j->j_barrier);
+}
+
+int ux_journal_commit(struct super_block *sb)
+{
+	int err;
+
+	err = ux_journal_lock(sb);
+	ux_journal_unlock(sb);
+	return err;
+}
+
+static void ux_journal_work(struct work_struct *work)
+{
+	struct ux_journal *j = container_of(to_delayed_work(work),
+					    struct ux_journal, j_work);
+
+	ux_journal_commit(j->j_sb);
+}
+
+/*
+ * Start a handle that may dirty up to "credits" metadata blocks.
+ * Handles nest: an operation that is already inside one joins it.
+ * A nested handle cannot wait for a commit, so it takes no credits
+ * of its own; the outermost handle reserves for everything done
+ * inside it. Starting a handle only fails once the journal has
+ * aborted. Returns NULL when the filesystem has no journal.
+ */
+
+struct ux_handle *ux_journal_start(struct super_block *sb, int credits)
+{
+	struct ux_journal *j = UX_JOURNAL(sb);
+	struct ux_handle *handle = current->journal_info;
+
+	if (!j)
+		return NULL;
+
+	/*
+	 * A handle belongs to one journal. Joining another
+	 * filesystem's would tie two transactions together, and
+	 * starting a second one could wait for a commit that waits
+	 * for the first.
+	 */
+
+	if (handle) {
+		if (WARN_ON_ONCE(handle->h_journal != j))
+			return ERR_PTR(-EIO);
+		if (j->j_aborted)
+			return ERR_PTR(-EROFS);
+		WARN_ON_ONCE(credits > handle->h_credits);
+		handle->h_ref++;
+		return handle;
+	}
+	if (credits > j->j_max)
+		return ERR_PTR(-ENOSPC);
+	handle = kmalloc(sizeof(struct ux_handle), GFP_NOFS | __GFP_NOFAIL);
+
+	for (;;) {
+		down_read(&j->j_barrier);
+		spin_lock(&j->j_lock);
+		if (j->j_aborted) {
+			spin_unlock(&j->j_lock);
+			up_read(&j->j_barrier);
+			kfree(handle);
+			return ERR_PTR(-EROFS);
+		}
+		if (j->j_nr + j->j_credits + credits <= j->j_max)
+			break;
+		spin_unlock(&j->j_lock);
+		up_read(&j->j_barrier);
+		ux_journal_commit(sb);
+	}
+	j->j_credits += credits;
+	spin_unlock(&j->j_lock);
+
+	handle->h_journal = j;
+	handle->h_credits = credits;
+	handle->h_ref = 1;
+	current->journal_info = handle;
+	return handle;
+}
+
+void ux_journal_stop(struct ux_handle *handle)
+{
+	struct ux_journal *j;
+	int nr;
+
+	if (IS_ERR_OR_NULL(handle) || --handle->h_ref)
+		return;
+	j = handle->h_journal;
+	current->journal_info = NULL;
+
+	spin_lock(&j->j_lock);
+	j->j_credits -= handle->h_credits;
+	nr = j->j_nr;
+	spin_unlock(&j->j_lock);
+	up_read(&j->j_barrier);
+	kfree(handle);
+
+	if (nr)
+		schedule_delayed_work(&j->j_work, UX_COMMIT_INTERVAL);
+}
+
+/*
+ * Add a modified metadata buffer to the running transaction. This
+ * takes the place of mark_buffer_dirty(), must be called inside a
+ * handle, which keeps a commit from running meanwhile, and may be
+ * called with spinlocks held. The handle's credits guarantee room for it, so
+ * a full transaction means a handle reserved too few, and the
+ * journal is aborted rather than let the block reach the disk
+ * outside a transaction.
+ */
+
+void ux_journal_dirty(struct super_block *sb, struct buffer_head *bh)
+{
+	struct ux_journal *j = UX_JOURNAL(sb);
+
+	if (!j) {
+		mark_buffer_dirty(bh);
+		return;
+	}
+	WARN_ON_ONCE(!current->journal_info && !j->j_aborted);
+	if (test_set_buffer_ux_journal(bh))
+		return;
+	spin_lock(&j->j_lock);
+	if (j->j_aborted || WARN_ON_ONCE(j->j_nr == j->j_max)) {
+		ux_journal_abort(j);
+		spin_unlock(&j->j_lock);
+		clear_buffer_ux_journal(bh);
+		return;
+	}
+	get_bh(bh);
+	j->j_bufs[j->j_nr++] = bh;
+	spin_unlock(&j->j_lock);
+}
+
+void ux_journal_dirty_inode(struct buffer_head *bh, struct inode *inode)
+{
+	if (!UX_JOURNAL(inode->i_sb))
+		mark_buffer_dirty_inode(bh, inode);
+	else
+		ux_journal_dirty(inode->i_sb, bh);
+}
+
+/*
+ * A metadata block is being freed. Its contents no longer matter,
+ * and logging them could overwrite the block's next owner at
+ * replay, so drop it from the running transaction.
+ */
+
+void ux_journal_forget(struct super_block *sb, struct buffer_head *bh)
+{
+	struct ux_journal *j = UX_JOURNAL(sb);
+	int i;
+
+	if (!j || !buffer_ux_journal(bh))
+		return;
+	spin_lock(&j->j_lock);
+	if (test_clear_buffer_ux_journal(bh)) {
+		for (i = 0 ; i < j->j_nr ; i++) {
+			if (j->j_bufs[i] == bh) {
+				j->j_bufs[i] = j->j_bufs[--j->j_nr];
+				put_bh(bh);
+				break;
+			}
+		}
+	}
+	spin_unlock(&j->j_lock);
+}
+
+/*
+ * Called at mount, before the maps are read. Replays the newest
+ * committed transaction, if any, and sets up the running one.
+ */
+
+int ux_journal_load(struct super_block *sb)
+{
+	struct ux_fs		*fs = (struct ux_fs *)sb->s_fs_info;
+	struct ux_superblock	*usb = fs->u_sb;
+	struct ux_journal	*j;
+	struct buffer_head	*d0 = NULL, *d1 = NULL;
+	__u32			s0, s1;
+	int			err = 0;
+
+	if (!usb->s_journal_blocks)
+		return 0;
+	if (usb->s_journal_blocks < 8 ||
+	    usb->s_journal_block < usb->s_data_block + usb->s_nblocks) {
+		printk("uxfs: bad journal location\n");
+		return -EINVAL;
+	}
+
+	j = kzalloc(sizeof(struct ux_journal), GFP_KERNEL);
+	if (!j)
+		return -ENOMEM;
+	j->j_sb = sb;
+	j->j_start = usb->s_journal_block;
+	j->j_half = usb->s_journal_blocks / 2;
+	j->j_max = min_t(__u32, UX_JDESC_BLOCKS, j->j_half - 2);
+	j->j_bufs = kcalloc(j->j_max, sizeof(struct buffer_head *), GFP_KERNEL);
+	j->j_log = kcalloc(j->j_max, sizeof(struct buffer_head *), GFP_KERNEL);
+	if (!j->j_bufs || !j->j_log) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	s0 = ux_journal_check(sb, j->j_start, j->j_half, &d0);
+	s1 = ux_journal_check(sb, j->j_start + j->j_half, j->j_half, &d1);
+	if (s0 && s1 && (__s32)(s1 - s0) > 0)
+		s0 = 0;
+
+	/*
+	 * After a clean unmount everything in the log is already home.
+	 */
+
+	if ((s0 || s1) && usb->s_mode != UX_FSCLEAN) {
+		if (bdev_read_only(sb->s_bdev)) {
+			printk("uxfs: journal needs recovery but the device is read-only\n");
+			err = -EROFS;
+			goto out;
+		}
+		if (s0)
+			err = ux_journal_replay(sb, j->j_start, d0);
+		else
+			err = ux_journal_replay(sb, j->j_start + j->j_half, d1);
+		if (err)
+			goto out;
+	}
+	j->j_sequence = (s0 ? s0 : s1) + 1;
+
+	init_rwsem(&j->j_barrier);
+	spin_lock_init(&j->j_lock);
+	INIT_DELAYED_WORK(&j->j_work, ux_journal_work);
+	fs->u_journal = j;
+out:
+	brelse(d0);
+	brelse(d1);
+	if (err) {
+		kfree(j->j_bufs);
+		kfree(j->j_log);
+		kfree(j);
+	}
+	return err;
+}
+
+/*
+ * Commit whatever is left and tear the journal down. Called at
+ * unmount, after the allocator has given back its cached blocks.
+ */
+
+void ux_journal_release(struct super_block *sb)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+	struct ux_journal *j = fs->u_journal;
+
+	if (!j)
+		return;
+	cancel_delayed_work_sync(&j->j_work);
+	ux_journal_commit(sb);
+	fs->u_journal = NULL;
+	kfree(j->j_bufs);
+	kfree(j->j_log);
+	kfree(j);
+}
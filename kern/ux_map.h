@@ -0,0 +1,334 @@
+#ifndef _UX_MAP_H
+#define _UX_MAP_H
+
+/*
+ * Allocation map and block list handling shared by the kernel and
+ * the tools, so that both allocate blocks and inodes the same way,
+ * map and truncate files the same way, and compute the online and
+ * offline fragmentation reports the same way. Include after ux_fs.h.
+ */
+
+static inline int ux_map_test(const unsigned char *map, __u32 nr)
+{
+	return (map[nr / 8] >> (nr % 8)) & 1;
+}
+
+static inline void ux_map_set(unsigned char *map, __u32 nr)
+{
+	map[nr / 8] |= 1 << (nr % 8);
+}
+
+static inline void ux_map_clear(unsigned char *map, __u32 nr)
+{
+	map[nr / 8] &= ~(1 << (nr % 8));
+}
+
+/*
+ * The kernel keeps each block of a map in its own buffer, the tools
+ * have the whole map in one piece. ux_map_next() finds the first
+ * set, or clear, bit at or after "start" within one piece, and
+ * returns "nbits" if there is none.
+ */
+
+#ifdef __KERNEL__
+typedef struct buffer_head **ux_map_t;
+
+static inline unsigned char *ux_map_block(ux_map_t map, __u32 blk)
+{
+	return (unsigned char *)map[blk]->b_data;
+}
+
+static inline __u32 ux_map_next(const void *map, __u32 nbits, __u32 start, int set)
+{
+	return set ? find_next_bit_le(map, nbits, start) :
+		     find_next_zero_bit_le(map, nbits, start);
+}
+#else
+typedef unsigned char *ux_map_t;
+
+static inline unsigned char *ux_map_block(ux_map_t map, __u32 blk)
+{
+	return map + (size_t)blk * UX_BSIZE;
+}
+
+static inline __u32 ux_map_next(const void *map, __u32 nbits, __u32 start, int set)
+{
+	const unsigned char *p = map;
+	unsigned char skip = set ? 0 : 0xff;
+
+	while (start < nbits) {
+		if (start % 8 == 0 && start + 8 <= nbits && p[start / 8] == skip) {
+			start += 8;
+			continue;
+		}
+		if (ux_map_test(p, start) == !!set)
+			return start;
+		start++;
+	}
+	return nbits;
+}
+#endif
+
+/*
+ * Same over a whole map of "nbits" bits.
+ */
+
+static inline __u32 ux_map_find(ux_map_t map, __u32 nbits, __u32 start, int set)
+{
+	__u32 blk, len, bit;
+
+	while (start < nbits) {
+		blk = start / UX_BITS_PER_BLOCK;
+		len = nbits - blk * UX_BITS_PER_BLOCK;
+		if (len > UX_BITS_PER_BLOCK)
+			len = UX_BITS_PER_BLOCK;
+		bit = ux_map_next(ux_map_block(map, blk), len, start % UX_BITS_PER_BLOCK, set);
+		if (bit < len)
+			return blk * UX_BITS_PER_BLOCK + bit;
+		start = (blk + 1) * UX_BITS_PER_BLOCK;
+	}
+	return nbits;
+}
+
+/*
+ * Blocks held in an allocation cache are still clear in the block
+ * map and are marked in "claimed", a bitmap of the data area in one
+ * piece, instead. Find the first block at or after "start" that is
+ * free in both. There are never more than a few claimed blocks, so
+ * stepping over them is cheap.
+ */
+
+static inline __u32 ux_find_free_block(ux_map_t bmap, const void *claimed, __u32 end, __u32 start)
+{
+	while ((start = ux_map_find(bmap, end, start, 0)) < end) {
+		if (!ux_map_test(claimed, start))
+			break;
+		start++;
+	}
+	return start;
+}
+
+/*
+ * Same for the first block that is in use or claimed.
+ */
+
+static inline __u32 ux_find_used_block(ux_map_t bmap, const void *claimed, __u32 end, __u32 start)
+{
+	__u32 used = ux_map_find(bmap, end, start, 1);
+	__u32 held = ux_map_next(claimed, end, start, 1);
+
+	return used < held ? used : held;
+}
+
+/*
+ * First run of "count" free blocks, or "nblocks" if there is none.
+ */
+
+static inline __u32 ux_find_free_run(ux_map_t bmap, const void *claimed, __u32 nblocks,
+				     __u32 count)
+{
+	__u32 start = 1, end;
+
+	while ((start = ux_find_free_block(bmap, claimed, nblocks, start)) < nblocks) {
+		end = ux_find_used_block(bmap, claimed, nblocks, start);
+		if (end - start >= count)
+			return start;
+		start = end;
+	}
+	return nblocks;
+}
+
+/*
+ * Claim up to "limit" free blocks, and no more than UX_ALLOC_BATCH,
+ * for an allocation cache, starting at the cache's own search
+ * position. The claims are only marked in "claimed": a block only
+ * becomes in use on disk once it is handed out. Returns the number
+ * of blocks claimed.
+ */
+
+static inline __u32 ux_cache_refill(struct ux_alloc_cache *cache, ux_map_t bmap, void *claimed,
+				    __u32 nblocks, __u32 data_block, __u32 limit)
+{
+	__u32 goal = cache->c_goal;
+	__u32 bit;
+	int wrapped = 0;
+
+	cache->c_next = 0;
+	cache->c_count = 0;
+	while (cache->c_count < UX_ALLOC_BATCH && cache->c_count < limit) {
+		bit = ux_find_free_block(bmap, claimed, nblocks, goal);
+		if (bit >= nblocks) {
+
+			/*
+			 * Wrap around to block 1. Block 0 is
+			 * for the root directory.
+			 */
+
+			if (wrapped)
+				break;
+			wrapped = 1;
+			goal = 1;
+			continue;
+		}
+		ux_map_set(claimed, bit);
+		cache->c_blocks[cache->c_count++] = data_block + bit;
+		goal = bit + 1;
+	}
+	cache->c_goal = goal;
+	return cache->c_count;
+}
+
+/*
+ * Next block of a cache, or 0 if it is empty. The caller hands it
+ * out by clearing its claim and marking it in the block map.
+ */
+
+static inline __u32 ux_cache_take(struct ux_alloc_cache *cache)
+{
+	if (cache->c_next < cache->c_count)
+		return cache->c_blocks[cache->c_next++];
+	return 0;
+}
+
+/*
+ * Give back a cache's claims. Returns how many there were.
+ */
+
+static inline __u32 ux_cache_drain(struct ux_alloc_cache *cache, void *claimed, __u32 data_block)
+{
+	__u32 n = 0;
+
+	for ( ; cache->c_next < cache->c_count ; cache->c_next++, n++)
+		ux_map_clear(claimed, cache->c_blocks[cache->c_next] - data_block);
+	return n;
+}
+
+static inline int ux_hist_bucket(__u32 len)
+{
+	int b = 0;
+
+	while ((len >>= 1) && b < UX_HIST_BUCKETS - 1)
+		b++;
+	return b;
+}
+
+static inline void ux_frag_add_free(struct ux_fragstat *st, __u32 run)
+{
+	int b = ux_hist_bucket(run);
+
+	if (!run)
+		return;
+	st->f_free_blocks += run;
+	st->f_free_extents++;
+	st->f_free_hist[b]++;
+	st->f_free_hist_blocks[b] += run;
+	if (run > st->f_free_longest)
+		st->f_free_longest = run;
+}
+
+/*
+ * Account the free runs in one block of the block map. A run that
+ * reaches the end of the block is returned, to be carried into the
+ * next block; pass the last return value to ux_frag_add_free().
+ */
+
+static inline __u32 ux_frag_scan_free(struct ux_fragstat *st, const unsigned char *map,
+				      __u32 nbits, __u32 run)
+{
+	__u32 nr = 0;
+
+	while (nr < nbits) {
+		if (nr % 8 == 0 && nr + 8 <= nbits && (map[nr / 8] == 0 || map[nr / 8] == 0xff)) {
+			if (map[nr / 8]) {
+				ux_frag_add_free(st, run);
+				run = 0;
+			} else
+				run += 8;
+			nr += 8;
+			continue;
+		}
+		if (ux_map_test(map, nr)) {
+			ux_frag_add_free(st, run);
+			run = 0;
+		} else
+			run++;
+		nr++;
+	}
+	return run;
+}
+
+/*
+ * Find the block backing logical block "lblk" of a block list, or
+ * zero for a hole. There is nothing past the last direct block, so
+ * a lookup there finds a hole and only an allocation fails.
+ */
+
+static inline int ux_bmap_lookup(const __u32 *addr, __u64 lblk, int create, __u32 *blk)
+{
+	*blk = 0;
+	if (lblk >= UX_DIRECT_BLOCKS)
+		return create ? -EFBIG : 0;
+	*blk = addr[lblk];
+	return 0;
+}
+
+/*
+ * Take every block from logical block "first" on out of a block
+ * list, into "blks". Returns how many there were; the caller frees
+ * them and adjusts i_blocks.
+ */
+
+static inline int ux_bmap_truncate(__u32 *addr, __u32 first, __u32 *blks)
+{
+	__u32 i;
+	int n = 0;
+
+	for (i = first; i < UX_DIRECT_BLOCKS; i++) {
+		if (!addr[i])
+			continue;
+		blks[n++] = addr[i];
+		addr[i] = 0;
+	}
+	return n;
+}
+
+/*
+ * Number of runs of logically and physically contiguous blocks
+ * in a block list.
+ */
+
+static inline int ux_count_extents(const __u32 *addr)
+{
+	int i, n = 0;
+
+	for (i = 0; i < UX_DIRECT_BLOCKS; i++) {
+		if (!addr[i])
+			continue;
+		if (!i || addr[i] != addr[i - 1] + 1)
+			n++;
+	}
+	return n;
+}
+
+static inline void ux_frag_add_file(struct ux_fragstat *st, const struct ux_inode *ui)
+{
+	int n, b;
+
+	if (!ui->i_mode)
+		return;
+	st->f_files++;
+	if (ui->i_flags & UX_INLINE_DATA) {
+		st->f_inline++;
+		return;
+	}
+	n = ux_count_extents(ui->i_addr);
+	if (!n)
+		return;
+	if (n > 1)
+		st->f_fragmented++;
+	b = ux_hist_bucket(n);
+	st->f_frag_hist[b]++;
+	st->f_frag_hist_blocks[b] += ui->i_blocks;
+}
+
+#endif
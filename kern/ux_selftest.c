@@ -0,0 +1,498 @@
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/bitops.h>
+#include <linux/string.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/buffer_head.h>
+#include "ux_fs.h"
+#include "ux_dirent.h"
+
+/*
+ * Self-tests for the allocator and the directory entry code, run
+ * when the module is loaded if it was built with UXFS_SELFTEST=1.
+ * They need no device, so they run as well under UML as anywhere.
+ * The superblock, the maps and the journal are built in memory:
+ * the map buffer_heads point at kmalloc'd blocks, and the journal
+ * only collects the buffers it is given, as a running transaction
+ * does, and is never committed. The tests therefore stay clear of
+ * anything that would reach the block layer, such as freeing data
+ * blocks or initializing lazy inode blocks.
+ *
+ * Each test is followed by a timing of the same path at several
+ * fill levels, reported in ns per call, so that a slowdown in these
+ * routines shows up in the load log next to the results.
+ */
+
+#define UX_TEST_MAPBITS UX_BITS_PER_BLOCK
+
+struct ux_test_fs{
+	struct super_block   t_sb;
+	struct ux_fs	     t_fs;
+	struct ux_superblock t_usb;
+	struct ux_journal    t_journal;
+	struct buffer_head   t_bh[2];
+	struct buffer_head  *t_imap[1];
+	struct buffer_head  *t_bmap[1];
+	char		     t_map[2][UX_BSIZE];
+};
+
+static int ux_test_failed;
+
+#define ux_test_check(cond)						\
+	do {								\
+		if (!(cond)) {						\
+			printk("uxfs: selftest %s:%d: %s failed\n",	\
+			       __func__, __LINE__, #cond);		\
+			ux_test_failed++;				\
+		}							\
+	} while (0)
+
+/*
+ * An in-memory filesystem with ninodes inodes and nblocks data
+ * blocks, each map in one block. Only the root inode and its
+ * directory block are in use, as after mkfs.
+ */
+
+static struct ux_test_fs *ux_test_fs_alloc(__u32 ninodes, __u32 nblocks)
+{
+	struct ux_test_fs     *t;
+	struct ux_alloc_cache *cache;
+	int		      i, cpu;
+
+	t = kzalloc(sizeof(*t), GFP_KERNEL);
+	if (!t)
+		return NULL;
+	t->t_journal.j_max = 8;
+	t->t_journal.j_bufs = kcalloc(t->t_journal.j_max, sizeof(struct buffer_head *),
+				      GFP_KERNEL);
+	t->t_fs.u_cache = alloc_percpu(struct ux_alloc_cache);
+	t->t_fs.u_claimed = kcalloc(BITS_TO_LONGS(nblocks), sizeof(unsigned long), GFP_KERNEL);
+	if (!t->t_journal.j_bufs || !t->t_fs.u_cache || !t->t_fs.u_claimed) {
+		kfree(t->t_journal.j_bufs);
+		free_percpu(t->t_fs.u_cache);
+		kfree(t->t_fs.u_claimed);
+		kfree(t);
+		return NULL;
+	}
+
+	t->t_usb.s_magic = UX_MAGIC;
+	t->t_usb.s_ninodes = ninodes;
+	t->t_usb.s_nblocks = nblocks;
+	t->t_usb.s_imap_block = UX_IMAP_BLOCK;
+	t->t_usb.s_imap_blocks = 1;
+	t->t_usb.s_bmap_block = UX_BMAP_BLOCK;
+	t->t_usb.s_bmap_blocks = 1;
+	t->t_usb.s_inode_block = UX_INODE_BLOCK;
+	t->t_usb.s_data_block = UX_FIRST_DATA_BLOCK;
+	t->t_usb.s_nifree = ninodes - UX_ROOT_NO - 1;
+	t->t_usb.s_nbfree = nblocks - 1;
+
+	for (i = 0 ; i < 2 ; i++) {
+		t->t_bh[i].b_data = t->t_map[i];
+		t->t_bh[i].b_size = UX_BSIZE;
+		t->t_bh[i].b_blocknr = i ? UX_BMAP_BLOCK : UX_IMAP_BLOCK;
+		atomic_set(&t->t_bh[i].b_count, 1);
+	}
+	t->t_imap[0] = &t->t_bh[0];
+	t->t_bmap[0] = &t->t_bh[1];
+	for (i = 0 ; i <= UX_ROOT_NO ; i++)
+		__set_bit_le(i, t->t_map[0]);
+	__set_bit_le(0, t->t_map[1]);
+
+	t->t_journal.j_sb = &t->t_sb;
+	spin_lock_init(&t->t_journal.j_lock);
+
+	t->t_fs.u_sb = &t->t_usb;
+	t->t_fs.u_imap = t->t_imap;
+	t->t_fs.u_bmap = t->t_bmap;
+	t->t_fs.u_nifree = t->t_usb.s_nifree;
+	t->t_fs.u_nbfree = t->t_usb.s_nbfree;
+	t->t_fs.u_journal = &t->t_journal;
+	spin_lock_init(&t->t_fs.u_lock);
+	init_rwsem(&t->t_fs.u_trim_sem);
+	for_each_possible_cpu(cpu) {
+		cache = per_cpu_ptr(t->t_fs.u_cache, cpu);
+		spin_lock_init(&cache->c_lock);
+		cache->c_goal = 1 + cpu * (nblocks / nr_cpu_ids);
+		cache->c_next = 0;
+		cache->c_count = 0;
+	}
+	t->t_sb.s_fs_info = &t->t_fs;
+	return t;
+}
+
+static void ux_test_fs_free(struct ux_test_fs *t)
+{
+	free_percpu(t->t_fs.u_cache);
+	kfree(t->t_fs.u_claimed);
+	kfree(t->t_journal.j_bufs);
+	kfree(t);
+}
+
+/*
+ * Mark about "fill" percent of a map's free bits as used, spread
+ * evenly, and return the number marked.
+ */
+
+static __u32 ux_test_fill(char *map, __u32 first, __u32 nbits, int fill)
+{
+	__u32 i, n = 0, acc = 0;
+
+	for (i = first ; i < nbits ; i++) {
+		acc += fill;
+		if (acc >= 100) {
+			acc -= 100;
+			if (!__test_and_set_bit_le(i, map))
+				n++;
+		}
+	}
+	return n;
+}
+
+static void ux_test_ialloc(void)
+{
+	struct ux_test_fs *t = ux_test_fs_alloc(UX_MAXFILES, UX_MAXBLOCKS);
+	struct super_block *sb;
+	ino_t		   ino;
+	__u32		   i, nbfree;
+
+	if (!t) {
+		ux_test_failed++;
+		return;
+	}
+	sb = &t->t_sb;
+	nbfree = t->t_fs.u_nbfree;
+
+	/*
+	 * Inodes come out lowest first, and allocating them leaves
+	 * the block counts alone.
+	 */
+
+	for (i = UX_ROOT_NO + 1 ; i < UX_MAXFILES ; i++) {
+		ino = ux_ialloc(sb);
+		ux_test_check(ino == i);
+		ux_test_check(t->t_fs.u_nifree == UX_MAXFILES - i - 1);
+	}
+	ux_test_check(t->t_fs.u_nbfree == nbfree);
+	ux_test_check(t->t_usb.s_nbfree == nbfree);
+	ux_test_check(ux_ialloc(sb) == 0);
+	ux_test_check(t->t_fs.u_nifree == 0);
+
+	/*
+	 * A freed inode is the next one handed out. Freeing the
+	 * root, an out of range inode or a free inode changes
+	 * nothing.
+	 */
+
+	ux_ifree(sb, 7);
+	ux_test_check(t->t_fs.u_nifree == 1);
+	ux_ifree(sb, 7);
+	ux_test_check(t->t_fs.u_nifree == 1);
+	ux_ifree(sb, UX_ROOT_NO);
+	ux_ifree(sb, UX_MAXFILES);
+	ux_test_check(t->t_fs.u_nifree == 1);
+	ux_test_check(ux_ialloc(sb) == 7);
+
+	/*
+	 * The map block was logged once, however many bits changed.
+	 */
+
+	ux_test_check(t->t_journal.j_nr == 1);
+	ux_test_check(t->t_journal.j_bufs[0] == &t->t_bh[0]);
+	ux_test_fs_free(t);
+}
+
+static __u32 ux_count_claimed(struct ux_test_fs *t)
+{
+	return bitmap_weight(t->t_fs.u_claimed, t->t_usb.s_nblocks);
+}
+
+static void ux_test_block_alloc(void)
+{
+	struct ux_test_fs *t = ux_test_fs_alloc(UX_MAXFILES, UX_MAXBLOCKS);
+	struct super_block *sb;
+	unsigned long	   *seen;
+	__u32		   blk, data, n = 0;
+
+	seen = kcalloc(BITS_TO_LONGS(UX_MAXBLOCKS), sizeof(long), GFP_KERNEL);
+	if (!t || !seen) {
+		kfree(seen);
+		if (t)
+			ux_test_fs_free(t);
+		ux_test_failed++;
+		return;
+	}
+	sb = &t->t_sb;
+	data = t->t_usb.s_data_block;
+
+	/*
+	 * Draining the caches gives their claims back, and leaves
+	 * the block that was handed out alone.
+	 */
+
+	blk = ux_block_alloc(sb);
+	ux_test_check(blk > data && blk < data + UX_MAXBLOCKS);
+	ux_alloc_drain(sb);
+	ux_test_check(ux_cached_blocks(sb) == 0);
+	ux_test_check(ux_count_claimed(t) == 0);
+	ux_test_check(t->t_fs.u_nbfree == UX_MAXBLOCKS - 2);
+	if (blk > data && blk < data + UX_MAXBLOCKS) {
+		set_bit(blk - data, seen);
+		n++;
+	}
+
+	/*
+	 * Every free block is handed out exactly once, never the
+	 * root directory's block. Blocks held in the per-CPU caches
+	 * are not lost, and are only marked in the map once they are
+	 * handed out.
+	 */
+
+	while ((blk = ux_block_alloc(sb)) != 0) {
+		ux_test_check(blk > data && blk < data + UX_MAXBLOCKS);
+		if (blk <= data || blk >= data + UX_MAXBLOCKS)
+			break;
+		ux_test_check(!test_and_set_bit(blk - data, seen));
+		ux_test_check(test_bit_le(blk - data, t->t_map[1]));
+		ux_test_check(!test_bit_le(blk - data, t->t_fs.u_claimed));
+		n++;
+		ux_test_check(t->t_fs.u_nbfree + ux_cached_blocks(sb) + n == UX_MAXBLOCKS - 1);
+		ux_test_check(ux_count_claimed(t) == ux_cached_blocks(sb));
+	}
+	ux_test_check(n == UX_MAXBLOCKS - 1);
+	ux_test_check(t->t_fs.u_nbfree == 0);
+	ux_test_check(ux_cached_blocks(sb) == 0);
+	ux_test_check(t->t_fs.u_nifree == UX_MAXFILES - UX_ROOT_NO - 1);
+
+	kfree(seen);
+	ux_test_fs_free(t);
+}
+
+static void ux_test_block_alloc_run(void)
+{
+	struct ux_test_fs *t = ux_test_fs_alloc(UX_MAXFILES, 64);
+	struct super_block *sb;
+	__u32		   data;
+
+	if (!t) {
+		ux_test_failed++;
+		return;
+	}
+	sb = &t->t_sb;
+	data = t->t_usb.s_data_block;
+
+	/*
+	 * Free runs: 1-2, 4-6, 10-63.
+	 */
+
+	__set_bit_le(3, t->t_map[1]);
+	__set_bit_le(7, t->t_map[1]);
+	__set_bit_le(8, t->t_map[1]);
+	__set_bit_le(9, t->t_map[1]);
+	t->t_fs.u_nbfree = 64 - 5;
+
+	ux_test_check(ux_block_alloc_run(sb, 3) == data + 4);
+	ux_test_check(ux_block_alloc_run(sb, 2) == data + 1);
+	ux_test_check(ux_block_alloc_run(sb, 54) == data + 10);
+	ux_test_check(ux_block_alloc_run(sb, 1) == 0);
+	ux_test_check(t->t_fs.u_nbfree == 0);
+	ux_test_fs_free(t);
+}
+
+static void ux_test_name(struct ux_dirent *de, int i)
+{
+	memset(de->d_name, 0, UX_NAMELEN);
+	snprintf(de->d_name, UX_NAMELEN, "entry%d", i);
+}
+
+static void ux_test_dirent(void)
+{
+	struct ux_dirent de[UX_DIRS_PER_BLOCK];
+	char		 name[UX_NAMELEN + 1];
+	int		 i;
+
+	memset(de, 0, sizeof(de));
+	ux_test_check(ux_dirent_free(de, UX_DIRS_PER_BLOCK) == &de[0]);
+	ux_test_check(ux_dirent_find(de, UX_DIRS_PER_BLOCK, "", 0) == NULL);
+
+	for (i = 0 ; i < UX_DIRS_PER_BLOCK ; i++) {
+		ux_test_name(&de[i], i);
+		de[i].d_ino = i + 1;
+	}
+	ux_test_check(ux_dirent_free(de, UX_DIRS_PER_BLOCK) == NULL);
+	for (i = 0 ; i < UX_DIRS_PER_BLOCK ; i++) {
+		snprintf(name, sizeof(name), "entry%d", i);
+		ux_test_check(ux_dirent_find(de, UX_DIRS_PER_BLOCK, name, strlen(name)) == &de[i]);
+	}
+
+	/*
+	 * Names match whole: "entry1" is not "entry10" or "entry".
+	 */
+
+	ux_test_check(ux_dirent_find(de, 2, "entry1", 6) == &de[1]);
+	ux_test_check(ux_dirent_find(de, UX_DIRS_PER_BLOCK, "entry", 5) == NULL);
+	ux_test_check(ux_dirent_find(&de[10], 1, "entry1", 6) == NULL);
+
+	/*
+	 * A removed entry keeps its name but is not found, and its
+	 * slot is the first free one.
+	 */
+
+	de[5].d_ino = 0;
+	ux_test_check(ux_dirent_find(de, UX_DIRS_PER_BLOCK, "entry5", 6) == NULL);
+	ux_test_check(ux_dirent_free(de, UX_DIRS_PER_BLOCK) == &de[5]);
+
+	/*
+	 * A name that fills d_name has no terminating NUL.
+	 */
+
+	memset(de[3].d_name, 'x', UX_NAMELEN);
+	memset(name, 'x', UX_NAMELEN);
+	ux_test_check(ux_dirent_find(de, UX_DIRS_PER_BLOCK, name, UX_NAMELEN) == &de[3]);
+	ux_test_check(ux_dirent_find(de, UX_DIRS_PER_BLOCK, name, UX_NAMELEN - 1) == NULL);
+}
+
+/*
+ * Timings. Each is the mean over "loops" calls.
+ */
+
+static void ux_bench_ialloc(int fill)
+{
+	struct ux_test_fs *t = ux_test_fs_alloc(UX_TEST_MAPBITS, UX_MAXBLOCKS);
+	int		  i, loops = 10000;
+	ino_t		  ino;
+	u64		  ns;
+
+	if (!t)
+		return;
+	t->t_fs.u_nifree -= ux_test_fill(t->t_map[0], UX_ROOT_NO + 1, UX_TEST_MAPBITS, fill);
+	ns = ktime_get_ns();
+	for (i = 0 ; i < loops ; i++) {
+		ino = ux_ialloc(&t->t_sb);
+		if (!ino)
+			break;
+		ux_ifree(&t->t_sb, ino);
+	}
+	ns = ktime_get_ns() - ns;
+	printk("uxfs: selftest ialloc+ifree, %d%% full: %llu ns\n", fill,
+	       (unsigned long long)ns / loops);
+	ux_test_fs_free(t);
+}
+
+/*
+ * Blocks are given back by clearing their bits directly, which is
+ * what ux_block_free() does once the buffer cache is dealt with.
+ */
+
+static void ux_bench_block_alloc(int fill)
+{
+	struct ux_test_fs *t = ux_test_fs_alloc(UX_MAXFILES, UX_TEST_MAPBITS);
+	int		  i, loops = 10000;
+	__u32		  blk, nr;
+	u64		  ns;
+
+	if (!t)
+		return;
+	t->t_fs.u_nbfree -= ux_test_fill(t->t_map[1], 1, UX_TEST_MAPBITS, fill);
+	ns = ktime_get_ns();
+	for (i = 0 ; i < loops ; i++) {
+		blk = ux_block_alloc(&t->t_sb);
+		if (!blk)
+			break;
+		nr = blk - t->t_usb.s_data_block;
+		spin_lock(&t->t_fs.u_lock);
+		__clear_bit_le(nr, t->t_map[1]);
+		t->t_fs.u_nbfree++;
+		spin_unlock(&t->t_fs.u_lock);
+	}
+	ns = ktime_get_ns() - ns;
+	printk("uxfs: selftest block alloc, %d%% full: %llu ns\n", fill,
+	       (unsigned long long)ns / loops);
+	ux_test_fs_free(t);
+}
+
+/*
+ * Lookup over a directory of UX_DIRECT_BLOCKS blocks, as
+ * ux_find_entry() walks it, for a name in the last live slot and
+ * for a missing name.
+ */
+
+static void ux_bench_lookup(int fill)
+{
+	int		 nents = UX_DIRECT_BLOCKS * UX_DIRS_PER_BLOCK;
+	int		 i, b, live = 0, last = 0, loops = 1000;
+	struct ux_dirent *de, *found = NULL;
+	char		 name[UX_NAMELEN];
+	u64		 hit, miss;
+
+	de = kcalloc(nents, sizeof(*de), GFP_KERNEL);
+	if (!de)
+		return;
+	for (i = 0 ; i < nents ; i++) {
+		ux_test_name(&de[i], i);
+		if ((i + 1) * fill / 100 > live) {
+			de[i].d_ino = i + 1;
+			live++;
+			last = i;
+		}
+	}
+	snprintf(name, sizeof(name), "entry%d", last);
+
+	hit = ktime_get_ns();
+	for (i = 0 ; i < loops ; i++)
+		for (b = 0 ; b < UX_DIRECT_BLOCKS ; b++) {
+			found = ux_dirent_find(de + b * UX_DIRS_PER_BLOCK, UX_DIRS_PER_BLOCK,
+					       name, strlen(name));
+			if (found)
+				break;
+		}
+	hit = ktime_get_ns() - hit;
+	ux_test_check(!live || found == &de[last]);
+
+	miss = ktime_get_ns();
+	for (i = 0 ; i < loops ; i++)
+		for (b = 0 ; b < UX_DIRECT_BLOCKS ; b++)
+			if (ux_dirent_find(de + b * UX_DIRS_PER_BLOCK, UX_DIRS_PER_BLOCK,
+					   "missing", 7))
+				break;
+	miss = ktime_get_ns() - miss;
+
+	printk("uxfs: selftest lookup of %d entries, %d%% live: hit %llu ns, miss %llu ns\n",
+	       nents, fill, (unsigned long long)hit / loops, (unsigned long long)miss / loops);
+	kfree(de);
+}
+
+int ux_run_selftests(void)
+{
+	static const int fills[] = { 0, 50, 90, 99 };
+	struct ux_handle handle = { .h_ref = 1 };
+	int		 i;
+
+	/*
+	 * The fake journal is never committed, so one standing handle
+	 * covers everything the tests log.
+	 */
+
+	printk("uxfs: running selftests\n");
+	current->journal_info = &handle;
+	ux_test_failed = 0;
+	ux_test_ialloc();
+	ux_test_block_alloc();
+	ux_test_block_alloc_run();
+	ux_test_dirent();
+	for (i = 0 ; i < ARRAY_SIZE(fills) ; i++) {
+		ux_bench_ialloc(fills[i]);
+		ux_bench_block_alloc(fills[i]);
+		ux_bench_lookup(fills[i] ? fills[i] : 25);
+	}
+	current->journal_info = NULL;
+	if (ux_test_failed) {
+		printk("uxfs: %d selftest checks failed\n", ux_test_failed);
+		return -EINVAL;
+	}
+	printk("uxfs: selftests passed\n");
+	return 0;
+}